@@ -0,0 +1,448 @@
+#include "audio_dsp.h"
+
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+//SSE and AVX intrinsics are only available on x86, any other CPU (like a raspberry pi) uses the scalar kernels
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AUDIO_DSP_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+//GCC and clang need to be told a function may use AVX, MSVC lets any function use the intrinsics
+#if defined(AUDIO_DSP_X86) && (defined(__GNUC__) || defined(__clang__))
+#define AUDIO_DSP_TARGET_AVX __attribute__((target("avx")))
+#else
+#define AUDIO_DSP_TARGET_AVX
+#endif
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Scalar kernels
+
+
+static void interleave_stereo_scalar(const float* left, const float* right, float* interleaved, int frames, float gain) {
+    for (int i = 0; i < frames; i++) {
+        interleaved[i * 2] = left[i] * gain;
+        interleaved[i * 2 + 1] = right[i] * gain;
+    }
+}
+
+static void apply_gain_scalar(float* samples, int count, float gain) {
+    for (int i = 0; i < count; i++) {
+        samples[i] *= gain;
+    }
+}
+
+static float dot_product_scalar(const float* a, const float* b, int count) {
+    float sum = 0.0f;
+    for (int i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static void crossfade_scalar(const float* from, const float* to, const float* weights, float* out, int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = from[i] + (to[i] - from[i]) * weights[i];
+    }
+}
+
+static void mid_channel_scalar(const float* left, const float* right, float* mid, int frames) {
+    for (int i = 0; i < frames; i++) {
+        mid[i] = (left[i] + right[i]) * 0.5f;
+    }
+}
+
+//The side channel (half the difference) is what's left with the center cancelled, it goes to the left as is and inverted to the right so the stereo image stays
+static void vocal_reduce_scalar(const float* left, const float* right, const float* bass, float* out_left, float* out_right, int frames, float amount_start, float amount_step) {
+    for (int i = 0; i < frames; i++) {
+        float amount = amount_start + amount_step * i;
+        float side = (left[i] - right[i]) * 0.5f;
+        out_left[i] = left[i] + (side + bass[i] - left[i]) * amount;
+        out_right[i] = right[i] + (bass[i] - side - right[i]) * amount;
+    }
+}
+
+
+#ifdef AUDIO_DSP_X86
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//SSE kernels, 4 samples at a time with the leftover samples done by the scalar kernel
+
+
+static void interleave_stereo_sse(const float* left, const float* right, float* interleaved, int frames, float gain) {
+    __m128 gains = _mm_set1_ps(gain);
+    int i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m128 l = _mm_mul_ps(_mm_loadu_ps(left + i), gains);
+        __m128 r = _mm_mul_ps(_mm_loadu_ps(right + i), gains);
+        _mm_storeu_ps(interleaved + i * 2, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(interleaved + i * 2 + 4, _mm_unpackhi_ps(l, r));
+    }
+    interleave_stereo_scalar(left + i, right + i, interleaved + i * 2, frames - i, gain);
+}
+
+static void apply_gain_sse(float* samples, int count, float gain) {
+    __m128 gains = _mm_set1_ps(gain);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), gains));
+    }
+    apply_gain_scalar(samples + i, count - i, gain);
+}
+
+//Four running sums are kept in one register and added together at the end
+static float dot_product_sse(const float* a, const float* b, int count) {
+    __m128 sums = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sums = _mm_add_ps(sums, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, sums);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dot_product_scalar(a + i, b + i, count - i);
+}
+
+static void crossfade_sse(const float* from, const float* to, const float* weights, float* out, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 start = _mm_loadu_ps(from + i);
+        __m128 difference = _mm_sub_ps(_mm_loadu_ps(to + i), start);
+        _mm_storeu_ps(out + i, _mm_add_ps(start, _mm_mul_ps(difference, _mm_loadu_ps(weights + i))));
+    }
+    crossfade_scalar(from + i, to + i, weights + i, out + i, count - i);
+}
+
+static void mid_channel_sse(const float* left, const float* right, float* mid, int frames) {
+    __m128 half = _mm_set1_ps(0.5f);
+    int i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        _mm_storeu_ps(mid + i, _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(left + i), _mm_loadu_ps(right + i)), half));
+    }
+    mid_channel_scalar(left + i, right + i, mid + i, frames - i);
+}
+
+static void vocal_reduce_sse(const float* left, const float* right, const float* bass, float* out_left, float* out_right, int frames, float amount_start, float amount_step) {
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 amounts = _mm_add_ps(_mm_set1_ps(amount_start), _mm_mul_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps(amount_step)));
+    __m128 amount_steps = _mm_set1_ps(amount_step * 4.0f);
+    int i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m128 l = _mm_loadu_ps(left + i);
+        __m128 r = _mm_loadu_ps(right + i);
+        __m128 b = _mm_loadu_ps(bass + i);
+        __m128 side = _mm_mul_ps(_mm_sub_ps(l, r), half);
+        _mm_storeu_ps(out_left + i, _mm_add_ps(l, _mm_mul_ps(_mm_sub_ps(_mm_add_ps(side, b), l), amounts)));
+        _mm_storeu_ps(out_right + i, _mm_add_ps(r, _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(b, side), r), amounts)));
+        amounts = _mm_add_ps(amounts, amount_steps);
+    }
+    vocal_reduce_scalar(left + i, right + i, bass + i, out_left + i, out_right + i, frames - i, amount_start + amount_step * i, amount_step);
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//AVX kernels, 8 samples at a time with the leftover samples done by the scalar kernel
+
+
+//unpacklo/unpackhi work inside each 128 bit half, so the halves are swapped back into order with permute2f128
+AUDIO_DSP_TARGET_AVX static void interleave_stereo_avx(const float* left, const float* right, float* interleaved, int frames, float gain) {
+    __m256 gains = _mm256_set1_ps(gain);
+    int i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 l = _mm256_mul_ps(_mm256_loadu_ps(left + i), gains);
+        __m256 r = _mm256_mul_ps(_mm256_loadu_ps(right + i), gains);
+        __m256 low = _mm256_unpacklo_ps(l, r);
+        __m256 high = _mm256_unpackhi_ps(l, r);
+        _mm256_storeu_ps(interleaved + i * 2, _mm256_permute2f128_ps(low, high, 0x20));
+        _mm256_storeu_ps(interleaved + i * 2 + 8, _mm256_permute2f128_ps(low, high, 0x31));
+    }
+    interleave_stereo_scalar(left + i, right + i, interleaved + i * 2, frames - i, gain);
+}
+
+AUDIO_DSP_TARGET_AVX static void apply_gain_avx(float* samples, int count, float gain) {
+    __m256 gains = _mm256_set1_ps(gain);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(samples + i, _mm256_mul_ps(_mm256_loadu_ps(samples + i), gains));
+    }
+    apply_gain_scalar(samples + i, count - i, gain);
+}
+
+AUDIO_DSP_TARGET_AVX static float dot_product_avx(const float* a, const float* b, int count) {
+    __m256 sums = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sums = _mm256_add_ps(sums, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, sums);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7] + dot_product_scalar(a + i, b + i, count - i);
+}
+
+AUDIO_DSP_TARGET_AVX static void crossfade_avx(const float* from, const float* to, const float* weights, float* out, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 start = _mm256_loadu_ps(from + i);
+        __m256 difference = _mm256_sub_ps(_mm256_loadu_ps(to + i), start);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(start, _mm256_mul_ps(difference, _mm256_loadu_ps(weights + i))));
+    }
+    crossfade_scalar(from + i, to + i, weights + i, out + i, count - i);
+}
+
+AUDIO_DSP_TARGET_AVX static void mid_channel_avx(const float* left, const float* right, float* mid, int frames) {
+    __m256 half = _mm256_set1_ps(0.5f);
+    int i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        _mm256_storeu_ps(mid + i, _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(left + i), _mm256_loadu_ps(right + i)), half));
+    }
+    mid_channel_scalar(left + i, right + i, mid + i, frames - i);
+}
+
+AUDIO_DSP_TARGET_AVX static void vocal_reduce_avx(const float* left, const float* right, const float* bass, float* out_left, float* out_right, int frames, float amount_start, float amount_step) {
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 amounts = _mm256_add_ps(_mm256_set1_ps(amount_start), _mm256_mul_ps(_mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f), _mm256_set1_ps(amount_step)));
+    __m256 amount_steps = _mm256_set1_ps(amount_step * 8.0f);
+    int i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 l = _mm256_loadu_ps(left + i);
+        __m256 r = _mm256_loadu_ps(right + i);
+        __m256 b = _mm256_loadu_ps(bass + i);
+        __m256 side = _mm256_mul_ps(_mm256_sub_ps(l, r), half);
+        _mm256_storeu_ps(out_left + i, _mm256_add_ps(l, _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(side, b), l), amounts)));
+        _mm256_storeu_ps(out_right + i, _mm256_add_ps(r, _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(b, side), r), amounts)));
+        amounts = _mm256_add_ps(amounts, amount_steps);
+    }
+    vocal_reduce_scalar(left + i, right + i, bass + i, out_left + i, out_right + i, frames - i, amount_start + amount_step * i, amount_step);
+}
+
+
+//Checks that the CPU has AVX and that the operating system saves the AVX registers between threads
+static bool cpu_supports_avx() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) {
+        return false;
+    }
+    return (_xgetbv(0) & 0x6) == 0x6;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+
+#endif
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Kernel selection and benchmark
+
+
+static const Audio_Kernels scalar_kernels = { "scalar", interleave_stereo_scalar, apply_gain_scalar, dot_product_scalar, crossfade_scalar, mid_channel_scalar, vocal_reduce_scalar };
+#ifdef AUDIO_DSP_X86
+//SSE2 is part of every x86-64 CPU so the SSE kernels never need checking for
+static const Audio_Kernels sse_kernels = { "SSE", interleave_stereo_sse, apply_gain_sse, dot_product_sse, crossfade_sse, mid_channel_sse, vocal_reduce_sse };
+static const Audio_Kernels avx_kernels = { "AVX", interleave_stereo_avx, apply_gain_avx, dot_product_avx, crossfade_avx, mid_channel_avx, vocal_reduce_avx };
+#endif
+
+Audio_Kernels audio_kernels = scalar_kernels;
+
+
+//Picks the widest kernels the CPU can run, called once at startup before any audio is decoded
+void select_audio_kernels() {
+    audio_kernels = scalar_kernels;
+#ifdef AUDIO_DSP_X86
+    audio_kernels = sse_kernels;
+    if (cpu_supports_avx()) {
+        audio_kernels = avx_kernels;
+    }
+#endif
+    std::cout << "Audio kernels: " << audio_kernels.name << std::endl;
+}
+
+
+//Times every version of the kernels on a second of stereo audio, repeated enough to get past timer resolution, and prints the speedup over the scalar loop
+void benchmark_audio_kernels() {
+    const int frames = 48000;
+    const int repeats = 2000;
+    std::vector<float> left(frames), right(frames), interleaved(frames * 2), weights(frames), mid(frames);
+    for (int i = 0; i < frames; i++) {
+        left[i] = (i % 200) / 100.0f - 1.0f;
+        right[i] = (i % 300) / 150.0f - 1.0f;
+        weights[i] = (float)i / frames;
+    }
+
+    std::vector<Audio_Kernels> kernel_sets = { scalar_kernels };
+#ifdef AUDIO_DSP_X86
+    kernel_sets.push_back(sse_kernels);
+    if (cpu_supports_avx()) {
+        kernel_sets.push_back(avx_kernels);
+    }
+#endif
+
+    double scalar_interleave = 0.0;
+    double scalar_gain = 0.0;
+    double scalar_dot = 0.0;
+    double scalar_crossfade = 0.0;
+    double scalar_vocal = 0.0;
+    //Volatile so the compiler can't throw the dot products away
+    volatile float dot_sink = 0.0f;
+    for (Audio_Kernels& kernels : kernel_sets) {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+            kernels.interleave_stereo(left.data(), right.data(), interleaved.data(), frames, 0.5f);
+        }
+        double interleave_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+            //Alternating gains keep the samples from running off to zero or infinity
+            kernels.apply_gain(interleaved.data(), frames * 2, (r & 1) ? 2.0f : 0.5f);
+        }
+        double gain_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+            dot_sink = kernels.dot_product(left.data(), right.data(), frames);
+        }
+        double dot_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        (void)dot_sink;
+
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+            kernels.crossfade(left.data(), right.data(), weights.data(), interleaved.data() + (r & 1) * frames, frames);
+        }
+        double crossfade_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        //Both vocal reduction kernels together, writing back over the interleaved buffer's two halves
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+            kernels.mid_channel(left.data(), right.data(), mid.data(), frames);
+            kernels.vocal_reduce(left.data(), right.data(), mid.data(), interleaved.data(), interleaved.data() + frames, frames, 0.0f, 1.0f / frames);
+        }
+        double vocal_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (scalar_interleave == 0.0) {
+            scalar_interleave = interleave_seconds;
+            scalar_gain = gain_seconds;
+            scalar_dot = dot_seconds;
+            scalar_crossfade = crossfade_seconds;
+            scalar_vocal = vocal_seconds;
+        }
+
+        double samples = (double)frames * 2 * repeats;
+        double block_samples = (double)frames * repeats;
+        std::cout << kernels.name << ": interleave " << samples / interleave_seconds / 1e6 << " Msamples/s (" << scalar_interleave / interleave_seconds << "x), gain "
+            << samples / gain_seconds / 1e6 << " Msamples/s (" << scalar_gain / gain_seconds << "x), dot product "
+            << block_samples / dot_seconds / 1e6 << " Msamples/s (" << scalar_dot / dot_seconds << "x), crossfade "
+            << block_samples / crossfade_seconds / 1e6 << " Msamples/s (" << scalar_crossfade / crossfade_seconds << "x), vocal reduction "
+            << samples / vocal_seconds / 1e6 << " Msamples/s (" << scalar_vocal / vocal_seconds << "x)" << std::endl;
+    }
+
+    //The whole filter with the selected kernels, including the per sample bass low pass
+    //frames is one second of audio, so the filter is set up for that rate
+    vocal_reduction_filter filter;
+    filter.configure(frames);
+    const float* out_left;
+    const float* out_right;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++) {
+        filter.process(left.data(), right.data(), frames, true, &out_left, &out_right);
+    }
+    double filter_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Vocal reduction filter (" << audio_kernels.name << "): " << (double)frames * 2 * repeats / filter_seconds / 1e6 << " Msamples/s, "
+        << (double)repeats / filter_seconds << "x real time" << std::endl;
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Vocal reduction
+
+
+//Bass under this stays in the middle when the center channel is cancelled
+static const double BASS_CUTOFF_HZ = 150.0;
+
+//Switching on or off fades over this long
+static const double VOCAL_RAMP_SECONDS = 0.05;
+
+
+//Works out the low pass coefficients (a second order Butterworth, from the RBJ audio EQ cookbook) for the output rate and clears the filter's state
+void vocal_reduction_filter::configure(int sample_rate) {
+    double w0 = 2.0 * 3.14159265358979 * BASS_CUTOFF_HZ / sample_rate;
+    double alpha = sin(w0) / (2.0 * 0.7071);
+    double a0 = 1.0 + alpha;
+    b0 = (float)((1.0 - cos(w0)) / 2.0 / a0);
+    b1 = (float)((1.0 - cos(w0)) / a0);
+    b2 = b0;
+    a1 = (float)(-2.0 * cos(w0) / a0);
+    a2 = (float)((1.0 - alpha) / a0);
+    x1 = x2 = y1 = y2 = 0.0f;
+    amount = 0.0f;
+    ramp_frames = std::max(1, (int)(sample_rate * VOCAL_RAMP_SECONDS));
+}
+
+
+void vocal_reduction_filter::low_pass(const float* input, float* output, int frames) {
+    for (int i = 0; i < frames; i++) {
+        float y = b0 * input[i] + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+        x2 = x1;
+        x1 = input[i];
+        y2 = y1;
+        y1 = y;
+        output[i] = y;
+    }
+}
+
+
+//Filters one block of planes, ramping towards fully on or fully off depending on enabled
+//Returns false and leaves the planes alone while the filter is off, otherwise out_left and out_right point at the filtered planes until the next call
+bool vocal_reduction_filter::process(const float* left, const float* right, int frames, bool enabled, const float** out_left, const float** out_right) {
+    float target = enabled ? 1.0f : 0.0f;
+    if (amount == 0.0f && target == 0.0f) {
+        x1 = x2 = y1 = y2 = 0.0f;
+        return false;
+    }
+
+    mid.resize(frames);
+    bass.resize(frames);
+    reduced_left.resize(frames);
+    reduced_right.resize(frames);
+    audio_kernels.mid_channel(left, right, mid.data(), frames);
+    low_pass(mid.data(), bass.data(), frames);
+
+    //Ramps at the full rate, a block that reaches the target before it ends holds it for the rest of the block
+    int ramp_count = 0;
+    float step = 0.0f;
+    if (amount != target) {
+        step = (target > amount ? 1.0f : -1.0f) / ramp_frames;
+        int ramp_left = (int)ceilf(fabsf(target - amount) * ramp_frames);
+        ramp_count = std::min(frames, ramp_left);
+        audio_kernels.vocal_reduce(left, right, bass.data(), reduced_left.data(), reduced_right.data(), ramp_count, amount, step);
+        amount = ramp_count == ramp_left ? target : amount + step * ramp_count;
+    }
+    if (ramp_count < frames) {
+        audio_kernels.vocal_reduce(left + ramp_count, right + ramp_count, bass.data() + ramp_count, reduced_left.data() + ramp_count, reduced_right.data() + ramp_count,
+            frames - ramp_count, amount, 0.0f);
+    }
+
+    *out_left = reduced_left.data();
+    *out_right = reduced_right.data();
+    return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <inttypes.h>
+#include <iostream>
+#include <vector>
+
+
+//Vectorized audio kernels that run on the audio decoder thread between the decoder and the audio sample ring
+//Every kernel has a scalar, SSE and AVX version and select_audio_kernels() picks the fastest one the CPU supports when the program starts
+
+//Interleaves a left and right plane into left/right sample pairs, multiplying every sample by gain on the way
+typedef void (*interleave_stereo_kernel)(const float* left, const float* right, float* interleaved, int frames, float gain);
+
+//Multiplies count samples by gain in place
+typedef void (*apply_gain_kernel)(float* samples, int count, float gain);
+
+//Sum of a[i] * b[i] over count samples
+typedef float (*dot_product_kernel)(const float* a, const float* b, int count);
+
+//Blends count samples from one block into another, out[i] = from[i] + (to[i] - from[i]) * weights[i]
+typedef void (*crossfade_kernel)(const float* from, const float* to, const float* weights, float* out, int count);
+
+//Average of the left and right planes, the mid (center) channel
+typedef void (*mid_channel_kernel)(const float* left, const float* right, float* mid, int frames);
+
+//Removes the center channel from a left and right plane, keeping bass (the low passed mid channel) in both
+//The result is blended in by amount, which starts at amount_start and goes up by amount_step every frame so switching on and off ramps instead of clicking
+typedef void (*vocal_reduce_kernel)(const float* left, const float* right, const float* bass, float* out_left, float* out_right, int frames, float amount_start, float amount_step);
+
+//Audio_Kernels object holds one version of every kernel and the name of the instruction set it was written for
+typedef struct {
+    const char* name;
+    interleave_stereo_kernel interleave_stereo;
+    apply_gain_kernel apply_gain;
+    dot_product_kernel dot_product;
+    crossfade_kernel crossfade;
+    mid_channel_kernel mid_channel;
+    vocal_reduce_kernel vocal_reduce;
+} Audio_Kernels;
+
+//External kernel table, filled by select_audio_kernels()
+extern Audio_Kernels audio_kernels;
+
+//Vocal reduction for songs that only have the original recording with vocals, on the left and right planes before they are interleaved
+//Vocals are usually mixed to the center, so the center channel is cancelled out of both sides, apart from the bass under BASS_CUTOFF_HZ which is also mostly in the center and is put back
+//The bass low pass is a biquad run per sample since each output depends on the last, everything else is the vectorized kernels above
+class vocal_reduction_filter {
+public:
+    void configure(int sample_rate);
+    bool process(const float* left, const float* right, int frames, bool enabled, const float** out_left, const float** out_right);
+
+private:
+    void low_pass(const float* input, float* output, int frames);
+
+    float b0 = 1.0f, b1 = 0.0f, b2 = 0.0f, a1 = 0.0f, a2 = 0.0f;
+    float x1 = 0.0f, x2 = 0.0f, y1 = 0.0f, y2 = 0.0f;
+    float amount = 0.0f;
+    int ramp_frames = 1;
+    std::vector<float> mid;
+    std::vector<float> bass;
+    std::vector<float> reduced_left;
+    std::vector<float> reduced_right;
+};
+
+//Kernel functions
+void select_audio_kernels();
+void benchmark_audio_kernels();
@@ -1,334 +1,2660 @@
 #include "decoding_func.h"
+#include "audio_dsp.h"
+#include "frame_cache.h"
+#include "pitch_shift.h"
+#include "mic_monitor.h"
 
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
-std::map<double, uint8_t*> video_frame_map;
-std::map<double, uint8_t*>::iterator video_frame_iterator;
-int video_width, video_height;
-std::queue<Sound_Data> sample_queue;
 
+const int VIDEO_RING_CAPACITY = 60;
+const int PACKET_QUEUE_TARGET = 50;
+const int64_t PACKET_QUEUE_MAX_BYTES = 16 * 1024 * 1024;
+const int AUDIO_RING_CAPACITY = 131072;
 
-//****************************************************************************************************************
-//****************************************************************************************************************
-// 
-//Video functions
+//Gain applied to every sample on its way into the audio sample ring
+static const float OUTPUT_GAIN = .5f;
 
+//Songs with a measured loudness are turned up or down from OUTPUT_GAIN by how far they are from REFERENCE_LUFS, boosting by no more than MAX_BOOST_DB
+//The gain is then lowered as far as it takes to keep the song's true peak at or under PEAK_CEILING, so nothing has to be limited or clipped
+static const double REFERENCE_LUFS = -14.0;
+static const double MAX_BOOST_DB = 12.0;
+static const double PEAK_CEILING = 0.89;
 
-//This function decodes the video frames of the mp4 at the filepath specified and fills the map with timestamp the frame occurs and the frame data. It also returns the width and height that the video should be streamed at. 
+//decode_audio() and seeks wait for this much audio to be decoded before the stream is started, it has to stay under AUDIO_LOOKAHEAD_SECONDS or the ring never gets there
+static const double AUDIO_PREFILL_SECONDS = 0.5;
 
-bool decode_video(const char* filepath) {
+//The audio decoder stays at most this far ahead of the callback, so a key or tempo change is heard within it rather than after the whole ring has played out
+static const double AUDIO_LOOKAHEAD_SECONDS = 0.75;
 
+//Frames per buffer of an output only stream, a duplex stream starts at mic_frames_per_buffer instead
+static const int OUTPUT_FRAMES_PER_BUFFER = 256;
 
-    //Create format context
+//When the callback runs dry this many times within the window, adapt_audio_buffer() doubles the buffer, up to the largest size
+static const double BUFFER_ADAPT_WINDOW_SECONDS = 10.0;
+static const int BUFFER_ADAPT_UNDERRUNS = 3;
+static const int MAX_FRAMES_PER_BUFFER = 4096;
 
-    const char* video_filepath = filepath;
-    AVFormatContext* av_format_context;
-    AVCodecContext* av_codec_context;
-    AVCodecParameters* av_codec_params;
-    const AVCodec* av_codec;
-    AVFrame* av_frame;
-    AVPacket* av_packet;
-    int video_stream_index;
-    AVRational time_base;
-    SwsContext* sws_scaler_context;
+//Frame buffers are aligned to the page size so each one starts on its own page
+static const size_t FRAME_BUFFER_ALIGNMENT = 4096;
 
+//A prefetched song pre-rolls this many video frames, and stops reading early if it reaches PREFETCH_MEMORY_LIMIT
+static const int PREFETCH_VIDEO_FRAMES = 3;
+const size_t PREFETCH_MEMORY_LIMIT = 64 * 1024 * 1024;
 
-    av_format_context = avformat_alloc_context();
-    if (avformat_open_input(&av_format_context, video_filepath, NULL, NULL) != 0) {
-        std::cout << "AV file not opened" << std::endl;
-    }
+video_frame_ring video_frames;
+video_frame_pool frame_pool;
+int video_width, video_height;
+bool gpu_yuv_conversion = true;
+color_matrix video_color_matrix = COLOR_MATRIX_BT709;
+bool video_full_range = false;
+audio_sample_ring audio_samples;
+int output_sample_rate = 44100;
+playback_clock audio_clock;
+audio_callback_recorder callback_recorder;
+double audio_stats_interval = 0.0;
+double crossfade_seconds = 0.0;
+double song_time_offset = 0.0;
+
+const int MAX_KEY_SHIFT = 12;
+const double MIN_TEMPO = 0.5;
+const double MAX_TEMPO = 2.0;
+
+//Key and tempo the audio decoder applies to each block, and whether it cancels the vocals, set from the main thread
+static std::atomic<int> key_shift(0);
+static std::atomic<double> tempo_setting(1.0);
+static std::atomic<bool> vocal_reduction(false);
+
+//Cost of the key and tempo stage, added to by each audio decoder thread as it finishes
+static Pitch_Stage_Stats pitch_stage_stats = { 0, 0, 0, 0.0, 0.0 };
+
+//Output_Level object is the gain a song is played at
+typedef struct {
+    float gain;
+} Output_Level;
+
+//Levels of the songs whose loudness has been given to set_song_loudness(), only used on the main thread where the audio decoders are started
+//The open song's level is picked when it opens, so a loudness that arrives while it plays doesn't change it on the next seek
+static std::map<std::string, Output_Level> song_levels;
+static Output_Level playing_level = { OUTPUT_GAIN };
+static Output_Level song_output_level();
+
+//The stream that is playing, its output latency, and when it was started for songs without audio
+static PaStream* playing_stream = NULL;
+static double playing_output_latency = 0.0;
+static std::chrono::steady_clock::time_point playback_started;
+
+//Buffer size adapt_audio_buffer() has stepped up to (0 until it has), it carries over to the streams opened for later songs
+//The window counts the underruns since it started, from the snapshot taken then
+static int adapted_frames_per_buffer = 0;
+static int buffer_increases = 0;
+static std::chrono::steady_clock::time_point adapt_window_start;
+static int64_t adapt_window_underruns = 0;
+static std::chrono::steady_clock::time_point last_stats_log;
+
+packet_queue video_packets;
+packet_queue audio_packets;
+Song_Streams song_streams = { -1, -1, NULL, NULL, { 0, 1 }, { 0, 1 } };
+Demux_Stats demux_stats = { 0, 0, 0.0 };
+keyframe_index song_keyframes;
+Seek_Stats seek_stats = { 0, 0, 0.0, 0.0 };
+
+//A seek seek_song() has started that seek_ready() hasn't seen finish yet, whether the audio stream has to be started again when it does, and where it was headed
+static bool seek_pending = false;
+static bool seek_resume_audio = false;
+static double seek_target = 0.0;
+static std::chrono::steady_clock::time_point seek_started;
+
+//Whether song_keyframes came from the song's saved index, and whether a seek jumped past the keyframes seen so far leaving a gap in it
+//Only an index the demuxer built from start to end without a gap is saved
+static bool keyframe_index_loaded = false;
+static bool keyframe_index_gap = false;
+
+//While seeking, the decoder skips non-reference frames until it is this close to the target
+static const double SEEK_SKIP_MARGIN = 0.5;
+
+//playback_time() holds here until the first buffer after a song starts or seeks has been played
+static double clock_hold_time = 0.0;
+
+//Background thread that reads every packet of the song once and sorts them into video_packets and audio_packets
+static std::thread demuxer_thread;
+static AVFormatContext* song_format_context = NULL;
+static std::atomic<bool> demuxer_stopping(false);
+static std::mutex demuxer_mutex;
+static std::condition_variable demuxer_wakeup;
+
+//Path of the open song, and whether its video is being read from the frame cache so the demuxer can drop its video packets
+static std::string song_path;
+static mapped_frame_cache cached_frames;
+static std::atomic<bool> demuxer_skip_video(false);
+static bool video_from_cache = false;
+
+//Background thread that decodes video frames into video_frames while the song plays
+static std::thread video_decoder_thread;
+
+//Background thread that decodes audio into audio_samples while the song plays
+static std::thread audio_decoder_thread;
+static std::atomic<bool> audio_decoder_stopping(false);
+static std::atomic<bool> audio_decoder_finished(false);
+
+//Left by the audio decoder when its song finishes: the time its last sample plays at, and the samples it held back to crossfade into the next song
+//Only written by the decoder before audio_decoder_finished is set and only read after it is
+static double audio_end_time = 0.0;
+static std::vector<float> crossfade_tail;
+
+//Set while a next song is being prefetched so the audio decoder keeps its crossfade tail for it instead of playing it out
+static std::atomic<bool> next_song_expected(false);
+
+Video_Decode_Stats video_decode_stats = { 0, 0.0, 0.0, 1, 0, false };
+
+//Only used by the video decoder thread, a new one isn't started until the last has been joined
+static std::chrono::steady_clock::time_point video_decode_timer;
+
+//Threading settings for codecs that have been configured, any other codec uses default_decoder_config()
+static std::map<std::string, Decoder_Config> decoder_configs;
+static std::mutex decoder_config_mutex;
+
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
-    //Set stream index to 0 to target video frames
-    video_stream_index = 0;
-    av_codec_params = av_format_context->streams[0]->codecpar;
-    av_codec = avcodec_find_decoder(av_codec_params->codec_id);
-    
-    //Pulls video's height and width entries from the codec parameters and assign to global video_width and video_height to use later in rendering function
-    video_width = av_codec_params->width;
-    video_height = av_codec_params->height;
-    time_base = av_format_context->streams[0]->time_base;
+//Starts the video decoding counters over for a new song, only called while no video decoder thread is running
+static void reset_video_decode_stats(int thread_count, int active_thread_type, double stream_fps, bool from_cache) {
+    video_decode_stats.frames_decoded = 0;
+    video_decode_stats.decode_seconds = 0.0;
+    video_decode_stats.stream_fps = stream_fps;
+    video_decode_stats.thread_count = thread_count;
+    video_decode_stats.active_thread_type = active_thread_type;
+    video_decode_stats.from_cache = from_cache;
+}
+
+//Only the video decoder thread adds decoding time, so a load and a store can't lose another thread's addition
+static void add_video_decode_seconds(double seconds) {
+    video_decode_stats.decode_seconds.store(video_decode_stats.decode_seconds.load() + seconds);
+}
 
 
-    av_codec_context = avcodec_alloc_context3(av_codec);
+//****************************************************************************************************************
+//****************************************************************************************************************
+// 
+//Packet queues and demuxing
 
-    if (!av_codec_context) {
-        printf("Couldn't create AVCodecContext\n");
-        return false;
-    }
-    if (avcodec_parameters_to_context(av_codec_context, av_codec_params) < 0) {
-        printf("Couldn't initialize AVCodecContext\n");
-        return false;
-    }
-    if (avcodec_open2(av_codec_context, av_codec, NULL) < 0) {
-        printf("Couldn't open codec\n");
-        return false;
+
+//Frees any packets left from the previous song so the queue can be filled again
+void packet_queue::reset() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    while (!packets.empty()) {
+        AVPacket* packet = packets.front();
+        packets.pop();
+        av_packet_free(&packet);
     }
-    av_frame = av_frame_alloc();
-    if (!av_frame) {
-        printf("Couldn't allocate AVFrame\n");
+    bytes = 0;
+    finished = false;
+    stopped = false;
+}
+
+//Moves the packet's data to the back of the queue, leaving the caller's packet empty to read into again
+bool packet_queue::push(AVPacket* packet) {
+    AVPacket* queued_packet = av_packet_alloc();
+    if (queued_packet == NULL) {
         return false;
     }
-    av_packet = av_packet_alloc();
-    if (!av_packet) {
-        printf("Couldn't allocate AVPacket\n");
+    av_packet_move_ref(queued_packet, packet);
+
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    packets.push(queued_packet);
+    bytes += queued_packet->size;
+    not_empty.notify_one();
+    return true;
+}
+
+//Moves the oldest packet into the caller's packet, waiting for the demuxer if the queue is empty. Returns false once the demuxer is finished and the queue is empty
+bool packet_queue::pop(AVPacket* packet) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    not_empty.wait(lock, [this] { return !packets.empty() || finished || stopped; });
+    if (packets.empty() || stopped) {
         return false;
     }
+    AVPacket* queued_packet = packets.front();
+    packets.pop();
+    bytes -= queued_packet->size;
+    lock.unlock();
+
+    av_packet_move_ref(packet, queued_packet);
+    av_packet_free(&queued_packet);
+    demuxer_wakeup.notify_one();
+    return true;
+}
 
-    //Ensures the video_frame_map is empty before putting in video frames
-    if (!video_frame_map.empty()) {
-        std::map<double, uint8_t*> temp;
-        std::swap(video_frame_map, temp);
-    }
+bool packet_queue::has_enough() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return (int)packets.size() >= PACKET_QUEUE_TARGET || finished || stopped;
+}
 
+bool packet_queue::is_full() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return bytes >= PACKET_QUEUE_MAX_BYTES;
+}
 
-    int response;
+//Marks that no more packets are coming so pop() stops waiting once the queue drains
+void packet_queue::finish() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    finished = true;
+    not_empty.notify_all();
+}
+
+//Wakes up the decoder waiting on this queue and makes it give up, used when a song is stopped early
+void packet_queue::stop() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopped = true;
+    not_empty.notify_all();
+}
+
+
+//Runs on the demuxer thread, reading each packet of the file once and handing it to the queue for its stream
+//While both queues have enough packets buffered, or either is full, it waits (checking every 10ms) instead of reading further ahead
+
+static void demuxer_loop() {
+    AVPacket* av_packet = av_packet_alloc();
+    if (!av_packet) {
+        printf("Couldn't allocate AVPacket\n");
+        video_packets.finish();
+        audio_packets.finish();
+        return;
+    }
 
-    //Iterates through the all the frames contained in the data packet, resamples them, and places them in the map
-    while (av_read_frame(av_format_context, av_packet) >= 0) {
-        if (av_packet->stream_index != video_stream_index) {
-            av_packet_unref(av_packet);
+    while (!demuxer_stopping) {
+        if ((video_packets.has_enough() && audio_packets.has_enough()) || video_packets.is_full() || audio_packets.is_full()) {
+            std::unique_lock<std::mutex> lock(demuxer_mutex);
+            demuxer_wakeup.wait_for(lock, std::chrono::milliseconds(10));
             continue;
         }
 
-        response = avcodec_send_packet(av_codec_context, av_packet);
+        auto read_start = std::chrono::steady_clock::now();
+        int response = av_read_frame(song_format_context, av_packet);
+        demux_stats.demux_seconds += seconds_since(read_start);
         if (response < 0) {
-            printf("Failed to decode packet\n");
-            return false;
-        }
-
-        response = avcodec_receive_frame(av_codec_context, av_frame);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
-            av_packet_unref(av_packet);
-            continue;
+            //Reading to the end without skipping any of the file means every keyframe has been seen
+            if (response == AVERROR_EOF && !keyframe_index_gap) {
+                song_keyframes.set_complete(true);
+            }
             break;
         }
-        else if (response < 0) {
-            printf("Failed to decode packet\n");
-            return false;
+        demux_stats.packets_read++;
+
+        if (av_packet->stream_index == song_streams.video_stream_index) {
+            if ((av_packet->flags & AV_PKT_FLAG_KEY) && !song_keyframes.is_complete()) {
+                song_keyframes.add(av_packet->pts != AV_NOPTS_VALUE ? av_packet->pts : av_packet->dts, av_packet->pos);
+            }
+            if (!demuxer_skip_video) {
+                video_packets.push(av_packet);
+            }
         }
+        else if (av_packet->stream_index == song_streams.audio_stream_index) {
+            audio_packets.push(av_packet);
+        }
+        av_packet_unref(av_packet);
+    }
 
-        //Frame data loaded into a buffer of uint8_t
-        uint8_t* frame_data = new uint8_t[av_frame->width * av_frame->height * 4];
+    if (song_format_context->pb) {
+        demux_stats.bytes_read = song_format_context->pb->bytes_read;
+    }
+    video_packets.finish();
+    audio_packets.finish();
+    av_packet_free(&av_packet);
+}
 
-        uint8_t* dest[4] = { frame_data, NULL, NULL, NULL };
-        int dest_linesize[4] = { video_width * 4, 0, 0, 0 };
 
-        //Rescales pixel format to fit OpenGL contraints
-        sws_scaler_context = sws_getContext(av_codec_context->width, av_codec_context->height, av_codec_context->pix_fmt, av_codec_context->width, av_codec_context->height, AV_PIX_FMT_RGB0, SWS_BICUBIC, NULL, NULL, NULL);
+//64 bit FNV-1a of a string, continuing from hash to cover several strings. Files saved on disk are named with it since it's the same on every build, unlike std::hash
+uint64_t fnv1a_hash(const char* text, uint64_t hash) {
+    for (; *text != '\0'; text++) {
+        hash ^= (uint8_t)*text;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-        if (sws_scaler_context == NULL) {
-            std::cout << "PROBLEM WITH SWS SCALER" << std::endl;
-        }
+//Size and modification time of a song file, stored with anything saved about the song so it is thrown away if the file is replaced
+bool song_file_identity(const std::string& filepath, int64_t& size, int64_t& time) {
+    std::error_code error;
+    size = (int64_t)std::filesystem::file_size(filepath, error);
+    if (error) {
+        return false;
+    }
+    time = (int64_t)std::filesystem::last_write_time(filepath, error).time_since_epoch().count();
+    return !error;
+}
 
-        response = sws_scale(sws_scaler_context, av_frame->data, av_frame->linesize, 0, av_codec_context->height, dest, dest_linesize);
-        if (response < 0) {
-            printf("sws_scale failed");
-        }
 
-        //Stores time and frame data as a pair in our global map variable
-        video_frame_map.insert(std::pair<double, uint8_t*>((int)((av_frame->pts * (double)time_base.num / (double)time_base.den) * 1000.0) / 1000.0, frame_data));
+//****************    Keyframe index
+
+static const char KEYFRAME_INDEX_MAGIC[4] = { 'K', 'F', 'I', '1' };
+
+void keyframe_index::reset() {
+    keyframes.clear();
+    complete = false;
+}
+
+//Keyframes can be seen again after seeking back, so each one is put in its place and duplicates are ignored
+void keyframe_index::add(int64_t pts, int64_t position) {
+    if (pts == AV_NOPTS_VALUE) {
+        return;
+    }
+    if (keyframes.empty() || pts > keyframes.back().pts) {
+        keyframes.push_back({ pts, position });
+        return;
     }
-    av_packet_unref(av_packet);
+    auto place = std::lower_bound(keyframes.begin(), keyframes.end(), pts, [](const Keyframe& keyframe, int64_t value) { return keyframe.pts < value; });
+    if (place == keyframes.end() || place->pts != pts) {
+        keyframes.insert(place, { pts, position });
+    }
+}
 
-    //Set video iterator to beginning of the new video_frame_map
-    video_frame_iterator = video_frame_map.begin();
-    
+//Finds the last keyframe at or before target_pts, returns false if the target is past the keyframes seen so far and a later one might be closer
+bool keyframe_index::find(int64_t target_pts, Keyframe& keyframe) {
+    if (keyframes.empty() || (target_pts > keyframes.back().pts && !complete)) {
+        return false;
+    }
+    auto after = std::upper_bound(keyframes.begin(), keyframes.end(), target_pts, [](int64_t value, const Keyframe& keyframe) { return value < keyframe.pts; });
+    keyframe = after == keyframes.begin() ? keyframes.front() : *(after - 1);
     return true;
 }
 
+//Reads an index saved by save(), only if it was saved for the same version of the song file
+bool keyframe_index::load(const std::string& path, int64_t source_size, int64_t source_time) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[4];
+    int64_t header[3];
+    bool loaded = fread(magic, 1, 4, file) == 4 && memcmp(magic, KEYFRAME_INDEX_MAGIC, 4) == 0 && fread(header, sizeof(int64_t), 3, file) == 3
+        && header[0] == source_size && header[1] == source_time && header[2] >= 0;
+    std::vector<Keyframe> saved_keyframes;
+    if (loaded) {
+        saved_keyframes.resize((size_t)header[2]);
+        loaded = fread(saved_keyframes.data(), sizeof(Keyframe), saved_keyframes.size(), file) == saved_keyframes.size();
+    }
+    fclose(file);
+    if (loaded) {
+        keyframes.swap(saved_keyframes);
+        complete = true;
+    }
+    return loaded;
+}
 
+bool keyframe_index::save(const std::string& path, int64_t source_size, int64_t source_time) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+    int64_t header[3] = { source_size, source_time, (int64_t)keyframes.size() };
+    bool saved = fwrite(KEYFRAME_INDEX_MAGIC, 1, 4, file) == 4 && fwrite(header, sizeof(int64_t), 3, file) == 3
+        && fwrite(keyframes.data(), sizeof(Keyframe), keyframes.size(), file) == keyframes.size();
+    if (fclose(file) != 0 || !saved) {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        return false;
+    }
+    return true;
+}
 
+size_t keyframe_index::size() {
+    return keyframes.size();
+}
 
+void keyframe_index::set_complete(bool is_complete) {
+    complete = is_complete;
+}
 
+bool keyframe_index::is_complete() {
+    return complete;
+}
 
-//****************************************************************************************************************
-//****************************************************************************************************************
-// 
-//Audio functions
 
-//This callback function is called everytime a buffer needs to be filled with audio data while PaStream is running (ruding the video stream)
-//It uses the global sample_queue object to fill the output with the amount of frames per buffer needed, where every frame consists of one queue entry that consists of a Sound_Data object that contains a left and right sample for each speaker
-static int patestCallback(const void* inputBuffer, void* outputBuffer, unsigned long framesPerBuffer, const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags, void* userData) {
+//****************    Opening songs
 
-    float* output_data = (float*)outputBuffer;
+//Opens the file at filepath and finds its video and audio streams, used for both the song being started and the one being prefetched
+static bool open_song_file(const char* filepath, AVFormatContext** format_context, Song_Streams& streams) {
+    *format_context = avformat_alloc_context();
+    if (avformat_open_input(format_context, filepath, NULL, NULL) != 0) {
+        std::cout << "AV file not opened" << std::endl;
+        *format_context = NULL;
+        return false;
+    }
+    if (avformat_find_stream_info(*format_context, NULL) < 0) {
+        std::cout << "Couldn't find stream info" << std::endl;
+        avformat_close_input(format_context);
+        return false;
+    }
 
-    for (int i = 0; i < framesPerBuffer; i++) {
-        Sound_Data data = sample_queue.front();
-        *output_data++ = data.right_sound * .5;
-        *output_data++ = data.left_sound * .5;
-        sample_queue.pop();
+    //Stream indices come from the container rather than assuming video is 0 and audio is 1
+    streams.video_stream_index = av_find_best_stream(*format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    streams.audio_stream_index = av_find_best_stream(*format_context, AVMEDIA_TYPE_AUDIO, -1, streams.video_stream_index, NULL, 0);
+    streams.video_params = NULL;
+    streams.audio_params = NULL;
+    if (streams.video_stream_index >= 0) {
+        AVStream* video_stream = (*format_context)->streams[streams.video_stream_index];
+        streams.video_params = video_stream->codecpar;
+        streams.video_time_base = video_stream->time_base;
+    }
+    if (streams.audio_stream_index >= 0) {
+        AVStream* audio_stream = (*format_context)->streams[streams.audio_stream_index];
+        streams.audio_params = audio_stream->codecpar;
+        streams.audio_time_base = audio_stream->time_base;
     }
+    return true;
+}
 
 
-    return paContinue;
+//Starts the demuxer thread on song_format_context, the queues must already be reset and hold any packets that were read ahead of it
+//A queue nothing will be pushed to is finished straight away, so has_enough() doesn't keep the demuxer reading ahead for it. That's a missing stream or video played from the frame cache
+static void start_demuxer() {
+    if (song_streams.video_stream_index < 0 || demuxer_skip_video) {
+        video_packets.finish();
+    }
+    if (song_streams.audio_stream_index < 0) {
+        audio_packets.finish();
+    }
+
+    demuxer_stopping = false;
+    demuxer_thread = std::thread(demuxer_loop);
 }
 
 
+//Stops the demuxer thread and frees any packets the decoders didn't get to, leaving the file open
+static void stop_demuxer() {
+    if (demuxer_thread.joinable()) {
+        demuxer_stopping = true;
+        demuxer_wakeup.notify_all();
+        demuxer_thread.join();
+    }
+    video_packets.reset();
+    audio_packets.reset();
+}
 
 
-//This function decodes the audio frames of the mp4 at the filepath specified and fills a queue with the audio frame data
+//Where a song's saved keyframe index goes, next to the song file
+static std::string keyframe_index_path(const std::string& filepath) {
+    return filepath + ".keyframes";
+}
+
 
-bool decode_audio(const char* filepath) {
+//Starts song_keyframes for a newly opened song, from its saved index if it has one that matches the file
+static void load_song_keyframes() {
+    int64_t source_size, source_time;
+    keyframe_index_gap = false;
+    keyframe_index_loaded = song_file_identity(song_path, source_size, source_time) && song_keyframes.load(keyframe_index_path(song_path), source_size, source_time);
+}
 
-    //Create format context
 
-    const char* audio_filepath = filepath;
-    AVFormatContext* av_format_context_audio;
-    AVCodecContext* av_codec_context_audio;
-    AVCodecParameters* av_codec_params_audio;
-    const AVCodec* av_codec_audio;        
-    AVFrame* av_frame_audio;
-    AVPacket* av_packet_audio;
-    int width;
-    int height;
-    int audio_stream_index;
-    AVRational time_base;
-    SwsContext* sws_scaler_context;
+//This function opens the mp4 at the filepath specified, finds its video and audio streams, and starts the demuxer thread that feeds video_packets and audio_packets
+//Any song that is still open is closed first, along with a next song that was being prefetched
 
-    int totalSamps;
-    double SR;         
-    static const int FPB = 2048; /* Frames per buffer: 46 ms buffers. */
+bool open_song(const char* filepath) {
+    cancel_prefetch();
+    stop_audio_decoding();
+    stop_video_decoding();
+    close_song();
 
-    //Allocates context
-    av_format_context_audio = avformat_alloc_context();
-    if (avformat_open_input(&av_format_context_audio, filepath, NULL, NULL) != 0) {
-        std::cout << "AV file not opened" << std::endl;
+    if (!open_song_file(filepath, &song_format_context, song_streams)) {
+        return false;
+    }
+    song_path = filepath;
+
+    video_packets.reset();
+    audio_packets.reset();
+    song_time_offset = 0.0;
+    clock_hold_time = 0.0;
+    song_keyframes.reset();
+    load_song_keyframes();
+    demux_stats = { 0, 0, 0.0 };
+    demuxer_skip_video = false;
+
+    //Every song starts in its own key and tempo, with its vocals
+    key_shift = 0;
+    tempo_setting = 1.0;
+    vocal_reduction = false;
+    playing_level = song_output_level();
+    start_demuxer();
+    return true;
+}
+
+
+//Stops the demuxer thread, frees any packets the decoders didn't get to and closes the file
+void close_song() {
+    stop_demuxer();
+    seek_pending = false;
+
+    //An index that covers the whole file is saved so the next play of the song can seek anywhere from the start
+    int64_t source_size, source_time;
+    if (song_format_context != NULL && song_streams.video_stream_index >= 0 && !keyframe_index_loaded && song_keyframes.is_complete()
+        && song_file_identity(song_path, source_size, source_time)) {
+        song_keyframes.save(keyframe_index_path(song_path), source_size, source_time);
     }
 
+    //A song whose video had to be decoded gets a frame cache entry built for next time
+    if (song_format_context != NULL && song_streams.video_stream_index >= 0 && !video_from_cache) {
+        queue_frame_cache_build(song_path);
+    }
+    cached_frames.close();
+    video_from_cache = false;
 
-    //Identifies codec needed to decode audio type
-    audio_stream_index = 1; //Set to 1 for audio stream
-    av_codec_params_audio = av_format_context_audio->streams[audio_stream_index]->codecpar;
-    av_codec_audio = avcodec_find_decoder(av_codec_params_audio->codec_id);
+    if (song_format_context != NULL) {
+        avformat_close_input(&song_format_context);
+    }
+    song_streams.video_params = NULL;
+    song_streams.audio_params = NULL;
+}
 
-    
-    int audio_frame_size = av_codec_params_audio->frame_size;
-    time_base = av_format_context_audio->streams[audio_stream_index]->time_base;
 
-    av_codec_context_audio = avcodec_alloc_context3(av_codec_audio);
-        if (!av_codec_context_audio) {
-        printf("Couldn't create AVCodecContext\n");
-        return false;
+//Length of the open song in seconds, 0 if the container doesn't say
+double song_duration() {
+    if (song_format_context == NULL || song_format_context->duration == AV_NOPTS_VALUE) {
+        return 0.0;
     }
-    if (avcodec_parameters_to_context(av_codec_context_audio, av_codec_params_audio) < 0) {
-        printf("Couldn't initialize AVCodecContext\n");
-        return false;
+    return song_format_context->duration / (double)AV_TIME_BASE;
+}
+
+
+//How far into the current song playback is, which after a gapless change is playback_time() less the time the song started at
+double song_position() {
+    return playback_time() - song_time_offset;
+}
+
+
+//Prints how much of the file was read and how long the reads took for the last song
+void print_demux_stats() {
+    std::cout << "Demuxer: " << demux_stats.bytes_read << " bytes in " << demux_stats.packets_read << " packets, "
+        << demux_stats.demux_seconds * 1000.0 << " ms reading" << std::endl;
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+// 
+//Video frame ring
+
+
+//Clears out any frames left from the previous song and sizes the ring for the next one
+void video_frame_ring::reset(int capacity) {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    for (int i = 0; i < count; i++) {
+        release_video_frame(frames[(head + i) % frames.size()]);
     }
-    if (avcodec_open2(av_codec_context_audio, av_codec_audio, NULL) < 0) {
-        printf("Couldn't open codec\n");
+    frames.assign(capacity, Video_Frame{ 0.0, NULL, FRAME_RGB0, 0, 0, false });
+    head = 0;
+    count = 0;
+    finished = false;
+    stopped = false;
+}
+
+//Adds a frame to the back of the ring, waiting while the ring is full. Returns false if playback was stopped while waiting
+bool video_frame_ring::push(Video_Frame frame) {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    not_full.wait(lock, [this] { return count < (int)frames.size() || stopped; });
+    if (stopped) {
         return false;
     }
-    av_frame_audio = av_frame_alloc();
-    if (!av_frame_audio) {
-        printf("Couldn't allocate AVFrame\n");
+    frames[(head + count) % frames.size()] = frame;
+    count++;
+    not_empty.notify_one();
+    return true;
+}
+
+//Takes the oldest frame out of the ring, waiting while the decoder catches up. Returns false once the decoder is finished and the ring is empty
+bool video_frame_ring::pop(Video_Frame& frame) {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    not_empty.wait(lock, [this] { return count > 0 || finished || stopped; });
+    if (count == 0 || stopped) {
         return false;
     }
-    av_packet_audio = av_packet_alloc();
-    if (!av_packet_audio) {
-        printf("Couldn't allocate AVPacket\n");
+    frame = frames[head];
+    head = (head + 1) % frames.size();
+    count--;
+    not_full.notify_one();
+    return true;
+}
+
+//Copies the oldest frame without taking it out of the ring, waiting the same way pop() does
+bool video_frame_ring::front(Video_Frame& frame) {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    not_empty.wait(lock, [this] { return count > 0 || finished || stopped; });
+    if (count == 0 || stopped) {
         return false;
     }
+    frame = frames[head];
+    return true;
+}
 
-    //Keeps track of errors
-    int response;
+//Marks that the decoder has reached the end of the file so pop() stops waiting once the ring drains
+void video_frame_ring::finish() {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    finished = true;
+    not_empty.notify_all();
+}
 
-    //Make sure the sample_queue is empty to fill with new song values
-    if (!sample_queue.empty()) {
-        std::queue <Sound_Data> new_queue;
-    std:swap(sample_queue, new_queue);
-    }
+//Wakes up both sides and makes them give up, used when a song is stopped early
+void video_frame_ring::stop() {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    stopped = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+}
 
-    //Iterates through each frame of the packet of audio data, reformats the unsigned 8 bit integer format into 32 bit floats and places them into the global sample_queue
-    while (av_read_frame(av_format_context_audio, av_packet_audio) >= 0) {
-        if (av_packet_audio->stream_index != audio_stream_index) {
-            av_packet_unref(av_packet_audio);
-            continue;
-        }
+//True once pop() won't wait, because there is a frame or the decoder has finished or been stopped
+bool video_frame_ring::ready() {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    return count > 0 || finished || stopped;
+}
 
-        response = avcodec_send_packet(av_codec_context_audio, av_packet_audio);
-        if (response < 0) {
-            printf("Failed to decode packet\n");
-            return false;
-        }
+int video_frame_ring::size() {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    return count;
+}
 
-        response = avcodec_receive_frame(av_codec_context_audio, av_frame_audio);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
-            av_packet_unref(av_packet_audio);
-            continue;
-            break;
-        }
-        else if (response < 0) {
-            printf("Failed to decode packet\n");
-            return false;
-        }
 
-        SR = av_frame_audio->sample_rate; //SAMPLE RATE TO PASS TO OPEN STREAM FUNCTION
-        int bytes_per_sample = av_get_bytes_per_sample(av_codec_context_audio->sample_fmt);
-        int samples_per_frame = av_frame_audio->nb_samples;
-        int samples_sample_rate = av_frame_audio->sample_rate;
+//****************************************************************************************************************
+//****************************************************************************************************************
+// 
+//Video frame pool
+
 
-        //Calculating value for how many unsigned 8 bit integers to iterate through
-        int buffer_entries = samples_per_frame * bytes_per_sample;
+static uint8_t* allocate_frame_buffer(size_t size) {
+#ifdef _WIN32
+    return (uint8_t*)_aligned_malloc(size, FRAME_BUFFER_ALIGNMENT);
+#else
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, FRAME_BUFFER_ALIGNMENT, size) != 0) {
+        return NULL;
+    }
+    return (uint8_t*)buffer;
+#endif
+}
 
+static void free_frame_buffer(uint8_t* buffer) {
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
 
 
+//Number of bytes one frame takes in the given layout, the YUV layouts have quarter size chroma planes
+size_t frame_buffer_size(int width, int height, frame_layout layout) {
+    size_t luma_size = (size_t)width * height;
+    size_t chroma_size = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    if (layout == FRAME_YUV420P || layout == FRAME_NV12) {
+        return luma_size + chroma_size * 2;
+    }
+    return luma_size * 4;
+}
 
-        for (int x = 0; x < buffer_entries; x += 4) {
-            //Create sound data object to store the left and right samples
-            Sound_Data extracted_data;
-            extracted_data.timestamp = (int)((av_frame_audio->pts * (double)time_base.num / (double)time_base.den) * 1000.0) / 1000.0;
 
-            //Utilizes bit shifting to change the format of each sample's four unint8_t values to one 32 bit float value for both left and right samples
-            uint8_t temp_left[] = { av_frame_audio->data[0][x], av_frame_audio->data[0][x + 1], av_frame_audio->data[0][x + 2], av_frame_audio->data[0][x + 3] };
-            uint8_t temp_right[] = { av_frame_audio->data[1][x], av_frame_audio->data[1][x + 1], av_frame_audio->data[1][x + 2], av_frame_audio->data[1][x + 3] };
+//Sets the buffer size to one frame at width x height in the given layout, throwing away the idle buffers if the size changed
+//Buffers of the old size that are still out with the decoder or renderer get freed when they are released
+void video_frame_pool::configure(int width, int height, frame_layout layout) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    size_t new_size = frame_buffer_size(width, height, layout);
+    if (new_size == buffer_size) {
+        return;
+    }
+    for (uint8_t* buffer : free_buffers) {
+        owned_buffers.erase(buffer);
+        free_frame_buffer(buffer);
+    }
+    free_buffers.clear();
+    owned_buffers.clear();
+    buffer_size = new_size;
+    counters.buffers_allocated = 0;
+
+    //Mapped buffers too small for the new frames go back to the renderer to be grown
+    for (auto buffer = free_mapped.begin(); buffer != free_mapped.end();) {
+        if (mapped_buffers[*buffer] < buffer_size) {
+            unused_mapped.push_back(*buffer);
+            mapped_buffers.erase(*buffer);
+            buffer = free_mapped.erase(buffer);
+        }
+        else {
+            buffer++;
+        }
+    }
+}
 
-            //Use memcpy to load 4 unsigned 8 bit ints into one float value for each left/right sample
-            memcpy(&(extracted_data.left_sound), &temp_left, sizeof(extracted_data.left_sound));
-            memcpy(&(extracted_data.right_sound), &temp_right, sizeof(extracted_data.right_sound));
+size_t video_frame_pool::frame_size() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return buffer_size;
+}
 
-            //Add entry to queue
-            sample_queue.push(extracted_data);
+//Hands out an idle buffer, a mapped pixel buffer if the renderer has lent one, and only allocates a new one when every buffer is in use
+uint8_t* video_frame_pool::acquire() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    uint8_t* buffer;
+    if (!free_mapped.empty()) {
+        buffer = free_mapped.back();
+        free_mapped.pop_back();
+        counters.mapped_acquires++;
+    }
+    else if (!free_buffers.empty()) {
+        buffer = free_buffers.back();
+        free_buffers.pop_back();
+    }
+    else {
+        buffer = allocate_frame_buffer(buffer_size);
+        if (buffer == NULL) {
+            std::cout << "Couldn't allocate frame buffer" << std::endl;
+            return NULL;
         }
+        owned_buffers.insert(buffer);
+        counters.buffers_allocated++;
+        counters.total_allocations++;
     }
-    return true;
+    counters.total_acquires++;
+    counters.buffers_in_use++;
+    if (counters.buffers_in_use > counters.high_water_mark) {
+        counters.high_water_mark = counters.buffers_in_use;
+    }
+    return buffer;
 }
 
+//Takes a buffer back so the decoder can reuse it, buffers left over from a previous resolution are freed instead
+void video_frame_pool::release(uint8_t* frame_data) {
+    if (frame_data == NULL) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    counters.buffers_in_use--;
+    auto mapped = mapped_buffers.find(frame_data);
+    if (mapped != mapped_buffers.end()) {
+        //A frame dropped before it was uploaded, its buffer is still mapped and can be written again
+        if (mapped->second >= buffer_size) {
+            free_mapped.push_back(frame_data);
+        }
+        else {
+            unused_mapped.push_back(frame_data);
+            mapped_buffers.erase(mapped);
+        }
+    }
+    else if (owned_buffers.count(frame_data)) {
+        free_buffers.push_back(frame_data);
+    }
+    else {
+        free_frame_buffer(frame_data);
+    }
+}
 
-//This function initializes and starts the audio stream that uses the sample_queue
-void initialize_audio(PaStream** stream) {
-    PaError err;
-    PaStreamParameters  outputParameters;
+//Called on the render thread with a pixel buffer object it has just mapped, capacity is the buffer's size in bytes
+void video_frame_pool::add_mapped(uint8_t* buffer, size_t capacity) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    mapped_buffers[buffer] = capacity;
+    if (capacity >= buffer_size) {
+        free_mapped.push_back(buffer);
+    }
+    else {
+        unused_mapped.push_back(buffer);
+        mapped_buffers.erase(buffer);
+    }
+}
 
-    err = Pa_Initialize();
-    if (err != paNoError) std::cout << "Error at initialize" << std::endl;
-    outputParameters.device = Pa_GetDefaultOutputDevice();
-    outputParameters.channelCount = 2;
-    outputParameters.sampleFormat = paFloat32;
-    outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
-    outputParameters.hostApiSpecificStreamInfo = NULL;
+//Called on the render thread when it unmaps a buffer holding a frame to upload it, the frame's buffer then belongs to the renderer again instead of the pool
+bool video_frame_pool::retire_mapped(uint8_t* buffer) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (mapped_buffers.erase(buffer) == 0) {
+        return false;
+    }
+    counters.buffers_in_use--;
+    return true;
+}
 
+//Mapped buffers the pool has no use for any more, nothing is writing to them so the renderer can unmap them
+void video_frame_pool::take_unused_mapped(std::vector<uint8_t*>& buffers) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    buffers.insert(buffers.end(), unused_mapped.begin(), unused_mapped.end());
+    unused_mapped.clear();
+}
 
-    int placeholder = 1;
+//Every mapped buffer the pool isn't handing out right now, for the renderer to unmap and delete when a song is closed. No more are handed out until add_mapped() lends some again
+void video_frame_pool::take_all_mapped(std::vector<uint8_t*>& buffers) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    buffers.insert(buffers.end(), unused_mapped.begin(), unused_mapped.end());
+    unused_mapped.clear();
+    for (uint8_t* buffer : free_mapped) {
+        buffers.push_back(buffer);
+        mapped_buffers.erase(buffer);
+    }
+    free_mapped.clear();
+}
 
-    //Take PaStream object from main and starts the stream with specified output parameters and sample rate, as well as our callback function
-    err = Pa_OpenStream(&(*stream), 0, &outputParameters, 44100, 256, paClipOff, patestCallback, &placeholder);
-    if (err != paNoError) {
-        std::cout << "error after default stream" << std::endl;
+//Hands a frame's buffer back to the pool once it has been shown or thrown away, frames mapped from the frame cache have nothing to give back
+void release_video_frame(Video_Frame& frame) {
+    if (!frame.mapped) {
+        frame_pool.release(frame.frame_data);
     }
+}
 
-    //Starts the audio stream
-    err = Pa_StartStream(*stream);
-    if (err != paNoError) std::cout << "error after start stream" << std::endl;
+Frame_Pool_Stats video_frame_pool::stats() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return counters;
 }
 
+//Prints the pool counters, if total allocations stays flat from song to song then steady-state playback is not allocating
+void video_frame_pool::print_stats() {
+    Frame_Pool_Stats current = stats();
+    std::cout << "Frame pool: " << current.buffers_in_use << " in use, high water " << current.high_water_mark
+        << ", " << current.buffers_allocated << " buffers of " << buffer_size << " bytes, "
+        << current.total_allocations << " allocations for " << current.total_acquires << " frames, " << current.mapped_acquires << " decoded straight into pixel buffers" << std::endl;
+}
 
-//Stops audio stream
-void stop_audio(PaStream** stream) {
 
-    PaError err;
-    err = Pa_StopStream(*stream);
-    if (err != paNoError) std::cout << "error after sleep" << std::endl;
-    err = Pa_CloseStream(*stream);
-    if (err != paNoError) std::cout << "error after close stream" << std::endl;
-    err = Pa_Terminate();
+//****************************************************************************************************************
+//****************************************************************************************************************
+// 
+//Video functions
+
+
+//****************    Decoder configuration
+
+//Uses one decoding thread per core the machine reports, letting the codec choose frame or slice threading
+Decoder_Config default_decoder_config() {
+    int cores = (int)std::thread::hardware_concurrency();
+    Decoder_Config config;
+    config.thread_count = cores > 0 ? cores : 1;
+    config.thread_type = DECODER_THREADS_AUTO;
+    return config;
+}
+
+void set_decoder_config(const std::string& codec_name, Decoder_Config config) {
+    std::lock_guard<std::mutex> lock(decoder_config_mutex);
+    decoder_configs[codec_name] = config;
+}
 
-}
\ No newline at end of file
+Decoder_Config get_decoder_config(const std::string& codec_name) {
+    std::lock_guard<std::mutex> lock(decoder_config_mutex);
+    auto config = decoder_configs.find(codec_name);
+    if (config != decoder_configs.end()) {
+        return config->second;
+    }
+    return default_decoder_config();
+}
+
+//Sets the codec context's threading options from the codec's configuration, this has to happen before avcodec_open2
+static void apply_decoder_config(AVCodecContext* av_codec_context, const AVCodec* av_codec) {
+    Decoder_Config config = get_decoder_config(av_codec->name);
+    av_codec_context->thread_count = config.thread_count;
+    if (config.thread_type == DECODER_THREADS_FRAME) {
+        av_codec_context->thread_type = FF_THREAD_FRAME;
+    }
+    else if (config.thread_type == DECODER_THREADS_SLICE) {
+        av_codec_context->thread_type = FF_THREAD_SLICE;
+    }
+    else {
+        av_codec_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+}
+
+
+//Picks how a decoded frame will be stored, only the pixel formats the YUV shader understands skip sws_scale
+frame_layout layout_for_format(int pixel_format) {
+    if (!gpu_yuv_conversion) {
+        return FRAME_RGB0;
+    }
+    if (pixel_format == AV_PIX_FMT_YUV420P || pixel_format == AV_PIX_FMT_YUVJ420P) {
+        return FRAME_YUV420P;
+    }
+    if (pixel_format == AV_PIX_FMT_NV12) {
+        return FRAME_NV12;
+    }
+    return FRAME_RGB0;
+}
+
+//Copies rows of one plane into a tightly packed destination, in one memcpy when the source has no padding
+static uint8_t* copy_plane(uint8_t* dest, const uint8_t* source, int source_linesize, int row_bytes, int rows) {
+    if (source_linesize == row_bytes) {
+        memcpy(dest, source, (size_t)row_bytes * rows);
+    }
+    else {
+        for (int y = 0; y < rows; y++) {
+            memcpy(dest + (size_t)y * row_bytes, source + (size_t)y * source_linesize, row_bytes);
+        }
+    }
+    return dest + (size_t)row_bytes * rows;
+}
+
+
+//Time in seconds a decoded frame should be shown at, rounded to the millisecond
+//Frame threading can hand back frames without a pts, best_effort_timestamp fills those in from the packet timing
+double video_frame_timestamp(AVFrame* av_frame, AVRational time_base) {
+    int64_t pts = av_frame->best_effort_timestamp != AV_NOPTS_VALUE ? av_frame->best_effort_timestamp : av_frame->pts;
+    return (int)((pts * (double)time_base.num / (double)time_base.den) * 1000.0) / 1000.0;
+}
+
+
+//Converts one decoded frame into frame_data, a buffer of frame_buffer_size() bytes, in the given layout
+//Returns false if the frame needed the scaler and it couldn't be created
+
+bool convert_video_frame(AVFrame* av_frame, frame_layout layout, uint8_t* frame_data, SwsContext** sws_scaler_context) {
+    int response;
+
+    if (layout == FRAME_YUV420P) {
+        //Planes are copied as they are, the fragment shader does the conversion to RGB
+        int chroma_width = (av_frame->width + 1) / 2;
+        int chroma_height = (av_frame->height + 1) / 2;
+        uint8_t* plane = copy_plane(frame_data, av_frame->data[0], av_frame->linesize[0], av_frame->width, av_frame->height);
+        plane = copy_plane(plane, av_frame->data[1], av_frame->linesize[1], chroma_width, chroma_height);
+        copy_plane(plane, av_frame->data[2], av_frame->linesize[2], chroma_width, chroma_height);
+    }
+    else if (layout == FRAME_NV12) {
+        int chroma_height = (av_frame->height + 1) / 2;
+        uint8_t* plane = copy_plane(frame_data, av_frame->data[0], av_frame->linesize[0], av_frame->width, av_frame->height);
+        copy_plane(plane, av_frame->data[1], av_frame->linesize[1], ((av_frame->width + 1) / 2) * 2, chroma_height);
+    }
+    else {
+        uint8_t* dest[4] = { frame_data, NULL, NULL, NULL };
+        int dest_linesize[4] = { av_frame->width * 4, 0, 0, 0 };
+
+        //Rescales pixel format to fit OpenGL contraints, the scaler is only rebuilt if the frame size or format changes
+        *sws_scaler_context = sws_getCachedContext(*sws_scaler_context, av_frame->width, av_frame->height, (AVPixelFormat)av_frame->format, av_frame->width, av_frame->height, AV_PIX_FMT_RGB0, SWS_BICUBIC, NULL, NULL, NULL);
+
+        if (*sws_scaler_context == NULL) {
+            std::cout << "PROBLEM WITH SWS SCALER" << std::endl;
+            return false;
+        }
+
+        response = sws_scale(*sws_scaler_context, av_frame->data, av_frame->linesize, 0, av_frame->height, dest, dest_linesize);
+        if (response < 0) {
+            printf("sws_scale failed");
+        }
+    }
+    return true;
+}
+
+
+//Converts one decoded frame into a pooled buffer and pushes it into video_frames, blocking while the decoder is a full ring ahead of the playhead
+//time_offset moves the frame's timestamp onto the playback clock, which carries on from the previous song after a gapless change
+//Returns false if playback was stopped or the frame couldn't be stored
+
+static bool store_video_frame(AVFrame* av_frame, SwsContext** sws_scaler_context, AVRational time_base, double time_offset) {
+
+    //Frame data loaded into a pooled buffer of uint8_t, the pool is only reshaped if the stream changes resolution or layout
+    frame_layout layout = layout_for_format(av_frame->format);
+    frame_pool.configure(av_frame->width, av_frame->height, layout);
+    uint8_t* frame_data = frame_pool.acquire();
+    if (frame_data == NULL) {
+        return false;
+    }
+    if (!convert_video_frame(av_frame, layout, frame_data, sws_scaler_context)) {
+        frame_pool.release(frame_data);
+        return false;
+    }
+
+    Video_Frame decoded_frame;
+    decoded_frame.timestamp = video_frame_timestamp(av_frame, time_base) + time_offset;
+    decoded_frame.frame_data = frame_data;
+    decoded_frame.layout = layout;
+    decoded_frame.width = av_frame->width;
+    decoded_frame.height = av_frame->height;
+    decoded_frame.mapped = false;
+
+    //Time spent waiting for room in the ring isn't decoding time, so the clock is paused around the push
+    add_video_decode_seconds(seconds_since(video_decode_timer));
+    bool pushed = video_frames.push(decoded_frame);
+    video_decode_timer = std::chrono::steady_clock::now();
+    if (!pushed) {
+        frame_pool.release(frame_data);
+        return false;
+    }
+    video_decode_stats.frames_decoded++;
+    return true;
+}
+
+
+//Runs on the background decoder thread, decoding frames and pushing them into video_frames until the file ends or playback is stopped
+//It owns the codec context handed to it by decode_video() and frees it when it finishes, along with any frames a prefetch already decoded which go into the ring first
+//With frame threading the decoder holds on to several packets before returning the first frame, so every frame waiting after each packet is taken and the decoder is drained with a NULL packet at the end of the stream
+//After a seek the decoder starts at the keyframe before start_time, frames before start_time are decoded but never converted, and until it is near the target frames nothing else refers to aren't decoded at all
+
+static void video_decoder_loop(AVCodecContext* av_codec_context, AVRational time_base, double time_offset, double start_time, std::vector<AVFrame*> prerolled_frames) {
+
+    AVFrame* av_frame;
+    AVPacket* av_packet;
+    SwsContext* sws_scaler_context = NULL;
+    int response;
+
+    av_frame = av_frame_alloc();
+    av_packet = av_packet_alloc();
+    if (!av_frame || !av_packet) {
+        printf("Couldn't allocate AVFrame/AVPacket\n");
+        video_frames.finish();
+        return;
+    }
+
+    bool playing = true;
+    for (AVFrame* prerolled_frame : prerolled_frames) {
+        video_decode_timer = std::chrono::steady_clock::now();
+        if (playing) {
+            playing = store_video_frame(prerolled_frame, &sws_scaler_context, time_base, time_offset);
+        }
+        av_frame_free(&prerolled_frame);
+    }
+
+    if (start_time > SEEK_SKIP_MARGIN) {
+        av_codec_context->skip_frame = AVDISCARD_NONREF;
+    }
+
+    //Iterates through the all the frames contained in the video packets from the demuxer, resamples them, and places them in the ring
+    bool draining = false;
+    while (playing && !draining) {
+        draining = !video_packets.pop(av_packet);
+        video_decode_timer = std::chrono::steady_clock::now();
+
+        response = avcodec_send_packet(av_codec_context, draining ? NULL : av_packet);
+        av_packet_unref(av_packet);
+        if (response < 0 && response != AVERROR(EAGAIN)) {
+            printf("Failed to decode packet\n");
+            break;
+        }
+
+        while (playing) {
+            response = avcodec_receive_frame(av_codec_context, av_frame);
+            if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+                break;
+            }
+            else if (response < 0) {
+                printf("Failed to decode packet\n");
+                playing = false;
+                break;
+            }
+            double timestamp = video_frame_timestamp(av_frame, time_base);
+            if (timestamp >= start_time - SEEK_SKIP_MARGIN) {
+                av_codec_context->skip_frame = AVDISCARD_DEFAULT;
+            }
+            if (timestamp < start_time) {
+                seek_stats.frames_skipped++;
+            }
+            else {
+                playing = store_video_frame(av_frame, &sws_scaler_context, time_base, time_offset);
+            }
+            av_frame_unref(av_frame);
+        }
+        add_video_decode_seconds(seconds_since(video_decode_timer));
+    }
+
+    video_frames.finish();
+
+    sws_freeContext(sws_scaler_context);
+    av_packet_free(&av_packet);
+    av_frame_free(&av_frame);
+    avcodec_free_context(&av_codec_context);
+}
+
+
+//Opens a decoder for a video stream with the threading settings for its codec, or on one thread for work that shouldn't compete with playback
+//Returns NULL if it can't be opened
+AVCodecContext* open_video_decoder(AVCodecParameters* av_codec_params, bool single_thread) {
+    const AVCodec* av_codec = avcodec_find_decoder(av_codec_params->codec_id);
+    if (av_codec == NULL) {
+        printf("Unsupported codec\n");
+        return NULL;
+    }
+    AVCodecContext* av_codec_context = avcodec_alloc_context3(av_codec);
+
+    if (!av_codec_context) {
+        printf("Couldn't create AVCodecContext\n");
+        return NULL;
+    }
+    if (avcodec_parameters_to_context(av_codec_context, av_codec_params) < 0) {
+        printf("Couldn't initialize AVCodecContext\n");
+        avcodec_free_context(&av_codec_context);
+        return NULL;
+    }
+    apply_decoder_config(av_codec_context, av_codec);
+    if (single_thread) {
+        av_codec_context->thread_count = 1;
+    }
+    if (avcodec_open2(av_codec_context, av_codec, NULL) < 0) {
+        printf("Couldn't open codec\n");
+        avcodec_free_context(&av_codec_context);
+        return NULL;
+    }
+    return av_codec_context;
+}
+
+
+//Sets the size and color settings the renderer uses for the video stream that is about to play
+static void set_video_properties(AVCodecParameters* av_codec_params) {
+
+    //Pulls video's height and width entries from the codec parameters and assign to global video_width and video_height to use later in rendering function
+    video_width = av_codec_params->width;
+    video_height = av_codec_params->height;
+
+    //Picks the YUV to RGB matrix and range for the shader, streams that don't say which matrix they use are assumed to be BT.709 when HD and BT.601 otherwise
+    if (av_codec_params->color_space == AVCOL_SPC_BT709) {
+        video_color_matrix = COLOR_MATRIX_BT709;
+    }
+    else if (av_codec_params->color_space == AVCOL_SPC_BT470BG || av_codec_params->color_space == AVCOL_SPC_SMPTE170M) {
+        video_color_matrix = COLOR_MATRIX_BT601;
+    }
+    else {
+        video_color_matrix = video_height >= 720 ? COLOR_MATRIX_BT709 : COLOR_MATRIX_BT601;
+    }
+    video_full_range = av_codec_params->color_range == AVCOL_RANGE_JPEG || av_codec_params->format == AV_PIX_FMT_YUVJ420P;
+}
+
+
+//Starts the background decoder thread on an opened codec, the song's frames from start_time on go into an empty ring after any prerolled_frames
+//A new song starts its decoding counters over, a seek keeps adding to the song's
+static void start_video_decoder(AVCodecContext* av_codec_context, AVStream* video_stream, double time_offset, double start_time, std::vector<AVFrame*> prerolled_frames, bool new_song) {
+
+    //Makes sure the previous song's decoder is gone and its frames are back in the pool before filling the ring with new video frames
+    stop_video_decoding();
+
+    //The stream's frame rate is kept to compare the decoding speed against real time
+    if (new_song) {
+        AVRational frame_rate = video_stream->avg_frame_rate;
+        reset_video_decode_stats(av_codec_context->thread_count, av_codec_context->active_thread_type, frame_rate.den != 0 ? frame_rate.num / (double)frame_rate.den : 0.0, false);
+    }
+    video_frames.reset(VIDEO_RING_CAPACITY);
+    frame_pool.configure(video_width, video_height, layout_for_format(video_stream->codecpar->format));
+
+    video_decoder_thread = std::thread(video_decoder_loop, av_codec_context, video_stream->time_base, time_offset, start_time, prerolled_frames);
+}
+
+
+//Runs on the video decoder thread in place of video_decoder_loop() when the song's frames are in the frame cache
+//Frames go into the ring pointing straight at the mapped file, so there is nothing to decode or copy, and a seek only has to find the first frame at start_time in the index
+static void cached_video_loop(double time_offset, double start_time) {
+    Frame_Cache_Header header = cached_frames.header();
+    int frame_count = cached_frames.frame_count();
+    int first = 0;
+    int last = frame_count;
+    while (first < last) {
+        int middle = (first + last) / 2;
+        if (cached_frames.timestamp(middle) < start_time) {
+            first = middle + 1;
+        }
+        else {
+            last = middle;
+        }
+    }
+    for (int i = first; i < frame_count; i++) {
+        Video_Frame cached_frame;
+        cached_frame.timestamp = cached_frames.timestamp(i) + time_offset;
+        cached_frame.frame_data = cached_frames.frame(i);
+        cached_frame.layout = (frame_layout)header.layout;
+        cached_frame.width = header.width;
+        cached_frame.height = header.height;
+        cached_frame.mapped = true;
+        if (!video_frames.push(cached_frame)) {
+            break;
+        }
+        video_decode_stats.frames_decoded++;
+    }
+    video_frames.finish();
+}
+
+
+//This function opens the decoder for the video stream of the song opened by open_song() and starts the background decoder thread that fills video_frames with frames as the song plays. It also sets the width and height that the video should be streamed at. 
+//If the frame cache has the song, its frames are played from the cache instead and the demuxer drops the video packets
+
+bool decode_video() {
+
+    if (song_streams.video_stream_index < 0) {
+        std::cout << "No video stream" << std::endl;
+        return false;
+    }
+
+    set_video_properties(song_streams.video_params);
+
+    if (open_cached_frames(song_path, cached_frames)) {
+        demuxer_skip_video = true;
+        video_packets.reset();
+        video_packets.finish();
+        video_from_cache = true;
+
+        stop_video_decoding();
+        reset_video_decode_stats(0, 0, 0.0, true);
+        video_frames.reset(VIDEO_RING_CAPACITY);
+        video_decoder_thread = std::thread(cached_video_loop, song_time_offset, 0.0);
+        return true;
+    }
+    AVCodecContext* av_codec_context = open_video_decoder(song_streams.video_params, false);
+    if (av_codec_context == NULL) {
+        return false;
+    }
+
+    start_video_decoder(av_codec_context, song_format_context->streams[song_streams.video_stream_index], song_time_offset, 0.0, std::vector<AVFrame*>(), true);
+
+    return true;
+}
+
+
+//Prints how fast the last song's video decoded, a real time factor well above 1 means the decoder has plenty of headroom
+void print_video_decode_stats() {
+    if (video_decode_stats.from_cache) {
+        std::cout << "Video decoder: " << video_decode_stats.frames_decoded.load() << " frames mapped from the frame cache" << std::endl;
+        return;
+    }
+    int64_t frames_decoded = video_decode_stats.frames_decoded.load();
+    double decode_seconds = video_decode_stats.decode_seconds.load();
+    double decoded_fps = decode_seconds > 0.0 ? frames_decoded / decode_seconds : 0.0;
+    std::cout << "Video decoder: " << frames_decoded << " frames at " << decoded_fps << " fps with "
+        << video_decode_stats.thread_count << " threads ("
+        << (video_decode_stats.active_thread_type == FF_THREAD_FRAME ? "frame" : video_decode_stats.active_thread_type == FF_THREAD_SLICE ? "slice" : "none") << ")";
+    if (video_decode_stats.stream_fps > 0.0) {
+        std::cout << ", " << decoded_fps / video_decode_stats.stream_fps << "x real time";
+    }
+    std::cout << std::endl;
+}
+
+
+//Stops the background decoder thread if it is still running and waits for it to exit
+void stop_video_decoding() {
+    if (video_decoder_thread.joinable()) {
+        video_frames.stop();
+        video_packets.stop();
+        video_decoder_thread.join();
+    }
+}
+
+
+
+
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+// 
+//Audio functions
+
+//****************    Audio sample ring
+
+//Sizes the ring and clears both positions, only called while neither the decoder thread nor the audio stream is running
+void audio_sample_ring::reset(int capacity_frames, int sample_rate) {
+    samples.assign((size_t)capacity_frames * AUDIO_CHANNELS, 0.0f);
+    capacity = capacity_frames;
+    mask = capacity_frames - 1;
+    rate = sample_rate;
+    write_position = 0;
+    read_position = 0;
+    timestamp_write = 0;
+    timestamp_read = 0;
+    current_timestamp = { 0, 0.0, 1.0 };
+    played_timestamp = 0.0;
+    played_speed = 1.0;
+    underruns = 0;
+    missing = 0;
+}
+
+//Producer side, copies as many of the interleaved frames as there is room for and returns how many were copied
+int audio_sample_ring::write(const float* source, int frames) {
+    int64_t write_at = write_position.load(std::memory_order_relaxed);
+    int64_t read_at = read_position.load(std::memory_order_acquire);
+    int space = capacity - (int)(write_at - read_at);
+    if (frames > space) {
+        frames = space;
+    }
+
+    //The copy is split in two when it wraps around the end of the ring
+    int start = (int)(write_at & mask);
+    int first_part = frames < capacity - start ? frames : capacity - start;
+    memcpy(&samples[(size_t)start * AUDIO_CHANNELS], source, sizeof(float) * first_part * AUDIO_CHANNELS);
+    memcpy(&samples[0], source + (size_t)first_part * AUDIO_CHANNELS, sizeof(float) * (frames - first_part) * AUDIO_CHANNELS);
+
+    write_position.store(write_at + frames, std::memory_order_release);
+    return frames;
+}
+
+//Consumer side, copies up to frames interleaved frames out and returns how many were available
+int audio_sample_ring::read(float* dest, int frames) {
+    int64_t read_at = read_position.load(std::memory_order_relaxed);
+    int64_t write_at = write_position.load(std::memory_order_acquire);
+    int available = (int)(write_at - read_at);
+    if (frames > available) {
+        frames = available;
+    }
+
+    int start = (int)(read_at & mask);
+    int first_part = frames < capacity - start ? frames : capacity - start;
+    memcpy(dest, &samples[(size_t)start * AUDIO_CHANNELS], sizeof(float) * first_part * AUDIO_CHANNELS);
+    memcpy(dest + (size_t)first_part * AUDIO_CHANNELS, &samples[0], sizeof(float) * (frames - first_part) * AUDIO_CHANNELS);
+
+    read_at += frames;
+    read_position.store(read_at, std::memory_order_release);
+
+    //Moves the timestamp track up to the newest mark that has been reached and works out the time of the next frame to be played from it
+    int track_read = timestamp_read.load(std::memory_order_relaxed);
+    int track_write = timestamp_write.load(std::memory_order_acquire);
+    while (track_read != track_write && timestamps[track_read % TIMESTAMP_TRACK_SIZE].frame_position <= read_at) {
+        current_timestamp = timestamps[track_read % TIMESTAMP_TRACK_SIZE];
+        track_read++;
+    }
+    timestamp_read.store(track_read, std::memory_order_release);
+    played_timestamp.store(current_timestamp.timestamp + (read_at - current_timestamp.frame_position) / (double)rate * current_timestamp.speed, std::memory_order_relaxed);
+    played_speed.store(current_timestamp.speed, std::memory_order_relaxed);
+
+    return frames;
+}
+
+//Producer side, marks the time of the frame frames_ahead past the next one that will be written (frames the decoder is still holding back) and the speed the song plays at from there. Marks are dropped if the track is full since the consumer can work forward from an older one
+void audio_sample_ring::mark_timestamp(double timestamp, int frames_ahead, double speed) {
+    int track_write = timestamp_write.load(std::memory_order_relaxed);
+    if (track_write - timestamp_read.load(std::memory_order_acquire) >= TIMESTAMP_TRACK_SIZE) {
+        return;
+    }
+    timestamps[track_write % TIMESTAMP_TRACK_SIZE] = { write_position.load(std::memory_order_relaxed) + frames_ahead, timestamp, speed };
+    timestamp_write.store(track_write + 1, std::memory_order_release);
+}
+
+int audio_sample_ring::frames_available() {
+    return (int)(write_position.load(std::memory_order_acquire) - read_position.load(std::memory_order_acquire));
+}
+
+int audio_sample_ring::space_available() {
+    return capacity - frames_available();
+}
+
+//Time in seconds of the next sample frame the callback will play
+double audio_sample_ring::playback_timestamp() {
+    return played_timestamp.load(std::memory_order_relaxed);
+}
+
+//Seconds of the song per second of samples at the frame the callback will play next
+double audio_sample_ring::playback_speed() {
+    return played_speed.load(std::memory_order_relaxed);
+}
+
+void audio_sample_ring::count_underrun(int missing_frames) {
+    underruns.fetch_add(1, std::memory_order_relaxed);
+    missing.fetch_add(missing_frames, std::memory_order_relaxed);
+}
+
+int64_t audio_sample_ring::underrun_count() {
+    return underruns.load(std::memory_order_relaxed);
+}
+
+int64_t audio_sample_ring::underrun_frames() {
+    return missing.load(std::memory_order_relaxed);
+}
+
+
+//****************    Playback clock
+
+void playback_clock::reset() {
+    sequence = 0;
+    media = 0.0;
+    device = 0.0;
+    speed = 1.0;
+    started = false;
+}
+
+//Called from the audio callback with the media time of the first sample in the buffer, the stream time it will be heard at and how fast the song is playing
+void playback_clock::update(double media_time, double device_time, double media_speed) {
+    unsigned int count = sequence.load(std::memory_order_relaxed);
+    sequence.store(count + 1, std::memory_order_relaxed);
+    //Keeps the value stores below from being seen before the odd count that marks the update as started
+    std::atomic_thread_fence(std::memory_order_release);
+    media.store(media_time, std::memory_order_relaxed);
+    device.store(device_time, std::memory_order_relaxed);
+    speed.store(media_speed, std::memory_order_relaxed);
+    sequence.store(count + 2, std::memory_order_release);
+    started.store(true, std::memory_order_release);
+}
+
+//Reads the last update, retrying if the callback was in the middle of writing one. Returns false if the callback hasn't run yet
+bool playback_clock::read(double& media_time, double& device_time, double& media_speed) {
+    if (!started.load(std::memory_order_acquire)) {
+        return false;
+    }
+    unsigned int before, after;
+    do {
+        before = sequence.load(std::memory_order_acquire);
+        media_time = media.load(std::memory_order_relaxed);
+        device_time = device.load(std::memory_order_relaxed);
+        media_speed = speed.load(std::memory_order_relaxed);
+        //Keeps the value loads above from being done after the count is checked again
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+    } while (before != after || (before & 1));
+    return true;
+}
+
+
+//****************    Audio callback stats
+
+//Only called while the stream is closed, the buffer period is what the histogram buckets are measured against
+void audio_callback_recorder::reset(int frames_per_buffer, double buffer_seconds, double stream_output_latency, double stream_input_latency) {
+    frames = frames_per_buffer;
+    period = buffer_seconds;
+    output_latency = stream_output_latency;
+    input_latency = stream_input_latency;
+    callbacks = 0;
+    for (int i = 0; i < CALLBACK_HISTOGRAM_BUCKETS; i++) {
+        histogram[i] = 0;
+    }
+    callback_seconds = 0.0;
+    max_callback_seconds = 0.0;
+    output_underflows = 0;
+    output_overflows = 0;
+    input_underflows = 0;
+    input_overflows = 0;
+    priming_buffers = 0;
+    ring_underruns = 0;
+    ring_frames_total = 0;
+    min_ring_frames = AUDIO_RING_CAPACITY;
+}
+
+//Called at the end of every callback with how long it took, the flags PortAudio passed in and how many frames the ring held when it started
+//The callback is the only writer, so the totals are loaded and stored rather than read-modify-written
+void audio_callback_recorder::record(double seconds, PaStreamCallbackFlags status_flags, int ring_frames, bool ring_underrun) {
+    static const double BUCKET_LIMITS[CALLBACK_HISTOGRAM_BUCKETS - 1] = { 0.10, 0.25, 0.50, 0.75, 1.0 };
+    int bucket = 0;
+    while (bucket < CALLBACK_HISTOGRAM_BUCKETS - 1 && seconds >= BUCKET_LIMITS[bucket] * period) {
+        bucket++;
+    }
+    histogram[bucket].store(histogram[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    callbacks.store(callbacks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    callback_seconds.store(callback_seconds.load(std::memory_order_relaxed) + seconds, std::memory_order_relaxed);
+    if (seconds > max_callback_seconds.load(std::memory_order_relaxed)) {
+        max_callback_seconds.store(seconds, std::memory_order_relaxed);
+    }
+
+    if (status_flags & paOutputUnderflow) {
+        output_underflows.store(output_underflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    if (status_flags & paOutputOverflow) {
+        output_overflows.store(output_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    if (status_flags & paInputUnderflow) {
+        input_underflows.store(input_underflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    if (status_flags & paInputOverflow) {
+        input_overflows.store(input_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    if (status_flags & paPrimingOutput) {
+        priming_buffers.store(priming_buffers.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    if (ring_underrun) {
+        ring_underruns.store(ring_underruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    ring_frames_total.store(ring_frames_total.load(std::memory_order_relaxed) + ring_frames, std::memory_order_relaxed);
+    if (ring_frames < min_ring_frames.load(std::memory_order_relaxed)) {
+        min_ring_frames.store(ring_frames, std::memory_order_relaxed);
+    }
+}
+
+//Can be taken while the stream runs, the counters are each up to date but may be a callback apart from each other
+Audio_Callback_Stats audio_callback_recorder::snapshot() {
+    Audio_Callback_Stats stats;
+    stats.frames_per_buffer = frames;
+    stats.buffer_seconds = period;
+    stats.output_latency = output_latency;
+    stats.input_latency = input_latency;
+    stats.callbacks = callbacks.load(std::memory_order_relaxed);
+    for (int i = 0; i < CALLBACK_HISTOGRAM_BUCKETS; i++) {
+        stats.histogram[i] = histogram[i].load(std::memory_order_relaxed);
+    }
+    stats.average_callback_seconds = stats.callbacks > 0 ? callback_seconds.load(std::memory_order_relaxed) / stats.callbacks : 0.0;
+    stats.max_callback_seconds = max_callback_seconds.load(std::memory_order_relaxed);
+    stats.output_underflows = output_underflows.load(std::memory_order_relaxed);
+    stats.output_overflows = output_overflows.load(std::memory_order_relaxed);
+    stats.input_underflows = input_underflows.load(std::memory_order_relaxed);
+    stats.input_overflows = input_overflows.load(std::memory_order_relaxed);
+    stats.priming_buffers = priming_buffers.load(std::memory_order_relaxed);
+    stats.ring_underruns = ring_underruns.load(std::memory_order_relaxed);
+    stats.min_ring_frames = stats.callbacks > 0 ? min_ring_frames.load(std::memory_order_relaxed) : 0;
+    stats.average_ring_frames = stats.callbacks > 0 ? ring_frames_total.load(std::memory_order_relaxed) / (double)stats.callbacks : 0.0;
+    stats.buffer_increases = 0;
+    return stats;
+}
+
+
+//Current position of the song in seconds, taken from the audio device when the song has audio
+//Until the first buffer has been played the clock holds at the start of the song (or where it was seeked to) so the video waits for the audio
+double playback_time() {
+    if (song_streams.audio_stream_index < 0 || playing_stream == NULL) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - playback_started).count();
+    }
+    double media_time, device_time, media_speed;
+    if (!audio_clock.read(media_time, device_time, media_speed)) {
+        return clock_hold_time;
+    }
+    double elapsed = Pa_GetStreamTime(playing_stream) - device_time;
+    return media_time + elapsed * media_speed;
+}
+
+//Seconds of the song that pass per second of playback, which follows the tempo once the callback is playing the changed audio
+double playback_speed() {
+    if (song_streams.audio_stream_index < 0 || playing_stream == NULL) {
+        return 1.0;
+    }
+    double media_time, device_time, media_speed;
+    if (!audio_clock.read(media_time, device_time, media_speed)) {
+        return 1.0;
+    }
+    return media_speed;
+}
+
+
+//****************    Audio decoding and playback
+
+//This callback function is called everytime a buffer needs to be filled with audio data while PaStream is running (during the video stream)
+//It copies the amount of frames per buffer needed out of audio_samples, which already holds interleaved left/right samples with the gain applied
+//If the decoder hasn't kept up, the rest of the buffer is filled with silence and the underrun is counted instead of reading past what was decoded
+//Every callback is timed and recorded in callback_recorder along with the stream's status flags and how full the ring was
+static int patestCallback(const void* inputBuffer, void* outputBuffer, unsigned long framesPerBuffer, const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags, void* userData) {
+
+    auto callback_start = std::chrono::steady_clock::now();
+    float* output_data = (float*)outputBuffer;
+    int ring_frames = audio_samples.frames_available();
+    bool ring_underrun = false;
+
+    //The first sample of this buffer reaches the speakers at outputBufferDacTime, some host APIs leave that at 0 so the output latency is added to the current time instead
+    //Once the whole song has been played the clock isn't updated any more, playback_time() then keeps counting on from the last sample on the stream's clock
+    //so video frames timed past the end of the audio still come due
+    double dac_time = timeInfo->outputBufferDacTime != 0.0 ? timeInfo->outputBufferDacTime : timeInfo->currentTime + playing_output_latency;
+    if (ring_frames > 0 || !audio_decoder_finished) {
+        audio_clock.update(audio_samples.playback_timestamp(), dac_time, audio_samples.playback_speed());
+    }
+
+    int frames_read = audio_samples.read(output_data, (int)framesPerBuffer);
+    if (frames_read < (int)framesPerBuffer) {
+        memset(output_data + (size_t)frames_read * AUDIO_CHANNELS, 0, sizeof(float) * (framesPerBuffer - frames_read) * AUDIO_CHANNELS);
+        if (!audio_decoder_finished) {
+            audio_samples.count_underrun((int)framesPerBuffer - frames_read);
+            ring_underrun = true;
+        }
+    }
+
+    //With a duplex stream the mics are mixed in over the backing track
+    if (inputBuffer != NULL) {
+        microphones.process((const float*)inputBuffer, output_data, (int)framesPerBuffer);
+        microphones.record_round_trip(timeInfo);
+    }
+
+    callback_recorder.record(std::chrono::duration<double>(std::chrono::steady_clock::now() - callback_start).count(), statusFlags, ring_frames, ring_underrun);
+    return paContinue;
+}
+
+
+//Sample frames of AUDIO_PREFILL_SECONDS at the output device's rate, capped at what the decoder will write ahead
+static int audio_prefill_frames() {
+    return (int)(std::min(AUDIO_PREFILL_SECONDS, AUDIO_LOOKAHEAD_SECONDS) * output_sample_rate);
+}
+
+//Writes all of the interleaved frames into audio_samples, waiting for the callback to make room while the ring holds AUDIO_LOOKAHEAD_SECONDS
+//Returns false if the decoder was stopped while waiting
+static bool write_audio_samples(const float* interleaved, int frames) {
+    int lookahead = (int)(AUDIO_LOOKAHEAD_SECONDS * output_sample_rate);
+    int written = 0;
+    while (written < frames) {
+        int room = lookahead - audio_samples.frames_available();
+        if (room > 0) {
+            written += audio_samples.write(interleaved + (size_t)written * AUDIO_CHANNELS, room < frames - written ? room : frames - written);
+        }
+        if (written < frames) {
+            if (audio_decoder_stopping) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+    return true;
+}
+
+
+//Works out the gain for a song from its integrated loudness and true peak so it plays at the same level as the others
+//Songs whose peaks would go over PEAK_CEILING at that gain play a bit quieter instead
+void set_song_loudness(const std::string& song_path, double integrated_lufs, double true_peak_dbtp) {
+    double gain_db = std::min(REFERENCE_LUFS - integrated_lufs, MAX_BOOST_DB);
+    double gain = OUTPUT_GAIN * pow(10.0, gain_db / 20.0);
+    double peak = pow(10.0, true_peak_dbtp / 20.0) * gain;
+    if (peak > PEAK_CEILING) {
+        gain *= PEAK_CEILING / peak;
+    }
+    song_levels[song_path] = { (float)gain };
+}
+
+
+//Level for the open song, songs that haven't been measured play at OUTPUT_GAIN like before
+static Output_Level song_output_level() {
+    auto level = song_levels.find(song_path);
+    if (level == song_levels.end()) {
+        return { OUTPUT_GAIN };
+    }
+    return level->second;
+}
+
+
+//What the audio decoder thread carries from one block of audio to the next
+//held_tail is the last crossfade_seconds of the song held back from the ring in case the next song fades in over it, fade_in is the previous song's tail that is still being mixed into this one
+//Once the key or tempo has been changed every block goes through shifter into shifted, even if they are changed back, so the audio it is holding isn't lost
+typedef struct {
+    SwrContext* resampler;
+    std::vector<float> planes;
+    std::vector<float> interleaved;
+    std::vector<float> held_tail;
+    std::vector<float> fade_in;
+    size_t fade_position;
+    pitch_tempo_stage shifter;
+    std::vector<float> shifted;
+    bool shifting;
+    vocal_reduction_filter vocal_filter;
+    Output_Level level;
+} Audio_Output;
+
+
+//Passes a block of interleaved frames on to audio_samples, mixing the previous song's tail in underneath while it lasts and holding back the newest crossfade_seconds of samples
+//Returns false if the decoder was stopped while waiting for room in the ring
+
+static bool queue_audio_samples(Audio_Output& output, float* samples, int frames) {
+    size_t count = (size_t)frames * AUDIO_CHANNELS;
+
+    //The previous song fades out as this one fades in
+    if (output.fade_position < output.fade_in.size()) {
+        size_t fade_frames = output.fade_in.size() / AUDIO_CHANNELS;
+        size_t mixed = output.fade_in.size() - output.fade_position < count ? output.fade_in.size() - output.fade_position : count;
+        for (size_t i = 0; i < mixed; i++) {
+            float fade = (float)((output.fade_position + i) / AUDIO_CHANNELS) / (float)fade_frames;
+            samples[i] = samples[i] * fade + output.fade_in[output.fade_position + i] * (1.0f - fade);
+        }
+        output.fade_position += mixed;
+    }
+
+    size_t hold = (size_t)(crossfade_seconds * output_sample_rate) * AUDIO_CHANNELS;
+    if (hold == 0) {
+        return write_audio_samples(samples, frames);
+    }
+
+    //Samples are only written out once twice the tail has built up, so the held samples aren't moved down on every block
+    output.held_tail.insert(output.held_tail.end(), samples, samples + count);
+    if (output.held_tail.size() < hold * 2) {
+        return true;
+    }
+    size_t release = output.held_tail.size() - hold;
+    bool written = write_audio_samples(output.held_tail.data(), (int)(release / AUDIO_CHANNELS));
+    output.held_tail.erase(output.held_tail.begin(), output.held_tail.begin() + release);
+    return written;
+}
+
+
+//Interleaves one block of converted audio into audio_samples with the output gain applied, marking timestamp (the block's time on the playback clock) where it starts
+//If the song's audio needs converting, the resampler turns it into planar float stereo at output_sample_rate first, and a NULL frame flushes the samples the resampler is still holding at the end of the song
+//Returns false if the decoder was stopped while waiting for room in the ring
+
+static bool output_audio_frame(Audio_Output& output, AVFrame* av_frame_audio, double timestamp) {
+    const float* left_samples;
+    const float* right_samples;
+    int frames;
+
+    if (output.resampler != NULL) {
+        int input_frames = av_frame_audio ? av_frame_audio->nb_samples : 0;
+        int max_frames = swr_get_out_samples(output.resampler, input_frames);
+        if (max_frames <= 0) {
+            return true;
+        }
+        output.planes.resize((size_t)max_frames * AUDIO_CHANNELS);
+        uint8_t* output_planes[AUDIO_CHANNELS] = { (uint8_t*)&output.planes[0], (uint8_t*)&output.planes[max_frames] };
+        frames = swr_convert(output.resampler, output_planes, max_frames, av_frame_audio ? (const uint8_t**)av_frame_audio->extended_data : NULL, input_frames);
+        if (frames < 0) {
+            printf("swr_convert failed\n");
+            return true;
+        }
+        left_samples = &output.planes[0];
+        right_samples = &output.planes[max_frames];
+    }
+    else if (av_frame_audio != NULL) {
+        frames = av_frame_audio->nb_samples;
+        left_samples = (const float*)av_frame_audio->data[0];
+        right_samples = (const float*)av_frame_audio->data[1];
+    }
+    else {
+        return true;
+    }
+
+    //Vocal reduction works on the planes, it ramps in and out over a few blocks when it is switched mid-song
+    output.vocal_filter.process(left_samples, right_samples, frames, vocal_reduction, &left_samples, &right_samples);
+
+    //Interleaves the left and right planes, applying the song's gain here so the callback only has to copy
+    output.interleaved.resize((size_t)frames * AUDIO_CHANNELS);
+    audio_kernels.interleave_stereo(left_samples, right_samples, output.interleaved.data(), frames, output.level.gain);
+
+    output.shifter.set_shift(key_shift, tempo_setting);
+    output.shifting = output.shifting || !output.shifter.is_neutral();
+    if (!output.shifting) {
+        if (av_frame_audio != NULL) {
+            audio_samples.mark_timestamp(timestamp, (int)(output.held_tail.size() / AUDIO_CHANNELS), 1.0);
+        }
+        return queue_audio_samples(output, output.interleaved.data(), frames);
+    }
+
+    //The shifted block is marked with its own time, since the stage holds some audio back and stretches the rest
+    double shifted_time;
+    int shifted_frames = output.shifter.process(output.interleaved.data(), frames, timestamp, output.shifted, shifted_time);
+    if (shifted_frames == 0) {
+        return true;
+    }
+    audio_samples.mark_timestamp(shifted_time, (int)(output.held_tail.size() / AUDIO_CHANNELS), output.shifter.tempo());
+    return queue_audio_samples(output, output.shifted.data(), shifted_frames);
+}
+
+
+//Works out where a decoded frame starts on the playback clock and outputs it, keeping track of when the song's last sample will play
+static bool play_audio_frame(Audio_Output& output, AVFrame* av_frame_audio, AVRational time_base, double time_offset) {
+    double timestamp = (int)((av_frame_audio->pts * (double)time_base.num / (double)time_base.den) * 1000.0) / 1000.0 + time_offset;
+    audio_end_time = timestamp + av_frame_audio->nb_samples / (double)av_frame_audio->sample_rate;
+    return output_audio_frame(output, av_frame_audio, timestamp);
+}
+
+
+//Runs on the audio decoder thread, decoding the demuxer's audio packets into audio_samples until the stream ends or playback is stopped
+//It owns the codec context and resampler handed to it by decode_audio() and frees them when it finishes, along with any frames a prefetch already decoded which are played first
+//After a gapless change fade_in is the previous song's held back tail, which is crossfaded into the start of this song, and after a seek frames that end before start_time are dropped
+//level is the song's gain from its stored loudness
+
+static void audio_decoder_loop(AVCodecContext* av_codec_context_audio, SwrContext* resampler, AVRational time_base, double time_offset, double start_time, std::vector<AVFrame*> prerolled_frames, std::vector<float> fade_in, Output_Level level) {
+
+    AVFrame* av_frame_audio = av_frame_alloc();
+    AVPacket* av_packet_audio = av_packet_alloc();
+    Audio_Output output;
+    output.resampler = resampler;
+    output.fade_in.swap(fade_in);
+    output.fade_position = 0;
+    output.shifter.configure(output_sample_rate);
+    output.shifting = false;
+    output.vocal_filter.configure(output_sample_rate);
+    output.level = level;
+
+    //Keeps track of errors
+    int response;
+
+    bool playing = av_frame_audio != NULL && av_packet_audio != NULL;
+    for (AVFrame* prerolled_frame : prerolled_frames) {
+        if (playing) {
+            playing = play_audio_frame(output, prerolled_frame, time_base, time_offset);
+        }
+        av_frame_free(&prerolled_frame);
+    }
+
+    //Iterates through each frame of the demuxer's audio packets, converts them to interleaved 32 bit float stereo at the output rate and writes them into the ring
+    //Once the packets run out a NULL packet drains whatever the decoder is still holding
+    bool draining = false;
+    while (playing && !draining) {
+        draining = !audio_packets.pop(av_packet_audio);
+        response = avcodec_send_packet(av_codec_context_audio, draining ? NULL : av_packet_audio);
+        av_packet_unref(av_packet_audio);
+        if (response < 0 && response != AVERROR(EAGAIN)) {
+            printf("Failed to decode packet\n");
+            break;
+        }
+
+        while (playing) {
+            response = avcodec_receive_frame(av_codec_context_audio, av_frame_audio);
+            if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+                break;
+            }
+            else if (response < 0) {
+                printf("Failed to decode packet\n");
+                playing = false;
+                break;
+            }
+
+            //Only after a seek, and only frames that say where they are, everything is played in normal playback
+            double frame_end = av_frame_audio->pts * (double)time_base.num / (double)time_base.den + av_frame_audio->nb_samples / (double)av_frame_audio->sample_rate;
+            if (start_time <= 0.0 || av_frame_audio->pts == AV_NOPTS_VALUE || frame_end > start_time) {
+                playing = play_audio_frame(output, av_frame_audio, time_base, time_offset);
+            }
+        }
+    }
+
+    if (playing) {
+        output_audio_frame(output, NULL, 0.0);
+
+        //Plays out what the key and tempo stage is still holding
+        double shifted_time;
+        int shifted_frames = output.shifting ? output.shifter.drain(output.shifted, shifted_time) : 0;
+        if (shifted_frames > 0) {
+            audio_samples.mark_timestamp(shifted_time, (int)(output.held_tail.size() / AUDIO_CHANNELS), output.shifter.tempo());
+            queue_audio_samples(output, output.shifted.data(), shifted_frames);
+        }
+
+        //A song shorter than the crossfade still fades the previous one out the rest of the way, against silence
+        if (output.fade_position < output.fade_in.size()) {
+            std::vector<float> silence(output.fade_in.size() - output.fade_position, 0.0f);
+            queue_audio_samples(output, silence.data(), (int)(silence.size() / AUDIO_CHANNELS));
+        }
+
+        //The held back tail is left for the next song to fade in over, or played out if nothing is queued after this song
+        crossfade_tail.clear();
+        if (next_song_expected) {
+            crossfade_tail.swap(output.held_tail);
+        }
+        else {
+            write_audio_samples(output.held_tail.data(), (int)(output.held_tail.size() / AUDIO_CHANNELS));
+        }
+    }
+
+    //Counted before the thread is marked finished, since the main thread prints them once it is
+    Pitch_Stage_Stats stage_stats = output.shifter.stats();
+    pitch_stage_stats.blocks += stage_stats.blocks;
+    pitch_stage_stats.input_frames += stage_stats.input_frames;
+    pitch_stage_stats.output_frames += stage_stats.output_frames;
+    pitch_stage_stats.process_seconds += stage_stats.process_seconds;
+    pitch_stage_stats.max_block_seconds = std::max(pitch_stage_stats.max_block_seconds, stage_stats.max_block_seconds);
+    audio_decoder_finished = true;
+
+    swr_free(&resampler);
+    av_packet_free(&av_packet_audio);
+    av_frame_free(&av_frame_audio);
+    avcodec_free_context(&av_codec_context_audio);
+}
+
+
+//Asks PortAudio for the default output device's own sample rate so audio is resampled once here instead of again by the driver
+static int query_output_sample_rate() {
+    int sample_rate = 44100;
+    if (Pa_Initialize() != paNoError) {
+        return sample_rate;
+    }
+    PaDeviceIndex device = Pa_GetDefaultOutputDevice();
+    if (device != paNoDevice && Pa_GetDeviceInfo(device) != NULL) {
+        sample_rate = (int)Pa_GetDeviceInfo(device)->defaultSampleRate;
+    }
+    Pa_Terminate();
+    return sample_rate;
+}
+
+
+//Opens a decoder for an audio stream, returns NULL if it can't be opened
+AVCodecContext* open_audio_decoder(AVCodecParameters* av_codec_params_audio) {
+    const AVCodec* av_codec_audio = avcodec_find_decoder(av_codec_params_audio->codec_id);
+    AVCodecContext* av_codec_context_audio = avcodec_alloc_context3(av_codec_audio);
+
+    if (!av_codec_context_audio) {
+        printf("Couldn't create AVCodecContext\n");
+        return NULL;
+    }
+    if (avcodec_parameters_to_context(av_codec_context_audio, av_codec_params_audio) < 0) {
+        printf("Couldn't initialize AVCodecContext\n");
+        avcodec_free_context(&av_codec_context_audio);
+        return NULL;
+    }
+    if (avcodec_open2(av_codec_context_audio, av_codec_audio, NULL) < 0) {
+        printf("Couldn't open codec\n");
+        avcodec_free_context(&av_codec_context_audio);
+        return NULL;
+    }
+    return av_codec_context_audio;
+}
+
+
+//Any sample format, channel layout and rate is converted to planar float stereo at output_sample_rate, songs that are already in that form skip the resampler and get NULL
+//Returns false if a resampler was needed and couldn't be created
+static bool create_audio_resampler(AVCodecContext* av_codec_context_audio, SwrContext** resampler) {
+    *resampler = NULL;
+    bool needs_conversion = av_codec_context_audio->sample_fmt != AV_SAMPLE_FMT_FLTP || av_codec_context_audio->ch_layout.nb_channels != AUDIO_CHANNELS || av_codec_context_audio->sample_rate != output_sample_rate;
+    if (!needs_conversion) {
+        return true;
+    }
+    AVChannelLayout output_layout;
+    av_channel_layout_default(&output_layout, AUDIO_CHANNELS);
+    if (swr_alloc_set_opts2(resampler, &output_layout, AV_SAMPLE_FMT_FLTP, output_sample_rate, &av_codec_context_audio->ch_layout, av_codec_context_audio->sample_fmt, av_codec_context_audio->sample_rate, 0, NULL) < 0 || swr_init(*resampler) < 0) {
+        printf("Couldn't create audio resampler\n");
+        swr_free(resampler);
+        return false;
+    }
+    return true;
+}
+
+
+//This function opens the decoder for the audio stream of the song opened by open_song() and starts the audio decoder thread that fills audio_samples as the song plays
+//It returns once enough audio has been decoded to start the stream without an underrun
+
+bool decode_audio() {
+
+    //A song without audio has nothing left to decode, so a queued song can follow it as soon as its video ends
+    if (song_streams.audio_stream_index < 0) {
+        std::cout << "No audio stream" << std::endl;
+        stop_audio_decoding();
+        audio_decoder_finished = true;
+        return false;
+    }
+
+    AVCodecContext* av_codec_context_audio = open_audio_decoder(song_streams.audio_params);
+    if (av_codec_context_audio == NULL) {
+        return false;
+    }
+
+    output_sample_rate = query_output_sample_rate();
+    SwrContext* resampler;
+    if (!create_audio_resampler(av_codec_context_audio, &resampler)) {
+        avcodec_free_context(&av_codec_context_audio);
+        return false;
+    }
+
+    //Make sure the ring is empty to fill with new song values
+    stop_audio_decoding();
+    audio_samples.reset(AUDIO_RING_CAPACITY, output_sample_rate);
+    audio_decoder_stopping = false;
+    audio_decoder_finished = false;
+
+    audio_decoder_thread = std::thread(audio_decoder_loop, av_codec_context_audio, resampler, song_streams.audio_time_base, song_time_offset, 0.0, std::vector<AVFrame*>(), std::vector<float>(), playing_level);
+
+    //Waits for the first AUDIO_PREFILL_SECONDS of audio (or the whole song if it is shorter) so the stream starts with samples ready
+    while (audio_samples.frames_available() < audio_prefill_frames() && !audio_decoder_finished) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+
+//Stops the audio decoder thread if it is still running and waits for it to exit, this must happen after the audio stream has been stopped
+void stop_audio_decoding() {
+    if (audio_decoder_thread.joinable()) {
+        audio_decoder_stopping = true;
+        audio_packets.stop();
+        audio_decoder_thread.join();
+    }
+}
+
+
+//True once the audio decoder has written the whole song into audio_samples (or left its tail for the next song to crossfade over)
+bool audio_decoding_finished() {
+    return audio_decoder_finished;
+}
+
+
+//****************    Key, tempo and vocal reduction
+
+//Semitones up (or down when negative) from the song's own key
+void set_key_shift(int semitones) {
+    key_shift = std::max(-MAX_KEY_SHIFT, std::min(semitones, MAX_KEY_SHIFT));
+}
+
+int get_key_shift() {
+    return key_shift;
+}
+
+//1 is the song's own tempo, 0.8 plays it at 80% speed. Rounded to whole percent so stepping back to 1 lands exactly on it
+void set_tempo(double tempo) {
+    tempo = std::round(tempo * 100.0) / 100.0;
+    tempo_setting = std::max(MIN_TEMPO, std::min(tempo, MAX_TEMPO));
+}
+
+double get_tempo() {
+    return tempo_setting;
+}
+
+//Cancels the center channel (where the vocals usually are) for songs with no instrumental version
+void set_vocal_reduction(bool enabled) {
+    vocal_reduction = enabled;
+}
+
+bool get_vocal_reduction() {
+    return vocal_reduction;
+}
+
+//Prints what the key and tempo stage cost since the last time this was called, then starts counting again
+void print_pitch_stage_stats() {
+    if (pitch_stage_stats.blocks > 0 && pitch_stage_stats.process_seconds > 0.0) {
+        std::cout << "Key/tempo stage: " << pitch_stage_stats.blocks << " blocks, average " << pitch_stage_stats.process_seconds / pitch_stage_stats.blocks * 1000.0 << " ms per block, worst "
+            << pitch_stage_stats.max_block_seconds * 1000.0 << " ms, " << (pitch_stage_stats.input_frames / (double)output_sample_rate) / pitch_stage_stats.process_seconds << "x real time" << std::endl;
+    }
+    pitch_stage_stats = { 0, 0, 0, 0.0, 0.0 };
+}
+
+
+//Opens the stream that plays from audio_samples at the current buffer size, without starting it
+//With mic monitoring on the stream is duplex, with the default input device's mics and small buffers to keep the round trip short, and falls back to output only if that can't be opened
+static bool open_audio_stream(PaStream** stream) {
+    PaError err;
+    PaStreamParameters  outputParameters;
+    PaStreamParameters  inputParameters;
+
+    outputParameters.device = Pa_GetDefaultOutputDevice();
+    outputParameters.channelCount = 2;
+    outputParameters.sampleFormat = paFloat32;
+    outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
+    outputParameters.hostApiSpecificStreamInfo = NULL;
+
+    //Streams start from the size asked for, or the size underruns have pushed it up to
+    int frames_per_buffer = std::max(mic_monitoring ? mic_frames_per_buffer : OUTPUT_FRAMES_PER_BUFFER, adapted_frames_per_buffer);
+
+    static int placeholder = 1;
+
+    bool duplex = false;
+    if (mic_monitoring) {
+        inputParameters.device = Pa_GetDefaultInputDevice();
+        if (inputParameters.device == paNoDevice || Pa_GetDeviceInfo(inputParameters.device)->maxInputChannels < 1) {
+            std::cout << "No input device, mics won't be monitored" << std::endl;
+        }
+        else {
+            inputParameters.channelCount = std::min(Pa_GetDeviceInfo(inputParameters.device)->maxInputChannels, MAX_MIC_CHANNELS);
+            inputParameters.sampleFormat = paFloat32;
+            inputParameters.suggestedLatency = Pa_GetDeviceInfo(inputParameters.device)->defaultLowInputLatency;
+            inputParameters.hostApiSpecificStreamInfo = NULL;
+
+            //Set up before the stream opens so the callback never allocates
+            microphones.prepare(output_sample_rate, inputParameters.channelCount);
+            err = Pa_OpenStream(&(*stream), &inputParameters, &outputParameters, output_sample_rate, frames_per_buffer, paClipOff, patestCallback, &placeholder);
+            duplex = err == paNoError;
+            if (!duplex) {
+                std::cout << "Could not open duplex stream (" << Pa_GetErrorText(err) << "), mics won't be monitored" << std::endl;
+            }
+        }
+    }
+
+    //Take PaStream object from main and opens the stream with specified output parameters and the device's sample rate the audio was converted to, as well as our callback function
+    if (!duplex) {
+        err = Pa_OpenStream(&(*stream), 0, &outputParameters, output_sample_rate, frames_per_buffer, paClipOff, patestCallback, &placeholder);
+        if (err != paNoError) {
+            std::cout << "error after default stream" << std::endl;
+            return false;
+        }
+    }
+
+    const PaStreamInfo* info = Pa_GetStreamInfo(*stream);
+    double output_latency = info ? info->outputLatency : 0.0;
+    double input_latency = info && duplex ? info->inputLatency : 0.0;
+    if (duplex) {
+        std::cout << "Monitoring " << inputParameters.channelCount << " mic input(s), " << frames_per_buffer << " frame buffers, host reported round trip "
+            << (input_latency + output_latency) * 1000.0 << " ms" << std::endl;
+    }
+
+    //The stats start over with the new stream, and so does the window underruns are counted in
+    callback_recorder.reset(frames_per_buffer, frames_per_buffer / (double)output_sample_rate, output_latency, input_latency);
+    playing_output_latency = output_latency;
+    adapt_window_start = std::chrono::steady_clock::now();
+    adapt_window_underruns = 0;
+    last_stats_log = adapt_window_start;
+    return true;
+}
+
+
+//This function initializes and starts the audio stream that plays from audio_samples
+void initialize_audio(PaStream** stream) {
+    PaError err;
+
+    err = Pa_Initialize();
+    if (err != paNoError) std::cout << "Error at initialize" << std::endl;
+    if (!open_audio_stream(stream)) {
+        return;
+    }
+
+    //Starts the audio stream, the playback clock starts over for the new song
+    audio_clock.reset();
+    playing_stream = *stream;
+    playback_started = std::chrono::steady_clock::now();
+    err = Pa_StartStream(*stream);
+    if (err != paNoError) std::cout << "error after start stream" << std::endl;
+}
+
+
+//Stops audio stream
+void stop_audio(PaStream** stream) {
+
+    PaError err;
+    bool opened = playing_stream != NULL;
+    playing_stream = NULL;
+    if (opened) {
+        err = Pa_StopStream(*stream);
+        if (err != paNoError) std::cout << "error after sleep" << std::endl;
+        err = Pa_CloseStream(*stream);
+        if (err != paNoError) std::cout << "error after close stream" << std::endl;
+    }
+    err = Pa_Terminate();
+
+    if (audio_samples.underrun_count() > 0) {
+        std::cout << "Audio underruns: " << audio_samples.underrun_count() << " (" << audio_samples.underrun_frames() << " frames of silence)" << std::endl;
+    }
+    print_audio_callback_stats();
+    if (mic_monitoring) {
+        print_monitor_stats();
+    }
+}
+
+
+//****************    Audio stream health
+
+Audio_Callback_Stats get_audio_callback_stats() {
+    Audio_Callback_Stats stats = callback_recorder.snapshot();
+    stats.buffer_increases = buffer_increases;
+    return stats;
+}
+
+
+//Prints the callback time histogram, the flags the stream reported and how full the ring stayed, for the stream that was last opened
+void print_audio_callback_stats() {
+    Audio_Callback_Stats stats = get_audio_callback_stats();
+    if (stats.callbacks == 0) {
+        return;
+    }
+    static const char* BUCKET_NAMES[CALLBACK_HISTOGRAM_BUCKETS] = { "<10%", "<25%", "<50%", "<75%", "<100%", "late" };
+    std::cout << "Audio callback: " << stats.callbacks << " buffers of " << stats.frames_per_buffer << " frames (" << stats.buffer_seconds * 1000.0 << " ms), average "
+        << stats.average_callback_seconds * 1e6 << " us, worst " << stats.max_callback_seconds * 1e6 << " us, device latency out " << stats.output_latency * 1000.0 << " ms";
+    if (stats.input_latency > 0.0) {
+        std::cout << " in " << stats.input_latency * 1000.0 << " ms";
+    }
+    std::cout << std::endl << "Callback time as share of the buffer:";
+    for (int i = 0; i < CALLBACK_HISTOGRAM_BUCKETS; i++) {
+        std::cout << " " << BUCKET_NAMES[i] << " " << stats.histogram[i];
+    }
+    std::cout << std::endl;
+    std::cout << "Audio ring: average " << stats.average_ring_frames * 1000.0 / output_sample_rate << " ms, lowest " << stats.min_ring_frames * 1000.0 / output_sample_rate
+        << " ms, " << stats.ring_underruns << " underruns" << std::endl;
+    if (stats.output_underflows > 0 || stats.output_overflows > 0 || stats.input_underflows > 0 || stats.input_overflows > 0) {
+        std::cout << "Stream flags: output underflow " << stats.output_underflows << ", output overflow " << stats.output_overflows
+            << ", input underflow " << stats.input_underflows << ", input overflow " << stats.input_overflows << std::endl;
+    }
+    if (stats.buffer_increases > 0) {
+        std::cout << "Audio buffer was increased " << stats.buffer_increases << " time(s) to " << adapted_frames_per_buffer << " frames" << std::endl;
+    }
+}
+
+
+//Prints a one line summary every audio_stats_interval seconds while the stream runs, called from the main loop
+void log_audio_stats() {
+    if (audio_stats_interval <= 0.0 || playing_stream == NULL) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - last_stats_log).count() < audio_stats_interval) {
+        return;
+    }
+    last_stats_log = now;
+    Audio_Callback_Stats stats = get_audio_callback_stats();
+    printf("Audio: %lld callbacks, average %.0f us, worst %.0f us of %.1f ms, %lld late, ring lowest %.0f ms, %lld underruns, %lld output underflows\n",
+        (long long)stats.callbacks, stats.average_callback_seconds * 1e6, stats.max_callback_seconds * 1e6, stats.buffer_seconds * 1000.0,
+        (long long)stats.histogram[CALLBACK_HISTOGRAM_BUCKETS - 1], stats.min_ring_frames * 1000.0 / output_sample_rate, (long long)stats.ring_underruns, (long long)stats.output_underflows);
+}
+
+
+//Called from the main loop while a song plays. When the callback has run dry (the ring or the device) BUFFER_ADAPT_UNDERRUNS times within the window,
+//the stream is reopened with twice the frames per buffer, the bigger size then stays for every later song
+//The ring keeps what was decoded while the stream is closed, and the clock holds at what was last played until the new stream's first buffer
+bool adapt_audio_buffer(PaStream** stream) {
+    if (playing_stream == NULL) {
+        return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    Audio_Callback_Stats stats = callback_recorder.snapshot();
+    int64_t underruns = stats.ring_underruns + stats.output_underflows;
+    if (std::chrono::duration<double>(now - adapt_window_start).count() > BUFFER_ADAPT_WINDOW_SECONDS) {
+        adapt_window_start = now;
+        adapt_window_underruns = underruns;
+        return false;
+    }
+    if (underruns - adapt_window_underruns < BUFFER_ADAPT_UNDERRUNS || stats.frames_per_buffer >= MAX_FRAMES_PER_BUFFER) {
+        return false;
+    }
+
+    PaError err;
+    bool running = Pa_IsStreamActive(playing_stream) == 1;
+    playing_stream = NULL;
+    err = Pa_StopStream(*stream);
+    if (err != paNoError) std::cout << "error after stop stream" << std::endl;
+    err = Pa_CloseStream(*stream);
+    if (err != paNoError) std::cout << "error after close stream" << std::endl;
+
+    adapted_frames_per_buffer = std::min(stats.frames_per_buffer * 2, MAX_FRAMES_PER_BUFFER);
+    buffer_increases++;
+    std::cout << underruns - adapt_window_underruns << " audio underruns in " << BUFFER_ADAPT_WINDOW_SECONDS << " s, increasing the buffer from "
+        << stats.frames_per_buffer << " to " << adapted_frames_per_buffer << " frames" << std::endl;
+    if (!open_audio_stream(stream)) {
+        return false;
+    }
+
+    clock_hold_time = audio_samples.playback_timestamp();
+    audio_clock.reset();
+    playing_stream = *stream;
+    if (running) {
+        err = Pa_StartStream(*stream);
+        if (err != paNoError) std::cout << "error after start stream" << std::endl;
+    }
+    return true;
+}
+
+
+
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+// 
+//Song prefetching
+
+//The next queued song is opened on its own thread while the current one plays: the file, both decoders and the resampler are set up and the first frames are decoded
+//switch_to_prefetched_song() then hands all of that to the decoder threads, so the audio stream keeps running and the next song's samples follow straight on from the last song's
+
+static Prefetched_Song prefetched_song;
+static std::thread prefetch_thread;
+static std::atomic<prefetch_state> prefetch_status(PREFETCH_NONE);
+static std::atomic<bool> prefetch_stopping(false);
+
+
+//Rough size of a decoded frame or packet, counted against PREFETCH_MEMORY_LIMIT
+static size_t frame_bytes(AVFrame* av_frame) {
+    size_t bytes = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && av_frame->buf[i] != NULL; i++) {
+        bytes += av_frame->buf[i]->size;
+    }
+    return bytes;
+}
+
+
+//Sends one packet to a prefetched decoder and keeps every frame that comes back
+static bool preroll_packet(AVCodecContext* av_codec_context, AVPacket* av_packet, AVFrame* av_frame, std::vector<AVFrame*>& frames, size_t& bytes) {
+    int response = avcodec_send_packet(av_codec_context, av_packet);
+    if (response < 0 && response != AVERROR(EAGAIN)) {
+        printf("Failed to decode packet\n");
+        return false;
+    }
+    while (avcodec_receive_frame(av_codec_context, av_frame) >= 0) {
+        bytes += frame_bytes(av_frame);
+        frames.push_back(av_frame_clone(av_frame));
+        av_frame_unref(av_frame);
+    }
+    return true;
+}
+
+
+//Frees everything a prefetch opened, for a prefetch that was cancelled or failed
+static void free_prefetched_song() {
+    Prefetched_Song& next = prefetched_song;
+    for (AVPacket* packet : next.video_packets) {
+        av_packet_free(&packet);
+    }
+    for (AVPacket* packet : next.audio_packets) {
+        av_packet_free(&packet);
+    }
+    for (AVFrame* frame : next.video_frames) {
+        av_frame_free(&frame);
+    }
+    for (AVFrame* frame : next.audio_frames) {
+        av_frame_free(&frame);
+    }
+    next.video_packets.clear();
+    next.audio_packets.clear();
+    next.video_frames.clear();
+    next.audio_frames.clear();
+    swr_free(&next.resampler);
+    avcodec_free_context(&next.video_codec_context);
+    avcodec_free_context(&next.audio_codec_context);
+    if (next.format_context != NULL) {
+        avformat_close_input(&next.format_context);
+    }
+    next.bytes = 0;
+}
+
+
+//Runs on the prefetch thread, opening the next song and reading it until a few video frames and the audio prefill plus the crossfade are decoded
+//Packets for a stream that already has enough are kept undecoded for the demuxer to hand on, and reading stops early at PREFETCH_MEMORY_LIMIT
+
+static void prefetch_loop(std::string filepath) {
+    auto prefetch_start = std::chrono::steady_clock::now();
+    Prefetched_Song& next = prefetched_song;
+
+    if (!open_song_file(filepath.c_str(), &next.format_context, next.streams)) {
+        prefetch_status = PREFETCH_FAILED;
+        return;
+    }
+    if (next.streams.video_stream_index >= 0) {
+        next.video_codec_context = open_video_decoder(next.streams.video_params, false);
+    }
+    if (next.streams.audio_stream_index >= 0) {
+        next.audio_codec_context = open_audio_decoder(next.streams.audio_params);
+    }
+    bool opened = (next.streams.video_stream_index < 0 || next.video_codec_context != NULL) && (next.streams.audio_stream_index < 0 || next.audio_codec_context != NULL);
+    if (!opened || (next.audio_codec_context != NULL && !create_audio_resampler(next.audio_codec_context, &next.resampler))) {
+        prefetch_status = PREFETCH_FAILED;
+        return;
+    }
+
+    AVPacket* av_packet = av_packet_alloc();
+    AVFrame* av_frame = av_frame_alloc();
+    double audio_wanted = audio_prefill_frames() / (double)output_sample_rate + crossfade_seconds;
+    double audio_decoded = 0.0;
+    bool video_done = next.video_codec_context == NULL;
+    bool audio_done = next.audio_codec_context == NULL;
+    bool failed = av_packet == NULL || av_frame == NULL;
+
+    while (!failed && !(video_done && audio_done) && !prefetch_stopping && next.bytes < PREFETCH_MEMORY_LIMIT) {
+        if (av_read_frame(next.format_context, av_packet) < 0) {
+            break;
+        }
+        if (av_packet->stream_index == next.streams.video_stream_index) {
+            if (av_packet->flags & AV_PKT_FLAG_KEY) {
+                next.keyframes.add(av_packet->pts != AV_NOPTS_VALUE ? av_packet->pts : av_packet->dts, av_packet->pos);
+            }
+            if (video_done) {
+                next.bytes += av_packet->size;
+                next.video_packets.push_back(av_packet_clone(av_packet));
+            }
+            else {
+                failed = !preroll_packet(next.video_codec_context, av_packet, av_frame, next.video_frames, next.bytes);
+                video_done = (int)next.video_frames.size() >= PREFETCH_VIDEO_FRAMES;
+            }
+        }
+        else if (av_packet->stream_index == next.streams.audio_stream_index) {
+            if (audio_done) {
+                next.bytes += av_packet->size;
+                next.audio_packets.push_back(av_packet_clone(av_packet));
+            }
+            else {
+                size_t frames_before = next.audio_frames.size();
+                failed = !preroll_packet(next.audio_codec_context, av_packet, av_frame, next.audio_frames, next.bytes);
+                for (size_t i = frames_before; i < next.audio_frames.size(); i++) {
+                    audio_decoded += next.audio_frames[i]->nb_samples / (double)next.audio_frames[i]->sample_rate;
+                }
+                audio_done = audio_decoded >= audio_wanted;
+            }
+        }
+        av_packet_unref(av_packet);
+    }
+    av_packet_free(&av_packet);
+    av_frame_free(&av_frame);
+
+    if (failed) {
+        prefetch_status = PREFETCH_FAILED;
+        return;
+    }
+    next.prefetch_seconds = seconds_since(prefetch_start);
+    prefetch_status = PREFETCH_READY;
+}
+
+
+//Starts opening the song at filepath in the background so it can follow the current song without a gap, replacing any song that was already being prefetched
+bool prefetch_song(const char* filepath) {
+    cancel_prefetch();
+
+    prefetched_song.filepath = filepath;
+    prefetched_song.keyframes.reset();
+    prefetched_song.format_context = NULL;
+    prefetched_song.video_codec_context = NULL;
+    prefetched_song.audio_codec_context = NULL;
+    prefetched_song.resampler = NULL;
+    prefetched_song.bytes = 0;
+    prefetched_song.prefetch_seconds = 0.0;
+
+    prefetch_stopping = false;
+    prefetch_status = PREFETCH_LOADING;
+    next_song_expected = true;
+    prefetch_thread = std::thread(prefetch_loop, std::string(filepath));
+    return true;
+}
+
+
+prefetch_state get_prefetch_state() {
+    return prefetch_status;
+}
+
+
+//Stops a prefetch that is still loading and frees whatever it opened
+void cancel_prefetch() {
+    if (prefetch_thread.joinable()) {
+        prefetch_stopping = true;
+        prefetch_thread.join();
+        free_prefetched_song();
+    }
+    next_song_expected = false;
+    prefetch_status = PREFETCH_NONE;
+}
+
+
+//True once the prefetched song is ready and the current song's audio has all been decoded, so switch_to_prefetched_song() will take it
+//A song without audio never set up the ring, so a song with audio can't follow it without restarting the stream
+bool prefetched_song_can_follow() {
+    if (prefetch_status != PREFETCH_READY || !audio_decoder_finished) {
+        return false;
+    }
+    return song_streams.audio_stream_index >= 0 || prefetched_song.streams.audio_stream_index < 0;
+}
+
+
+//Hands the prefetched song to the demuxer and decoder threads once the current song's video has ended and its audio has all been decoded
+//The audio stream and audio_samples are left running, so the next song's first samples land right after (or crossfade over) the last song's last ones
+//Returns false if prefetched_song_can_follow() doesn't, the caller should then stop the current song and start the next one the usual way
+
+bool switch_to_prefetched_song() {
+    if (!prefetched_song_can_follow()) {
+        return false;
+    }
+    Prefetched_Song& next = prefetched_song;
+
+    auto switch_start = std::chrono::steady_clock::now();
+    prefetch_thread.join();
+
+    //The new song starts where the last one's audio ends, less the length of the crossfade, on the clock playback_time() already follows
+    double first_timestamp = 0.0;
+    if (!next.audio_frames.empty()) {
+        AVFrame* first_frame = next.audio_frames.front();
+        first_timestamp = first_frame->pts * (double)next.streams.audio_time_base.num / (double)next.streams.audio_time_base.den;
+    }
+    else if (!next.video_frames.empty()) {
+        AVFrame* first_frame = next.video_frames.front();
+        int64_t pts = first_frame->best_effort_timestamp != AV_NOPTS_VALUE ? first_frame->best_effort_timestamp : first_frame->pts;
+        first_timestamp = pts * (double)next.streams.video_time_base.num / (double)next.streams.video_time_base.den;
+    }
+    std::vector<float> fade_in;
+    fade_in.swap(crossfade_tail);
+    double song_start = song_streams.audio_stream_index >= 0 ? audio_end_time - fade_in.size() / AUDIO_CHANNELS / (double)output_sample_rate : playback_time();
+
+    //Both of the last song's decoders have already run to the end of the file, so this only joins their threads and closes the file
+    stop_audio_decoding();
+    stop_video_decoding();
+    close_song();
+
+    song_path = next.filepath;
+    song_format_context = next.format_context;
+    song_streams = next.streams;
+    song_keyframes = next.keyframes;
+    load_song_keyframes();
+    demux_stats = { 0, 0, 0.0 };
+    demuxer_skip_video = false;
+
+    //Every song starts in its own key and tempo, with its vocals
+    key_shift = 0;
+    tempo_setting = 1.0;
+    vocal_reduction = false;
+    playing_level = song_output_level();
+    song_time_offset = song_start - first_timestamp;
+    for (AVPacket* packet : next.video_packets) {
+        video_packets.push(packet);
+        av_packet_free(&packet);
+    }
+    for (AVPacket* packet : next.audio_packets) {
+        audio_packets.push(packet);
+        av_packet_free(&packet);
+    }
+    start_demuxer();
+
+    if (next.video_codec_context != NULL) {
+        set_video_properties(song_streams.video_params);
+        start_video_decoder(next.video_codec_context, song_format_context->streams[song_streams.video_stream_index], song_time_offset, 0.0, next.video_frames, true);
+    }
+    else {
+        video_frames.reset(VIDEO_RING_CAPACITY);
+        video_frames.finish();
+    }
+
+    if (next.audio_codec_context != NULL) {
+        audio_decoder_stopping = false;
+        audio_decoder_finished = false;
+        audio_decoder_thread = std::thread(audio_decoder_loop, next.audio_codec_context, next.resampler, song_streams.audio_time_base, song_time_offset, 0.0, next.audio_frames, fade_in, playing_level);
+    }
+    else {
+        //Without audio playback_time() follows the steady clock, which is moved so it carries on from where the last song left off
+        playback_started = std::chrono::steady_clock::now() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(song_start));
+        audio_decoder_finished = true;
+    }
+
+    std::cout << "Switched to next song in " << seconds_since(switch_start) * 1000.0 << " ms (prefetched in " << next.prefetch_seconds * 1000.0 << " ms, "
+        << next.bytes / 1024 << " KB held)" << std::endl;
+
+    //Everything the prefetch opened is owned by the demuxer and decoder threads now
+    next.format_context = NULL;
+    next.video_codec_context = NULL;
+    next.audio_codec_context = NULL;
+    next.resampler = NULL;
+    next.video_packets.clear();
+    next.audio_packets.clear();
+    next.video_frames.clear();
+    next.audio_frames.clear();
+    next.bytes = 0;
+    next_song_expected = false;
+    prefetch_status = PREFETCH_NONE;
+    return true;
+}
+
+
+
+
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+// 
+//Seeking
+
+
+//Moves playback of the current song to position seconds from its start
+//The audio stream is paused and every thread working on the song is stopped so both rings can be emptied together, then the file is moved to the keyframe at or before the target
+//and the decoders are started again from there, only converting and playing what comes at or after the target
+//Returns straight away without waiting on the decoders, the render loop keeps the last frame up until seek_ready() says the target is ready and starts the audio again
+
+bool seek_song(double position) {
+    if (song_format_context == NULL) {
+        return false;
+    }
+    seek_started = std::chrono::steady_clock::now();
+    double duration = song_duration();
+    if (position < 0.0) {
+        position = 0.0;
+    }
+    if (duration > 0.0 && position > duration) {
+        position = duration;
+    }
+
+    //A seek made while the last one is still pending has already paused the stream
+    bool audio_running = seek_pending ? seek_resume_audio : playing_stream != NULL && Pa_IsStreamActive(playing_stream) == 1;
+    if (audio_running && Pa_IsStreamActive(playing_stream) == 1) {
+        Pa_AbortStream(playing_stream);
+    }
+    stop_audio_decoding();
+    stop_video_decoding();
+    stop_demuxer();
+
+    //Lands on the keyframe from the index when it has one for the target, otherwise ffmpeg finds the keyframe before it and the index now has a gap
+    int response;
+    Keyframe keyframe;
+    if (song_streams.video_stream_index >= 0) {
+        AVRational time_base = song_streams.video_time_base;
+        int64_t target_pts = (int64_t)(position * time_base.den / time_base.num);
+        if (song_keyframes.find(target_pts, keyframe)) {
+            response = avformat_seek_file(song_format_context, song_streams.video_stream_index, INT64_MIN, keyframe.pts, keyframe.pts, 0);
+        }
+        else {
+            keyframe_index_gap = true;
+            response = av_seek_frame(song_format_context, song_streams.video_stream_index, target_pts, AVSEEK_FLAG_BACKWARD);
+        }
+    }
+    else {
+        AVRational time_base = song_streams.audio_time_base;
+        response = av_seek_frame(song_format_context, song_streams.audio_stream_index, (int64_t)(position * time_base.den / time_base.num), AVSEEK_FLAG_BACKWARD);
+    }
+    if (response < 0) {
+        printf("Seek failed, carrying on from where the file was\n");
+    }
+    start_demuxer();
+
+    if (song_streams.video_stream_index >= 0) {
+        if (video_decode_stats.from_cache) {
+            video_frames.reset(VIDEO_RING_CAPACITY);
+            video_decoder_thread = std::thread(cached_video_loop, song_time_offset, position);
+        }
+        else {
+            AVCodecContext* av_codec_context = open_video_decoder(song_streams.video_params, false);
+            if (av_codec_context != NULL) {
+                start_video_decoder(av_codec_context, song_format_context->streams[song_streams.video_stream_index], song_time_offset, position, std::vector<AVFrame*>(), false);
+            }
+            else {
+                //Nothing will fill the ring, so the seek doesn't wait on it
+                video_frames.reset(VIDEO_RING_CAPACITY);
+                video_frames.finish();
+            }
+        }
+    }
+
+    //The clock holds at the target until the first buffer from there has been played
+    clock_hold_time = song_time_offset + position;
+    if (song_streams.audio_stream_index >= 0) {
+        AVCodecContext* av_codec_context_audio = open_audio_decoder(song_streams.audio_params);
+        SwrContext* resampler = NULL;
+        if (av_codec_context_audio != NULL && !create_audio_resampler(av_codec_context_audio, &resampler)) {
+            avcodec_free_context(&av_codec_context_audio);
+        }
+        audio_samples.reset(AUDIO_RING_CAPACITY, output_sample_rate);
+        audio_clock.reset();
+        audio_decoder_stopping = false;
+        audio_decoder_finished = av_codec_context_audio == NULL;
+        if (av_codec_context_audio != NULL) {
+            audio_decoder_thread = std::thread(audio_decoder_loop, av_codec_context_audio, resampler, song_streams.audio_time_base, song_time_offset, position, std::vector<AVFrame*>(), std::vector<float>(), playing_level);
+        }
+    }
+
+    seek_pending = true;
+    seek_resume_audio = audio_running;
+    seek_target = position;
+    return response >= 0;
+}
+
+
+//Called every pass of the render loop while a song plays, true unless a seek is still waiting on the decoders
+//A seek is ready once the audio ring holds audio_prefill_frames() and the first video frame at the target is in the ring, then the audio stream is started again
+//and the latency covers everything from seek_song() to that point
+bool seek_ready() {
+    if (!seek_pending) {
+        return true;
+    }
+    if (song_streams.audio_stream_index >= 0 && audio_samples.frames_available() < audio_prefill_frames() && !audio_decoder_finished) {
+        return false;
+    }
+    if (song_streams.video_stream_index >= 0 && !video_frames.ready()) {
+        return false;
+    }
+    seek_pending = false;
+
+    if (song_streams.audio_stream_index < 0) {
+        playback_started = std::chrono::steady_clock::now() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(clock_hold_time));
+    }
+    if (seek_resume_audio) {
+        Pa_StartStream(playing_stream);
+    }
+
+    double seek_seconds = seconds_since(seek_started);
+    seek_stats.seeks++;
+    seek_stats.total_seconds += seek_seconds;
+    if (seek_seconds > seek_stats.max_seconds) {
+        seek_stats.max_seconds = seek_seconds;
+    }
+    std::cout << "Seeked to " << seek_target << " s in " << seek_seconds * 1000.0 << " ms" << std::endl;
+    return true;
+}
+
+
+//Prints how long seeks have taken to get the first frame at the target ready, and how many frames were decoded on the way from the keyframe
+void print_seek_stats() {
+    if (seek_stats.seeks == 0) {
+        return;
+    }
+    std::cout << "Seeks: " << seek_stats.seeks << ", average " << seek_stats.total_seconds / seek_stats.seeks * 1000.0 << " ms, worst " << seek_stats.max_seconds * 1000.0
+        << " ms, " << seek_stats.frames_skipped.load() << " frames decoded before the targets" << std::endl;
+}
@@ -6,39 +6,467 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+#include <libavutil/channel_layout.h>
 	//#include <libavutil/pixdesc.h>
 }
 #include <inttypes.h>
 #include <map>
 #include <queue>
+#include <vector>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
 
 //PortAudio library
 #include "portaudio.h"
 
-//Sound_Data object stores enough data for one frame that consists of a left and right sample
+//Number of interleaved channels in the audio sample ring and the output stream
+#define AUDIO_CHANNELS 2
+
+//Audio_Timestamp marks the time (in seconds) of the sample frame at a position in the audio sample ring, and how many seconds of the song each second of samples after it covers (1 unless the tempo is changed)
+typedef struct {
+    int64_t frame_position;
+    double timestamp;
+    double speed;
+} Audio_Timestamp;
+
+//Wait-free single producer/single consumer ring of interleaved float samples between the audio decoder thread and the PortAudio callback
+//Positions are counted in sample frames (one sample per channel) and only ever increase, the producer owns write_position and the consumer owns read_position
+//Alongside the samples is a coarse timestamp track with one entry per decoded audio frame, which the consumer turns into the time of the sample being played
+class audio_sample_ring {
+public:
+    void reset(int capacity_frames, int sample_rate);
+    int write(const float* samples, int frames);
+    int read(float* samples, int frames);
+    void mark_timestamp(double timestamp, int frames_ahead, double speed);
+    int frames_available();
+    int space_available();
+    double playback_timestamp();
+    double playback_speed();
+    void count_underrun(int missing_frames);
+    int64_t underrun_count();
+    int64_t underrun_frames();
+
+private:
+    std::vector<float> samples;
+    int capacity = 0;
+    int mask = 0;
+    int rate = 44100;
+    alignas(64) std::atomic<int64_t> write_position{ 0 };
+    alignas(64) std::atomic<int64_t> read_position{ 0 };
+
+    static const int TIMESTAMP_TRACK_SIZE = 256;
+    Audio_Timestamp timestamps[TIMESTAMP_TRACK_SIZE];
+    std::atomic<int> timestamp_write{ 0 };
+    std::atomic<int> timestamp_read{ 0 };
+    Audio_Timestamp current_timestamp = { 0, 0.0, 1.0 };
+    std::atomic<double> played_timestamp{ 0.0 };
+    std::atomic<double> played_speed{ 1.0 };
+
+    std::atomic<int64_t> underruns{ 0 };
+    std::atomic<int64_t> missing{ 0 };
+};
+
+//Clock that follows the audio device, the callback records which media time is reaching the DAC and at what stream time
+//playback_time() extrapolates from the last record using the stream's clock at the speed the song is playing at, so video follows exactly what is being heard
+//The values are written together under a sequence counter so a reader never sees half of an update
+class playback_clock {
+public:
+    void reset();
+    void update(double media_time, double device_time, double media_speed);
+    bool read(double& media_time, double& device_time, double& media_speed);
+
+private:
+    std::atomic<unsigned int> sequence{ 0 };
+    std::atomic<double> media{ 0.0 };
+    std::atomic<double> device{ 0.0 };
+    std::atomic<double> speed{ 1.0 };
+    std::atomic<bool> started{ false };
+};
+
+//Callback times are sorted by how much of the buffer period they used: under 10%, 25%, 50%, 75%, 100%, and the last bucket for callbacks that missed the deadline
+#define CALLBACK_HISTOGRAM_BUCKETS 6
+
+//Audio_Callback_Stats object is what the audio callback measured since the stream was opened, along with the buffer size and latencies the device reported for it
+typedef struct {
+    int frames_per_buffer;
+    double buffer_seconds;
+    double output_latency;
+    double input_latency;
+    int64_t callbacks;
+    int64_t histogram[CALLBACK_HISTOGRAM_BUCKETS];
+    double average_callback_seconds;
+    double max_callback_seconds;
+    int64_t output_underflows;
+    int64_t output_overflows;
+    int64_t input_underflows;
+    int64_t input_overflows;
+    int64_t priming_buffers;
+    int64_t ring_underruns;
+    int min_ring_frames;
+    double average_ring_frames;
+    int buffer_increases;
+} Audio_Callback_Stats;
+
+//Counters the audio callback adds to on every buffer, each one is a relaxed atomic so the main thread can take a snapshot while the stream runs
+class audio_callback_recorder {
+public:
+    void reset(int frames_per_buffer, double buffer_seconds, double output_latency, double input_latency);
+    void record(double seconds, PaStreamCallbackFlags status_flags, int ring_frames, bool ring_underrun);
+    Audio_Callback_Stats snapshot();
+
+private:
+    int frames = 0;
+    double period = 0.0;
+    double output_latency = 0.0;
+    double input_latency = 0.0;
+    std::atomic<int64_t> callbacks{ 0 };
+    std::atomic<int64_t> histogram[CALLBACK_HISTOGRAM_BUCKETS];
+    std::atomic<double> callback_seconds{ 0.0 };
+    std::atomic<double> max_callback_seconds{ 0.0 };
+    std::atomic<int64_t> output_underflows{ 0 };
+    std::atomic<int64_t> output_overflows{ 0 };
+    std::atomic<int64_t> input_underflows{ 0 };
+    std::atomic<int64_t> input_overflows{ 0 };
+    std::atomic<int64_t> priming_buffers{ 0 };
+    std::atomic<int64_t> ring_underruns{ 0 };
+    std::atomic<int64_t> ring_frames_total{ 0 };
+    std::atomic<int> min_ring_frames{ 0 };
+};
+
+//Size of the audio sample ring in sample frames (about 3 seconds at 44.1kHz), must be a power of two
+extern const int AUDIO_RING_CAPACITY;
+
+//Layouts a decoded frame can be stored in. FRAME_RGB0 is converted on the CPU by sws_scale, the YUV layouts keep the decoder's planes packed one after another and are converted to RGB in yuv_fragmentShaderSource
+enum frame_layout {
+    FRAME_RGB0,
+    FRAME_YUV420P,
+    FRAME_NV12
+};
+
+//Color matrices the YUV shader can convert with
+enum color_matrix {
+    COLOR_MATRIX_BT601,
+    COLOR_MATRIX_BT709
+};
+
+//Video_Frame object stores one decoded frame's pixel data, its layout and size, and the time (in seconds) it should be shown
+//Mapped frames point straight into a frame cache file instead of a pooled buffer, release_video_frame() only hands pooled ones back
 typedef struct {
-    float left_sound;
-    float right_sound;
     double timestamp;
-} Sound_Data;
+    uint8_t* frame_data;
+    frame_layout layout;
+    int width;
+    int height;
+    bool mapped;
+} Video_Frame;
+
+//Fixed-size ring of decoded frames that the background decoder thread fills ahead of the playhead
+//push() blocks while the ring is full and pop() blocks while it is empty, so memory use depends on the ring size and not the song length
+class video_frame_ring {
+public:
+    void reset(int capacity);
+    bool push(Video_Frame frame);
+    bool pop(Video_Frame& frame);
+    bool front(Video_Frame& frame);
+    bool ready();
+    void finish();
+    void stop();
+    int size();
+
+private:
+    std::vector<Video_Frame> frames;
+    int head = 0;
+    int count = 0;
+    bool finished = false;
+    bool stopped = false;
+    std::mutex ring_mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+//Counters for the frame pool, allocations should stop growing once playback reaches a steady state
+typedef struct {
+    int buffers_in_use;
+    int high_water_mark;
+    int buffers_allocated;
+    long long total_allocations;
+    long long total_acquires;
+    long long mapped_acquires;
+} Frame_Pool_Stats;
+
+//Pool of page-aligned frame buffers that are all the size of one frame at the current resolution and layout
+//Buffers are handed out to the decoder with acquire() and handed back by the renderer with release() once the frame is uploaded
+//The pool only frees and reallocates buffers when configure() is called with a different resolution or layout
+//The renderer also lends the pool pixel buffer objects it has mapped (add_mapped()), which are handed out first so the decoder writes frames straight into GL memory
+//The renderer takes those back with retire_mapped() when it unmaps one to upload it, and collects the ones too small for a new resolution with take_unused_mapped()
+class video_frame_pool {
+public:
+    void configure(int width, int height, frame_layout layout);
+    size_t frame_size();
+    uint8_t* acquire();
+    void release(uint8_t* frame_data);
+    void add_mapped(uint8_t* buffer, size_t capacity);
+    bool retire_mapped(uint8_t* buffer);
+    void take_unused_mapped(std::vector<uint8_t*>& buffers);
+    void take_all_mapped(std::vector<uint8_t*>& buffers);
+    Frame_Pool_Stats stats();
+    void print_stats();
+
+private:
+    size_t buffer_size = 0;
+    std::vector<uint8_t*> free_buffers;
+    std::unordered_set<uint8_t*> owned_buffers;
+    std::vector<uint8_t*> free_mapped;
+    std::vector<uint8_t*> unused_mapped;
+    std::unordered_map<uint8_t*, size_t> mapped_buffers;
+    Frame_Pool_Stats counters = { 0, 0, 0, 0, 0, 0 };
+    std::mutex pool_mutex;
+};
+
+//Queue of compressed packets for one stream, filled by the demuxer thread and drained by that stream's decoder
+//The demuxer stops reading once every queue has_enough() packets buffered, so a decoder that is keeping up never waits on the file, or once any queue is_full()
+class packet_queue {
+public:
+    void reset();
+    bool push(AVPacket* packet);
+    bool pop(AVPacket* packet);
+    bool has_enough();
+    bool is_full();
+    void finish();
+    void stop();
+
+private:
+    std::queue<AVPacket*> packets;
+    int64_t bytes = 0;
+    bool finished = false;
+    bool stopped = false;
+    std::mutex queue_mutex;
+    std::condition_variable not_empty;
+};
+
+//Stream information for the song being demuxed, filled in by open_song() before either decoder starts
+//A stream index of -1 means the file has no stream of that type
+typedef struct {
+    int video_stream_index;
+    int audio_stream_index;
+    AVCodecParameters* video_params;
+    AVCodecParameters* audio_params;
+    AVRational video_time_base;
+    AVRational audio_time_base;
+} Song_Streams;
+
+//One video keyframe, pts is in the video stream's time base and position is its byte offset in the file
+typedef struct {
+    int64_t pts;
+    int64_t position;
+} Keyframe;
+
+//Keyframes of the open song in pts order, filled in by the demuxer as it reads and saved next to the song file once it has seen all of them
+//seek_song() uses it to land exactly on the keyframe before the target, a target past the last keyframe seen so far is left to ffmpeg's own seek
+class keyframe_index {
+public:
+    void reset();
+    void add(int64_t pts, int64_t position);
+    bool find(int64_t target_pts, Keyframe& keyframe);
+    bool load(const std::string& path, int64_t source_size, int64_t source_time);
+    bool save(const std::string& path, int64_t source_size, int64_t source_time);
+    size_t size();
+    void set_complete(bool complete);
+    bool is_complete();
+
+private:
+    std::vector<Keyframe> keyframes;
+    bool complete = false;
+};
+
+//Seek counters since the program started, latency is from seek_song() being called to seek_ready() finding the first frame at the target ready to show
+//frames_skipped is counted on the video decoder thread
+typedef struct {
+    int64_t seeks;
+    std::atomic<int64_t> frames_skipped;
+    double total_seconds;
+    double max_seconds;
+} Seek_Stats;
+
+//I/O counters for the song being demuxed, demux_seconds only counts time spent inside av_read_frame
+typedef struct {
+    int64_t bytes_read;
+    int64_t packets_read;
+    double demux_seconds;
+} Demux_Stats;
+
+//How a codec's decoder splits its work between threads, AUTO lets the decoder use frame and slice threading where it supports them
+enum decoder_thread_type {
+    DECODER_THREADS_AUTO,
+    DECODER_THREADS_FRAME,
+    DECODER_THREADS_SLICE
+};
+
+//Threading settings for one codec, set with set_decoder_config() using the codec's ffmpeg name (e.g. "h264", "hevc")
+typedef struct {
+    int thread_count;
+    decoder_thread_type thread_type;
+} Decoder_Config;
+
+//Video decoding counters for the current song, decode_seconds leaves out time spent waiting on the demuxer or for room in the ring
+//from_cache is set when the song's frames came out of the frame cache instead of the decoder
+//The decoder thread adds to the first two while the main thread prints them, so they're atomic. The rest are only set while no decoder thread is running
+typedef struct {
+    std::atomic<int64_t> frames_decoded;
+    std::atomic<double> decode_seconds;
+    double stream_fps;
+    int thread_count;
+    int active_thread_type;
+    bool from_cache;
+} Video_Decode_Stats;
+
+//Where the next queued song is in being opened by prefetch_song()
+enum prefetch_state {
+    PREFETCH_NONE,
+    PREFETCH_LOADING,
+    PREFETCH_READY,
+    PREFETCH_FAILED
+};
+
+//Everything prefetch_song() has opened and decoded of the next song, handed over to the decoders by switch_to_prefetched_song()
+//Packets read after the pre-rolled frames are kept so the demuxer carries on from where the prefetch stopped reading, bytes counts all of it against PREFETCH_MEMORY_LIMIT
+typedef struct {
+    std::string filepath;
+    AVFormatContext* format_context;
+    Song_Streams streams;
+    keyframe_index keyframes;
+    AVCodecContext* video_codec_context;
+    AVCodecContext* audio_codec_context;
+    SwrContext* resampler;
+    std::vector<AVPacket*> video_packets;
+    std::vector<AVPacket*> audio_packets;
+    std::vector<AVFrame*> video_frames;
+    std::vector<AVFrame*> audio_frames;
+    size_t bytes;
+    double prefetch_seconds;
+} Prefetched_Song;
+
+//Number of packets each queue buffers before the demuxer waits
+//A queue holding PACKET_QUEUE_MAX_BYTES also makes the demuxer wait, even if the other queue is short, so a file with one stream stored far ahead of the other can't fill memory
+extern const int PACKET_QUEUE_TARGET;
+extern const int64_t PACKET_QUEUE_MAX_BYTES;
+
+//Number of frames the decoder is allowed to get ahead of the playhead (about 2 seconds of 30fps video)
+extern const int VIDEO_RING_CAPACITY;
+
+//Most memory a prefetched song is allowed to hold in packets and decoded frames
+extern const size_t PREFETCH_MEMORY_LIMIT;
 
 //External video variables
-extern std::map<double, uint8_t*> video_frame_map;
-extern std::map<double, uint8_t*>::iterator video_frame_iterator;
+extern video_frame_ring video_frames;
+extern video_frame_pool frame_pool;
+
+//External demuxing variables
+extern packet_queue video_packets;
+extern packet_queue audio_packets;
+extern Song_Streams song_streams;
+extern Demux_Stats demux_stats;
+extern keyframe_index song_keyframes;
+extern Seek_Stats seek_stats;
+
+//External decoder variables
+extern Video_Decode_Stats video_decode_stats;
 extern int video_width, video_height;
 
-//External audio variable
-extern std::queue<Sound_Data> sample_queue;
+//When true, YUV420P and NV12 streams are uploaded as planes and converted on the GPU, everything else falls back to sws_scale
+extern bool gpu_yuv_conversion;
+extern color_matrix video_color_matrix;
+extern bool video_full_range;
+
+//External audio variables, output_sample_rate is the default output device's rate that every song is converted to
+extern audio_sample_ring audio_samples;
+extern int output_sample_rate;
+extern playback_clock audio_clock;
+extern audio_callback_recorder callback_recorder;
+
+//Seconds between the audio stats lines log_audio_stats() prints while a song plays, 0 leaves them off
+extern double audio_stats_interval;
+
+//Length of the crossfade between queued songs in seconds, 0 switches straight from the last sample of one song to the first of the next
+extern double crossfade_seconds;
+
+//playback_time() keeps counting up across gapless song changes, song_time_offset is where the current song started on that clock
+extern double song_time_offset;
 
+//Limits for the key and tempo of the playing song, set_key_shift() and set_tempo() clamp to them
+extern const int MAX_KEY_SHIFT;
+extern const double MIN_TEMPO;
+extern const double MAX_TEMPO;
+
+
+//Demuxing functions
+bool song_file_identity(const std::string& filepath, int64_t& size, int64_t& time);
+uint64_t fnv1a_hash(const char* text, uint64_t hash = 14695981039346656037ULL);
+bool open_song(const char* filepath);
+void close_song();
+void print_demux_stats();
+double song_duration();
+double song_position();
+bool seek_song(double position);
+bool seek_ready();
+void print_seek_stats();
+
+//Song prefetching functions
+bool prefetch_song(const char* filepath);
+prefetch_state get_prefetch_state();
+void cancel_prefetch();
+bool prefetched_song_can_follow();
+bool switch_to_prefetched_song();
+
+//Decoder configuration functions
+Decoder_Config default_decoder_config();
+void set_decoder_config(const std::string& codec_name, Decoder_Config config);
+Decoder_Config get_decoder_config(const std::string& codec_name);
 
 //Decoding functions
-bool decode_video(const char* filepath);
-bool decode_audio(const char* filepath);
+bool decode_video();
+void stop_video_decoding();
+size_t frame_buffer_size(int width, int height, frame_layout layout);
+void release_video_frame(Video_Frame& frame);
+frame_layout layout_for_format(int pixel_format);
+double video_frame_timestamp(AVFrame* av_frame, AVRational time_base);
+bool convert_video_frame(AVFrame* av_frame, frame_layout layout, uint8_t* frame_data, SwsContext** sws_scaler_context);
+AVCodecContext* open_video_decoder(AVCodecParameters* av_codec_params, bool single_thread);
+void print_video_decode_stats();
+AVCodecContext* open_audio_decoder(AVCodecParameters* av_codec_params_audio);
+bool decode_audio();
+void stop_audio_decoding();
+bool audio_decoding_finished();
+void set_song_loudness(const std::string& song_path, double integrated_lufs, double true_peak_dbtp);
+
+//Key, tempo and vocal reduction functions, changes are heard within the audio lookahead
+void set_key_shift(int semitones);
+int get_key_shift();
+void set_tempo(double tempo);
+double get_tempo();
+void set_vocal_reduction(bool enabled);
+bool get_vocal_reduction();
+void print_pitch_stage_stats();
 
 static int patestCallback(const void* inputBuffer, void* outputBuffer, unsigned long framesPerBuffer, const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags, void* userData);
 
 void initialize_audio(PaStream** stream);
 
 void stop_audio(PaStream** stream);
+
+//Audio stream health functions, adapt_audio_buffer() reopens the stream with bigger buffers when underruns keep happening
+Audio_Callback_Stats get_audio_callback_stats();
+void print_audio_callback_stats();
+void log_audio_stats();
+bool adapt_audio_buffer(PaStream** stream);
+
+double playback_time();
+double playback_speed();
@@ -0,0 +1,467 @@
+#include "frame_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <algorithm>
+#include <filesystem>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+static const char FRAME_CACHE_MAGIC[4] = { 'K', 'F', 'C', 'F' };
+static const uint32_t FRAME_CACHE_VERSION = 1;
+
+//Frames in a cache file are padded out to the page size so every frame starts on its own page, like the frame pool's buffers
+static const uint64_t FRAME_CACHE_PAGE = 4096;
+
+bool frame_cache_enabled = false;
+Frame_Cache_Stats frame_cache_stats = { 0, 0, 0, 0 };
+
+static std::string cache_directory;
+static uint64_t cache_budget = 0;
+
+//Background thread that builds the entries queued by queue_frame_cache_build(), one song at a time
+static std::thread builder_thread;
+static std::deque<std::string> build_queue;
+static std::mutex build_mutex;
+static std::condition_variable build_wakeup;
+static std::atomic<bool> builder_stopping(false);
+
+
+static uint64_t round_to_page(uint64_t bytes) {
+    return (bytes + FRAME_CACHE_PAGE - 1) / FRAME_CACHE_PAGE * FRAME_CACHE_PAGE;
+}
+
+//Each song's entry is named after a hash of its path, the same FNV-1a the shader cache names its files with
+static std::string cache_entry_path(const std::string& song_path) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.kfc", (unsigned long long)fnv1a_hash(song_path.c_str()));
+    return (std::filesystem::path(cache_directory) / name).string();
+}
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Mapped cache entries
+
+
+//Maps a cache file read only and checks that its header, frames and index all fit inside it
+bool mapped_frame_cache::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+    view = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle = file;
+    mapping_handle = mapping;
+    length = (uint64_t)file_size.QuadPart;
+#else
+    file_descriptor = ::open(path.c_str(), O_RDONLY);
+    if (file_descriptor < 0) {
+        return false;
+    }
+    struct stat file_info;
+    if (fstat(file_descriptor, &file_info) != 0 || file_info.st_size <= 0) {
+        close();
+        return false;
+    }
+    void* mapped = mmap(NULL, (size_t)file_info.st_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+    if (mapped == MAP_FAILED) {
+        close();
+        return false;
+    }
+    view = (uint8_t*)mapped;
+    length = (uint64_t)file_info.st_size;
+
+    //Frames are read front to back as the song plays, so the kernel can read ahead of the playhead
+    madvise(view, (size_t)length, MADV_SEQUENTIAL);
+#endif
+
+    Frame_Cache_Header cache_header = header();
+    bool valid = length >= sizeof(Frame_Cache_Header) && memcmp(cache_header.magic, FRAME_CACHE_MAGIC, 4) == 0 && cache_header.version == FRAME_CACHE_VERSION
+        && cache_header.frame_count >= 0 && cache_header.frames_offset % FRAME_CACHE_PAGE == 0 && cache_header.frame_stride % FRAME_CACHE_PAGE == 0
+        && cache_header.frame_stride >= frame_buffer_size(cache_header.width, cache_header.height, (frame_layout)cache_header.layout)
+        && cache_header.frames_offset + cache_header.frame_stride * (uint64_t)cache_header.frame_count <= cache_header.index_offset
+        && cache_header.index_offset + sizeof(double) * (uint64_t)cache_header.frame_count <= length;
+    if (!valid) {
+        close();
+    }
+    return valid;
+}
+
+void mapped_frame_cache::close() {
+#ifdef _WIN32
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+    }
+    if (mapping_handle != NULL) {
+        CloseHandle((HANDLE)mapping_handle);
+    }
+    if (file_handle != NULL) {
+        CloseHandle((HANDLE)file_handle);
+    }
+    mapping_handle = NULL;
+    file_handle = NULL;
+#else
+    if (view != NULL) {
+        munmap(view, (size_t)length);
+    }
+    if (file_descriptor >= 0) {
+        ::close(file_descriptor);
+    }
+    file_descriptor = -1;
+#endif
+    view = NULL;
+    length = 0;
+}
+
+bool mapped_frame_cache::is_open() {
+    return view != NULL;
+}
+
+Frame_Cache_Header mapped_frame_cache::header() {
+    Frame_Cache_Header cache_header;
+    memset(&cache_header, 0, sizeof(cache_header));
+    if (view != NULL && length >= sizeof(cache_header)) {
+        memcpy(&cache_header, view, sizeof(cache_header));
+    }
+    return cache_header;
+}
+
+int mapped_frame_cache::frame_count() {
+    return (int)header().frame_count;
+}
+
+double mapped_frame_cache::timestamp(int frame) {
+    double frame_timestamp;
+    memcpy(&frame_timestamp, view + header().index_offset + sizeof(double) * frame, sizeof(double));
+    return frame_timestamp;
+}
+
+//Pointer to the frame's pixels inside the mapping, pages are only read from disk when the renderer touches them
+uint8_t* mapped_frame_cache::frame(int frame) {
+    Frame_Cache_Header cache_header = header();
+    return view + cache_header.frames_offset + cache_header.frame_stride * (uint64_t)frame;
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Building and evicting entries
+
+
+//Decodes every video frame of a song on one thread and writes them into a new cache entry, which only replaces the old one once it is complete
+//Returns false if the song couldn't be decoded, would take more than the whole budget, or the builder was stopped
+static bool build_cache_entry(const std::string& song_path) {
+    int64_t source_size, source_time;
+    if (!song_file_identity(song_path, source_size, source_time)) {
+        return false;
+    }
+    std::string entry_path = cache_entry_path(song_path);
+    std::string temp_path = entry_path + ".tmp";
+
+    AVFormatContext* format_context = NULL;
+    if (avformat_open_input(&format_context, song_path.c_str(), NULL, NULL) != 0) {
+        return false;
+    }
+    if (avformat_find_stream_info(format_context, NULL) < 0) {
+        avformat_close_input(&format_context);
+        return false;
+    }
+    int stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        avformat_close_input(&format_context);
+        return false;
+    }
+    AVStream* video_stream = format_context->streams[stream_index];
+    AVCodecParameters* params = video_stream->codecpar;
+
+    //Songs that would fill the whole budget on their own aren't worth caching
+    frame_layout layout = layout_for_format(params->format);
+    uint64_t frame_stride = round_to_page(frame_buffer_size(params->width, params->height, layout));
+    double frame_rate = video_stream->avg_frame_rate.den != 0 ? video_stream->avg_frame_rate.num / (double)video_stream->avg_frame_rate.den : 0.0;
+    double duration = format_context->duration != AV_NOPTS_VALUE ? format_context->duration / (double)AV_TIME_BASE : 0.0;
+    if (frame_stride * frame_rate * duration > (double)cache_budget) {
+        std::cout << "Frame cache: " << song_path << " is too big to cache" << std::endl;
+        avformat_close_input(&format_context);
+        return false;
+    }
+
+    //Only the video is needed, so the demuxer skips every other stream
+    for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+        if ((int)i != stream_index) {
+            format_context->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    AVCodecContext* codec_context = open_video_decoder(params, true);
+    FILE* file = codec_context != NULL ? fopen(temp_path.c_str(), "wb") : NULL;
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    bool ok = file != NULL && packet != NULL && frame != NULL;
+
+    //The header is written again with the frame count once every frame is in, for now it just holds the first page
+    Frame_Cache_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_CACHE_MAGIC, 4);
+    header.version = FRAME_CACHE_VERSION;
+    header.width = params->width;
+    header.height = params->height;
+    header.layout = layout;
+    header.frame_stride = frame_stride;
+    header.frames_offset = FRAME_CACHE_PAGE;
+    header.source_size = source_size;
+    header.source_time = source_time;
+    std::vector<uint8_t> page(FRAME_CACHE_PAGE, 0);
+    if (ok) {
+        ok = fwrite(page.data(), 1, page.size(), file) == page.size();
+    }
+
+    std::vector<uint8_t> frame_data(frame_stride, 0);
+    std::vector<double> timestamps;
+    SwsContext* sws_scaler_context = NULL;
+    bool draining = false;
+    while (ok && !draining && !builder_stopping) {
+        int response = av_read_frame(format_context, packet);
+        if (response >= 0 && packet->stream_index != stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+        draining = response < 0;
+        response = avcodec_send_packet(codec_context, draining ? NULL : packet);
+        av_packet_unref(packet);
+        if (response < 0 && response != AVERROR(EAGAIN)) {
+            ok = false;
+            break;
+        }
+        while (ok && avcodec_receive_frame(codec_context, frame) >= 0) {
+            //Every frame in an entry has the same size, a stream that changes resolution isn't cached
+            ok = frame->width == header.width && frame->height == header.height
+                && convert_video_frame(frame, layout, frame_data.data(), &sws_scaler_context)
+                && fwrite(frame_data.data(), 1, frame_data.size(), file) == frame_data.size();
+            timestamps.push_back(video_frame_timestamp(frame, video_stream->time_base));
+            av_frame_unref(frame);
+        }
+    }
+    ok = ok && !builder_stopping;
+
+    if (ok) {
+        header.frame_count = (int64_t)timestamps.size();
+        header.index_offset = header.frames_offset + frame_stride * timestamps.size();
+        memcpy(page.data(), &header, sizeof(header));
+        ok = fwrite(timestamps.data(), sizeof(double), timestamps.size(), file) == timestamps.size()
+            && fseek(file, 0, SEEK_SET) == 0 && fwrite(page.data(), 1, page.size(), file) == page.size();
+    }
+    if (file != NULL && fclose(file) != 0) {
+        ok = false;
+    }
+
+    sws_freeContext(sws_scaler_context);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&codec_context);
+    avformat_close_input(&format_context);
+
+    std::error_code error;
+    if (ok) {
+        std::filesystem::remove(entry_path, error);
+        std::filesystem::rename(temp_path, entry_path, error);
+        ok = !error;
+    }
+    if (!ok) {
+        std::filesystem::remove(temp_path, error);
+    }
+    return ok;
+}
+
+
+//Deletes the least recently played entries until the cache fits its budget, keep_path is never deleted
+//Playing an entry touches its modification time, so that is what the entries are ordered by
+static void evict_cache_entries(const std::string& keep_path) {
+    typedef struct {
+        std::filesystem::path path;
+        uint64_t size;
+        std::filesystem::file_time_type last_played;
+    } Cache_Entry;
+
+    std::vector<Cache_Entry> entries;
+    uint64_t total = 0;
+    std::error_code error;
+    for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator(cache_directory, error)) {
+        if (file.path().extension() != ".kfc") {
+            continue;
+        }
+        Cache_Entry entry = { file.path(), (uint64_t)file.file_size(error), file.last_write_time(error) };
+        total += entry.size;
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), [](const Cache_Entry& a, const Cache_Entry& b) { return a.last_played < b.last_played; });
+
+    for (Cache_Entry& entry : entries) {
+        if (total <= cache_budget) {
+            break;
+        }
+        if (entry.path == std::filesystem::path(keep_path)) {
+            continue;
+        }
+        //Windows can refuse to delete an entry that is mapped for playback, it will go on a later pass
+        if (std::filesystem::remove(entry.path, error)) {
+            total -= entry.size;
+            frame_cache_stats.entries_evicted++;
+        }
+    }
+}
+
+
+//Runs on the builder thread, building each queued song's entry and then trimming the cache back to its budget
+static void frame_cache_builder_loop() {
+    while (true) {
+        std::string song_path;
+        {
+            std::unique_lock<std::mutex> lock(build_mutex);
+            build_wakeup.wait(lock, [] { return !build_queue.empty() || builder_stopping; });
+            if (builder_stopping) {
+                return;
+            }
+            song_path = build_queue.front();
+        }
+
+        //A song can be queued again before its first entry is built, only a missing or outdated entry is built
+        mapped_frame_cache existing;
+        int64_t source_size, source_time;
+        bool current = existing.open(cache_entry_path(song_path)) && song_file_identity(song_path, source_size, source_time)
+            && existing.header().source_size == source_size && existing.header().source_time == source_time;
+        existing.close();
+        if (!current && build_cache_entry(song_path)) {
+            frame_cache_stats.entries_built++;
+            evict_cache_entries(cache_entry_path(song_path));
+        }
+
+        std::lock_guard<std::mutex> lock(build_mutex);
+        build_queue.pop_front();
+    }
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Frame cache functions
+
+
+//Turns the cache on, keeping entries in directory and deleting the least recently played ones once they take up more than budget_bytes
+void enable_frame_cache(const std::string& directory, uint64_t budget_bytes) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        std::cout << "Couldn't create frame cache directory " << directory << std::endl;
+        return;
+    }
+    cache_directory = directory;
+    cache_budget = budget_bytes;
+    frame_cache_enabled = true;
+
+    //Entries that were still being built when the program last closed are thrown away
+    for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator(cache_directory, error)) {
+        if (file.path().extension() == ".tmp") {
+            std::filesystem::remove(file.path(), error);
+        }
+    }
+}
+
+
+//Maps the song's entry if it has one that was built from the file as it is now, counting the hit or miss
+bool open_cached_frames(const std::string& song_path, mapped_frame_cache& cache) {
+    if (!frame_cache_enabled) {
+        return false;
+    }
+    std::string entry_path = cache_entry_path(song_path);
+    int64_t source_size, source_time;
+    bool hit = song_file_identity(song_path, source_size, source_time) && cache.open(entry_path);
+    if (hit) {
+        Frame_Cache_Header header = cache.header();
+        hit = header.source_size == source_size && header.source_time == source_time && (header.layout == FRAME_RGB0 || gpu_yuv_conversion);
+    }
+    if (!hit) {
+        cache.close();
+        frame_cache_stats.misses++;
+        return false;
+    }
+
+    //Marks the entry as just played so it is the last to be evicted
+    std::error_code error;
+    std::filesystem::last_write_time(entry_path, std::filesystem::file_time_type::clock::now(), error);
+    frame_cache_stats.hits++;
+    return true;
+}
+
+
+//Queues a song that just played without a cache entry to have one built in the background
+void queue_frame_cache_build(const std::string& song_path) {
+    if (!frame_cache_enabled) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(build_mutex);
+    if (std::find(build_queue.begin(), build_queue.end(), song_path) != build_queue.end()) {
+        return;
+    }
+    build_queue.push_back(song_path);
+    if (!builder_thread.joinable()) {
+        builder_stopping = false;
+        builder_thread = std::thread(frame_cache_builder_loop);
+    }
+    build_wakeup.notify_one();
+}
+
+
+//Stops the builder thread before the program exits, an entry it was in the middle of is thrown away
+void stop_frame_cache_builder() {
+    if (builder_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(build_mutex);
+            builder_stopping = true;
+        }
+        build_wakeup.notify_all();
+        builder_thread.join();
+    }
+}
+
+
+void print_frame_cache_stats() {
+    if (!frame_cache_enabled) {
+        return;
+    }
+    uint64_t used = 0;
+    std::error_code error;
+    for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator(cache_directory, error)) {
+        if (file.path().extension() == ".kfc") {
+            used += file.file_size(error);
+        }
+    }
+    std::cout << "Frame cache: " << frame_cache_stats.hits << " hits, " << frame_cache_stats.misses << " misses, " << frame_cache_stats.entries_built.load() << " built, "
+        << frame_cache_stats.entries_evicted.load() << " evicted, " << used / (1024 * 1024) << " MB of " << cache_budget / (1024 * 1024) << " MB used" << std::endl;
+}
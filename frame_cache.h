@@ -0,0 +1,70 @@
+#pragma once
+
+#include "decoding_func.h"
+
+#include <atomic>
+#include <string>
+
+
+//On-disk cache of the converted video frames of songs that have been played before
+//Each entry is one file holding a header, every frame already in the layout the renderer uploads (RGB0 or YUV planes) and an index of their timestamps
+//Frames start on page boundaries so a mapped entry can be handed to the renderer frame by frame with no decoding and no copying
+//Entries are built in the background after a song's first play and the least recently played ones are deleted to stay under the disk budget
+
+//Frame_Cache_Header object is the start of every cache file, the timestamp index of frame_count doubles is at index_offset and frame i is at frames_offset + i * frame_stride
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t layout;
+    int32_t reserved;
+    int64_t frame_count;
+    uint64_t frame_stride;
+    uint64_t frames_offset;
+    uint64_t index_offset;
+    int64_t source_size;
+    int64_t source_time;
+} Frame_Cache_Header;
+
+//Cache counters since the program started, a hit is a song whose video played from the cache
+//Entries are built and evicted on the builder thread while the main thread prints them, so those two are atomic
+typedef struct {
+    int64_t hits;
+    int64_t misses;
+    std::atomic<int64_t> entries_built;
+    std::atomic<int64_t> entries_evicted;
+} Frame_Cache_Stats;
+
+//One cache entry mapped into memory for as long as its song plays
+class mapped_frame_cache {
+public:
+    bool open(const std::string& path);
+    void close();
+    bool is_open();
+    int frame_count();
+    double timestamp(int frame);
+    uint8_t* frame(int frame);
+    Frame_Cache_Header header();
+
+private:
+    uint8_t* view = NULL;
+    uint64_t length = 0;
+#ifdef _WIN32
+    void* file_handle = NULL;
+    void* mapping_handle = NULL;
+#else
+    int file_descriptor = -1;
+#endif
+};
+
+//External frame cache variables, the cache is off until enable_frame_cache() is called
+extern bool frame_cache_enabled;
+extern Frame_Cache_Stats frame_cache_stats;
+
+//Frame cache functions
+void enable_frame_cache(const std::string& directory, uint64_t budget_bytes);
+bool open_cached_frames(const std::string& song_path, mapped_frame_cache& cache);
+void queue_frame_cache_build(const std::string& song_path);
+void stop_frame_cache_builder();
+void print_frame_cache_stats();
@@ -0,0 +1,247 @@
+#include "headless.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+
+bool headless_mode = false;
+
+//Script events that haven't run yet, in pass order
+static std::deque<Headless_Event> script_events;
+
+//Framebuffer everything is drawn into, and its size
+static unsigned int offscreen_framebuffer = 0;
+static unsigned int offscreen_color = 0;
+static int offscreen_width = 0;
+static int offscreen_height = 0;
+
+//Pixels read back for dumps and checksums, kept between reads
+static std::vector<uint8_t> read_pixels;
+
+//Time from the first pass drawn to the last one, for the frames per second the renderer managed
+static std::chrono::steady_clock::time_point first_pass_time;
+static std::chrono::steady_clock::time_point last_pass_time;
+static int64_t passes_run = 0;
+static int64_t frames_read = 0;
+
+
+static bool key_from_name(const std::string& name, int& key) {
+    static const std::map<std::string, int> KEY_NAMES = {
+        { "ENTER", GLFW_KEY_ENTER }, { "BACKSPACE", GLFW_KEY_BACKSPACE }, { "ESCAPE", GLFW_KEY_ESCAPE },
+        { "UP", GLFW_KEY_UP }, { "DOWN", GLFW_KEY_DOWN }, { "LEFT", GLFW_KEY_LEFT }, { "RIGHT", GLFW_KEY_RIGHT },
+        { "HOME", GLFW_KEY_HOME }, { "E", GLFW_KEY_E }, { "V", GLFW_KEY_V }, { "EQUAL", GLFW_KEY_EQUAL }, { "MINUS", GLFW_KEY_MINUS }
+    };
+    auto found = KEY_NAMES.find(name);
+    if (found == KEY_NAMES.end()) {
+        return false;
+    }
+    key = found->second;
+    return true;
+}
+
+
+//Reads the script and turns on headless mode, a line that can't be read is reported and the whole script is rejected
+bool load_headless_script(const std::string& script_path) {
+    std::ifstream script(script_path);
+    if (!script) {
+        std::cout << "Could not open headless script " << script_path << std::endl;
+        return false;
+    }
+    std::deque<Headless_Event> events;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(script, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        Headless_Event event = { 0, HEADLESS_QUIT, 0, "" };
+        std::string action;
+        if (!(fields >> event.pass >> action)) {
+            std::cout << "Headless script line " << line_number << ": expected <pass> <action>" << std::endl;
+            return false;
+        }
+        std::string argument;
+        std::getline(fields >> std::ws, argument);
+        if (action == "key") {
+            event.action = HEADLESS_KEY;
+            if (!key_from_name(argument, event.key)) {
+                std::cout << "Headless script line " << line_number << ": unknown key " << argument << std::endl;
+                return false;
+            }
+        }
+        else if (action == "text") {
+            event.action = HEADLESS_TEXT;
+            event.text = argument;
+        }
+        else if (action == "dump") {
+            event.action = HEADLESS_DUMP;
+            event.text = argument;
+        }
+        else if (action == "checksum") {
+            event.action = HEADLESS_CHECKSUM;
+        }
+        else if (action == "quit") {
+            event.action = HEADLESS_QUIT;
+        }
+        else {
+            std::cout << "Headless script line " << line_number << ": unknown action " << action << std::endl;
+            return false;
+        }
+        events.push_back(event);
+    }
+    std::stable_sort(events.begin(), events.end(), [](const Headless_Event& a, const Headless_Event& b) { return a.pass < b.pass; });
+    script_events = events;
+    headless_mode = true;
+    return true;
+}
+
+
+//Called before glfwInit(), asks for the null platform so GLFW doesn't connect to a display server. GLFWs before 3.4 don't have it and use the usual platform
+void set_headless_init_hints() {
+#ifdef GLFW_PLATFORM_NULL
+    glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
+}
+
+//Called before the window is created, it stays hidden and asks for an EGL context, or OSMesa's software context if EGL couldn't make one
+//On the null platform EGL contexts are surfaceless, a Mesa without EGL still has OSMesa
+void set_headless_window_hints(bool software_context) {
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+#if defined(GLFW_OSMESA_CONTEXT_API) && defined(GLFW_EGL_CONTEXT_API)
+    glfwWindowHint(GLFW_CONTEXT_CREATION_API, software_context ? GLFW_OSMESA_CONTEXT_API : GLFW_EGL_CONTEXT_API);
+#endif
+}
+
+
+//Makes the framebuffer every frame is drawn into, the same size the window would have been
+bool create_offscreen_target(int width, int height) {
+    glGenFramebuffers(1, &offscreen_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, offscreen_framebuffer);
+    glGenRenderbuffers(1, &offscreen_color);
+    glBindRenderbuffer(GL_RENDERBUFFER, offscreen_color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreen_color);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "Offscreen framebuffer is incomplete" << std::endl;
+        destroy_offscreen_target();
+        return false;
+    }
+    offscreen_width = width;
+    offscreen_height = height;
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+void destroy_offscreen_target() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (offscreen_framebuffer != 0) {
+        glDeleteFramebuffers(1, &offscreen_framebuffer);
+        offscreen_framebuffer = 0;
+    }
+    if (offscreen_color != 0) {
+        glDeleteRenderbuffers(1, &offscreen_color);
+        offscreen_color = 0;
+    }
+}
+
+
+//Hands out the key, text and quit events for this pass one at a time, in script order. Dumps and checksums are left for run_headless_output()
+//Called at the start of every pass, which also counts the pass
+bool next_headless_input(int64_t pass, Headless_Event& event) {
+    auto now = std::chrono::steady_clock::now();
+    if (passes_run == 0) {
+        first_pass_time = now;
+    }
+    if (pass >= passes_run) {
+        passes_run = pass + 1;
+        last_pass_time = now;
+    }
+    for (auto queued = script_events.begin(); queued != script_events.end() && queued->pass <= pass; queued++) {
+        if (queued->action != HEADLESS_DUMP && queued->action != HEADLESS_CHECKSUM) {
+            event = *queued;
+            script_events.erase(queued);
+            return true;
+        }
+    }
+    return false;
+}
+
+//Called once the pass has drawn its frame, before it is swapped
+void run_headless_output(int64_t pass) {
+    while (!script_events.empty() && script_events.front().pass <= pass &&
+        (script_events.front().action == HEADLESS_DUMP || script_events.front().action == HEADLESS_CHECKSUM)) {
+        Headless_Event event = script_events.front();
+        script_events.pop_front();
+        if (event.action == HEADLESS_DUMP) {
+            if (!dump_offscreen_frame(event.text)) {
+                std::cout << "Could not write frame " << pass << " to " << event.text << std::endl;
+            }
+        }
+        else {
+            printf("Frame %lld checksum %016llx\n", (long long)pass, (unsigned long long)offscreen_frame_checksum());
+        }
+    }
+}
+
+
+static void read_offscreen_pixels() {
+    read_pixels.resize((size_t)offscreen_width * offscreen_height * 4);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, offscreen_framebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, offscreen_width, offscreen_height, GL_RGBA, GL_UNSIGNED_BYTE, read_pixels.data());
+    frames_read++;
+}
+
+//64 bit FNV-1a over the frame's RGBA pixels, bottom row first as OpenGL reads them
+uint64_t offscreen_frame_checksum() {
+    read_offscreen_pixels();
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint8_t byte : read_pixels) {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//Writes the frame as a binary PPM, flipped so the top row comes first
+bool dump_offscreen_frame(const std::string& path) {
+    read_offscreen_pixels();
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", offscreen_width, offscreen_height);
+    std::vector<uint8_t> row((size_t)offscreen_width * 3);
+    for (int y = offscreen_height - 1; y >= 0; y--) {
+        const uint8_t* source = &read_pixels[(size_t)y * offscreen_width * 4];
+        for (int x = 0; x < offscreen_width; x++) {
+            row[x * 3] = source[x * 4];
+            row[x * 3 + 1] = source[x * 4 + 1];
+            row[x * 3 + 2] = source[x * 4 + 2];
+        }
+        fwrite(row.data(), 1, row.size(), file);
+    }
+    bool written = ferror(file) == 0;
+    fclose(file);
+    return written;
+}
+
+
+//Prints how fast the passes went, with no vsync this is the renderer's throughput
+void print_headless_stats() {
+    if (passes_run < 2) {
+        return;
+    }
+    double seconds = std::chrono::duration<double>(last_pass_time - first_pass_time).count();
+    std::cout << "Headless: " << passes_run << " passes in " << seconds << " s (" << (seconds > 0.0 ? (passes_run - 1) / seconds : 0.0) << " per second), "
+        << frames_read << " frames read back" << std::endl;
+    if (!script_events.empty()) {
+        std::cout << "Headless: " << script_events.size() << " script events never ran" << std::endl;
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "opengl_funcs.h"
+
+#include <string>
+
+
+//Headless mode runs the same state machine and renderer with no visible window, for benchmarks and pixel regression tests on machines with no display or GPU
+//With GLFW 3.4 or later GLFW runs on its null platform, so no display server is needed, and the context comes from EGL's surfaceless platform or failing that OSMesa,
+//where Mesa's software rasterizer can stand in for a GPU. Older GLFWs have no null platform and still need a display (Xvfb works) for the hidden window
+//Every frame is drawn into an offscreen framebuffer with vsync off
+//Input comes from a script with one event per line, each at a pass of the render loop:
+//  <pass> key <ENTER|BACKSPACE|ESCAPE|UP|DOWN|LEFT|RIGHT|HOME|E|V|EQUAL|MINUS>
+//  <pass> text <characters typed>
+//  <pass> dump <file.ppm>
+//  <pass> checksum
+//  <pass> quit
+//Dumps and checksums are of the frame drawn in that pass, taken before it is swapped
+
+enum headless_action {
+    HEADLESS_KEY,
+    HEADLESS_TEXT,
+    HEADLESS_DUMP,
+    HEADLESS_CHECKSUM,
+    HEADLESS_QUIT
+};
+
+//Headless_Event object is one line of the script
+typedef struct {
+    int64_t pass;
+    headless_action action;
+    int key;
+    std::string text;
+} Headless_Event;
+
+//External headless variables, headless_mode is off until load_headless_script() succeeds
+extern bool headless_mode;
+
+//Headless functions
+bool load_headless_script(const std::string& script_path);
+void set_headless_init_hints();
+void set_headless_window_hints(bool software_context);
+bool create_offscreen_target(int width, int height);
+void destroy_offscreen_target();
+bool next_headless_input(int64_t pass, Headless_Event& event);
+void run_headless_output(int64_t pass);
+uint64_t offscreen_frame_checksum();
+bool dump_offscreen_frame(const std::string& path);
+void print_headless_stats();
@@ -14,6 +14,13 @@
 //My created headers
 #include "opengl_funcs.h"
 #include "decoding_func.h"
+#include "audio_dsp.h"
+#include "frame_cache.h"
+#include "pitch_shift.h"
+#include "mic_monitor.h"
+#include "loudness.h"
+#include "headless.h"
+#include "lyrics.h"
 
 
 //FFMPEG testing
@@ -28,6 +35,13 @@ extern "C" {
 #include <inttypes.h>
 #include <map>
 #include <thread>
+#include <deque>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 //States for the program, you either are in main menu, in a song search process, or playing a song
 enum state {
@@ -55,31 +69,149 @@ void character_callback(GLFWwindow* window, unsigned int key);
 //Callback for keys during program navigation
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 
+//Asks for the menu to be drawn again when the window has been uncovered or restored
+void window_refresh_callback(GLFWwindow* window);
+
+//Sends a headless script's key, text or quit event to the window as if it had been typed
+void run_headless_event(GLFWwindow* window, const Headless_Event& event);
+
+//Prints the playback stats of the song that just ended, whether it was stopped or the next queued song followed it without a gap
+void print_song_stats();
+
+//CPU time every thread of the process has used so far, in seconds
+double process_cpu_seconds();
+
+//Adds one pass of the render loop in a menu state to menu_render_stats, and prints them
+void count_menu_pass(std::chrono::steady_clock::time_point pass_start, double cpu_start, bool drew);
+void print_menu_render_stats();
+
+//Gets a queued song's stored loudness for playback, or has it measured in the background if it has none yet
+void load_song_loudness(const std::string& song);
+
+//Saves the loudness of songs the background analysis has finished with their rows
+void store_loudness_results();
+
+//Measures every song in the library that has no stored loudness, then reports how long it took
+void analyze_library();
+
 //String to track user input and a mysql string object to plug into song search sql functions
 std::string user_text_input;
 string user_text_submission;
 
-//Map of generated objects used in character generation
-std::map<char, Character> characters;
+//Songs picked from the results waiting to be played, the front one is prefetched PREFETCH_LEAD_SECONDS before the current song ends so it follows without a gap
+std::deque<std::string> song_queue;
+const double PREFETCH_LEAD_SECONDS = 10.0;
+
+//Position the singer asked to skip to with the arrow keys (or Home to restart), -1 when there is no seek waiting
+double requested_seek = -1.0;
+const double SEEK_STEP_SECONDS = 10.0;
+
+//Menu states are only drawn again when input, a window event or a state change asks for it, otherwise the loop sleeps in glfwWaitEventsTimeout
+//It still wakes every MENU_TICK_SECONDS for background work like storing loudness results, SONG_PLAYING renders continuously
+bool redraw_requested = true;
+state drawn_state = MAIN_MENU;
+const double MENU_TICK_SECONDS = 0.5;
+
+//Time spent in menu states, the process CPU time used in it (every thread, so a running loudness analysis shows up too), frames drawn and wakeups that drew nothing
+typedef struct {
+    double seconds;
+    double cpu_seconds;
+    int64_t frames;
+    int64_t idle_wakeups;
+} Menu_Render_Stats;
+
+Menu_Render_Stats menu_render_stats = { 0.0, 0.0, 0, 0 };
+
+//Up and Down move the key a semitone at a time, + and - change the tempo by this much
+const double TEMPO_STEP = 0.05;
+
+//Disk space the frame cache may use when it is turned on with "--frame-cache <directory>"
+const uint64_t FRAME_CACHE_BUDGET = 20ULL * 1024 * 1024 * 1024;
+
+//Glyphs of the fonts text is drawn with, rasterized as code points are first drawn
+glyph_cache characters;
 int text_vertexShader;
 int text_fragmentShader;
 int text_shaderProgram;
 unsigned int text_VAO, text_VBO;
 
 
-int main()
+int main(int argc, char** argv)
 {
 
+    //Picks the SIMD audio kernels for this CPU, "--benchmark-audio" times them against the scalar loops and exits without opening a window
+    select_audio_kernels();
+    if (argc > 1 && std::string(argv[1]) == "--benchmark-audio") {
+        benchmark_audio_kernels();
+        benchmark_pitch_stage();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--analyze-library") {
+        analyze_library();
+        my_session.close();
+        return 0;
+    }
+
+    //Songs that have been played before can have their video played from already converted frames on disk
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--frame-cache") {
+            enable_frame_cache(argv[i + 1], FRAME_CACHE_BUDGET);
+        }
+        //"--mic <frames per buffer>" monitors the default input device's mics through the speakers, 64 frames is a good start
+        if (std::string(argv[i]) == "--mic") {
+            enable_mic_monitoring(atoi(argv[i + 1]));
+        }
+        //"--audio-stats <seconds>" prints a line of audio callback stats that often while a song plays
+        if (std::string(argv[i]) == "--audio-stats") {
+            audio_stats_interval = atof(argv[i + 1]);
+        }
+        //"--decoder-threads <codec> <count> <frame|slice|auto>" sets the threading a codec (h264, hevc, vp9...) is decoded with, other codecs keep a thread per core
+        if (std::string(argv[i]) == "--decoder-threads" && i + 3 < argc) {
+            std::string thread_type = argv[i + 3];
+            if (thread_type != "frame" && thread_type != "slice" && thread_type != "auto") {
+                std::cout << "--decoder-threads <codec> <count> <frame|slice|auto>" << std::endl;
+                return 1;
+            }
+            Decoder_Config config;
+            config.thread_count = std::max(1, atoi(argv[i + 2]));
+            config.thread_type = thread_type == "frame" ? DECODER_THREADS_FRAME : thread_type == "slice" ? DECODER_THREADS_SLICE : DECODER_THREADS_AUTO;
+            set_decoder_config(argv[i + 1], config);
+        }
+        //"--crossfade <seconds>" fades each queued song in over the end of the last one, 0 (the default) plays them back to back
+        if (std::string(argv[i]) == "--crossfade") {
+            crossfade_seconds = std::max(0.0, atof(argv[i + 1]));
+        }
+        //"--headless <script>" runs with no visible window, drawing offscreen and taking its input from the script (see headless.h)
+        if (std::string(argv[i]) == "--headless" && !load_headless_script(argv[i + 1])) {
+            return 1;
+        }
+    }
+
 
     //Initializing of the window that everything will be rendered in and interacted with
 
-    glfwInit();
+    if (headless_mode) {
+        set_headless_init_hints();
+    }
+    if (!glfwInit())
+    {
+        std::cout << "Failed to initialize GLFW" << std::endl;
+        return -1;
+    }
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+    if (headless_mode) {
+        set_headless_window_hints(false);
+    }
+
     // glfw window creation
     GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+    if (window == NULL && headless_mode) {
+        set_headless_window_hints(true);
+        window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+    }
     if (window == NULL)
     {
         std::cout << "Failed to create GLFW window" << std::endl;
@@ -97,38 +229,58 @@ int main()
         return -1;
     }
 
+    //Swaps wait for the vblank from here on, video frames are picked for the vblank they'll be shown at
+    //Headless runs draw into an offscreen framebuffer as fast as they can instead
+    if (!headless_mode) {
+        start_frame_pacing();
+    }
+    else {
+        glfwSwapInterval(0);
+        if (!create_offscreen_target(SCR_WIDTH, SCR_HEIGHT)) {
+            glfwTerminate();
+            return -1;
+        }
+    }
+
 
 ////****************    Text creation shaders and shader program
 //
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    int text_vertexShader = vertex_shader_creator(text_vertexShaderSource);
-    int text_fragmentShader = fragment_shader_creator(text_fragmentShaderSource);
-    int text_shaderProgram = shader_program_creator(text_vertexShader, text_fragmentShader);
+    int text_shaderProgram = shader_program_from_sources(text_vertexShaderSource, text_fragmentShaderSource);
     unsigned int text_VAO, text_VBO;
 
-    std::map<char, Character> characters = text_component_generation(text_VAO, text_VBO, text_shaderProgram);
+    text_component_generation(text_VAO, text_VBO, text_shaderProgram, characters);
+
+    //Lyrics are drawn with the glyphs of the text atlas, timed by a uniform instead of being laid out every frame
+    int lyrics_shaderProgram = shader_program_from_sources(lyrics_vertexShaderSource, lyrics_fragmentShaderSource);
+    lyrics_component_generation(lyrics_shaderProgram);
 
 ////////****************      Texture creation shaders and shader program
 
-    int vertexShader = vertex_shader_creator(texture_vertexShaderSource);
-    int fragmentShader = fragment_shader_creator(texture_fragmentShaderSource);
-    int shaderProgram = shader_program_creator(vertexShader, fragmentShader);
+    int shaderProgram = shader_program_from_sources(texture_vertexShaderSource, texture_fragmentShaderSource);
 
     unsigned int VAO, VBO, EBO, background_texture;
     background_component_generation(VAO, VBO, EBO, shaderProgram, background_texture);
 
     ////////****************      Video Texture creation shaders and shader program
 
-    int video_vertexShader = vertex_shader_creator(texture_vertexShaderSource);
-    int video_fragmentShader = fragment_shader_creator(texture_fragmentShaderSource);
-    int video_shaderProgram = shader_program_creator(video_vertexShader, video_fragmentShader);
+    //Same sources as the background, so this is the background's program
+    int video_shaderProgram = shader_program_from_sources(texture_vertexShaderSource, texture_fragmentShaderSource);
 
     unsigned int video_VAO, video_VBO, video_EBO, video_texture;
 
+    //YUV video frames use the standard texture vertex shader with a fragment shader that converts the planes to RGB
+    int yuv_shaderProgram = shader_program_from_sources(texture_vertexShaderSource, yuv_fragmentShaderSource);
+
+    unsigned int video_plane_textures[3];
+    video_plane_texture_generation(yuv_shaderProgram, video_plane_textures);
+    print_shader_stats();
+
     //Set up so the glfw window responds to character and key callback functions
     glfwSetCharCallback(window, character_callback);
     glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
     //Bool objects to track if the video/audio stream has started/ended and gone through all frames
     bool stream_started = false;
@@ -140,12 +292,38 @@ int main()
     //Stream object that will be used to start and stop audio streams
     PaStream* stream;
 
+    //Passes of the render loop so far, headless scripts are timed in them
+    int64_t render_pass = 0;
+
 
     //// render loop
     while (!glfwWindowShouldClose(window))
     {
 
+        auto pass_start = std::chrono::steady_clock::now();
+        double cpu_start = process_cpu_seconds();
+
+        //Headless runs take their input from the script and draw every pass, so passes line up with the script's numbering
+        if (headless_mode) {
+            Headless_Event event;
+            while (next_headless_input(render_pass, event)) {
+                run_headless_event(window, event);
+            }
+            redraw_requested = true;
+        }
+        bool in_menu = program.program_state != SONG_PLAYING;
+
         processInput(window);
+        store_loudness_results();
+
+        //An unchanged menu isn't drawn again, the loop sleeps until an event or the next tick instead
+        if (in_menu && !redraw_requested && drawn_state == program.program_state) {
+            glfwWaitEventsTimeout(MENU_TICK_SECONDS);
+            count_menu_pass(pass_start, cpu_start, false);
+            continue;
+        }
+        redraw_requested = false;
+        drawn_state = program.program_state;
 
         //Sets background color to black
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -155,7 +333,7 @@ int main()
 
         if (program.program_state == MAIN_MENU) {
             render_background(VAO, background_texture, shaderProgram);
-            render_text(characters, "Hit Enter to start song search", text_shaderProgram, text_VAO, text_VBO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
+            render_text(characters, "Hit Enter to start song search", text_shaderProgram, text_VAO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
         }
 
 
@@ -163,8 +341,8 @@ int main()
 
         if (program.program_state == SONG_SEARCH) {
             render_background(VAO, background_texture, shaderProgram);
-            render_text(characters, "Type search text and hit Enter", text_shaderProgram, text_VAO, text_VBO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
-            render_text(characters, "Input : " + user_text_input, text_shaderProgram, text_VAO, text_VBO, 0.05f * SCR_WIDTH, 0.8f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
+            render_text(characters, "Type search text and hit Enter", text_shaderProgram, text_VAO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
+            render_text(characters, "Input : " + user_text_input, text_shaderProgram, text_VAO, 0.05f * SCR_WIDTH, 0.8f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
         }
 
 
@@ -172,9 +350,9 @@ int main()
 
         if (program.program_state == SONG_RESULTS) {
             render_background(VAO, background_texture, shaderProgram);
-            render_text(characters, "Results for submission", text_shaderProgram, text_VAO, text_VBO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
-            render_text(characters, user_text_submission, text_shaderProgram, text_VAO, text_VBO, 0.05f * SCR_WIDTH, 0.8f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
-            print_songs(song_query(user_text_submission, my_session), SCR_WIDTH, SCR_HEIGHT, characters, text_shaderProgram, text_VAO, text_VBO);
+            render_text(characters, "Results for submission", text_shaderProgram, text_VAO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
+            render_text(characters, user_text_submission, text_shaderProgram, text_VAO, 0.05f * SCR_WIDTH, 0.8f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
+            print_songs(song_query(user_text_submission, my_session), SCR_WIDTH, SCR_HEIGHT, characters, text_shaderProgram, text_VAO);
         }
 
         //if program::state == SONG_PLAYING, it will inform the user that song is loading, decode the audio/video frames from the selected song, and renders the video while playing the audio 
@@ -182,46 +360,124 @@ int main()
 
             //First statement marks that stream started, decodes audio/video frames, and plays first frame of video
             //Second statement ensures after stream ends that the state is reverted back to SONG_SEARCH for another search entry
-            //Third statement renders every video frame before the  stream is marked as ended (last video_frame_map entry has been iterated through and rendered)
+            //Third statement renders every video frame before the stream is marked as ended (decoder has finished and the last frame in video_frames has been rendered)
             if (!stream_started) {
                 stream_started = true;
-                const char* song = /*String of selected song*/;
+                std::string song = song_queue.front();
+                song_queue.pop_front();
 
                 glfwSwapBuffers(window);
                 render_background(VAO, background_texture, shaderProgram);
-                render_text(characters, "Loading song", text_shaderProgram, text_VAO, text_VBO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
+                render_text(characters, "Loading song", text_shaderProgram, text_VAO, 0.05f * SCR_WIDTH, 0.9f * SCR_HEIGHT, 0.5f, glm::vec3(0.0f, 0.0f, 0.0f));
+
+                //Opens the file once, the demuxer thread then feeds both the video and audio decoders
+                open_song(song.c_str());
+                load_lyrics(song, characters);
 
-                //Video section
-                decode_video(song);
+                //Video section, decoding continues in the background while the song plays
+                decode_video();
                 video_component_generation(video_VAO, video_VBO, video_EBO, video_shaderProgram, video_texture, video_width, video_height);
 
-                //Audio section
-                decode_audio(song);
+                //Audio section, decoding continues in the background while the song plays
+                decode_audio();
                 initialize_audio(&stream);
 
-                //Renders first frame
+                //Renders first frame, video timing follows the audio device's playback clock from here on
                 glfwSwapBuffers(window);
-                glfwSetTime(0.0);
-                double time = (int)(glfwGetTime() * 1000.0) / 1000.0;
-                render_video_frame(video_VAO, video_texture, video_shaderProgram, video_frame_iterator, video_frame_map.end(), time, video_width, video_height, stream_ended);
-                video_frame_iterator++;
+                reset_av_sync_stats();
+                reset_texture_upload_stats();
+                double time = playback_time();
+                render_video_frame(video_VAO, video_texture, video_shaderProgram, video_plane_textures, yuv_shaderProgram, time, stream_ended);
 
             }
             else if (stream_ended == true) {
-                stop_audio(&stream);
-                program.program_state = SONG_SEARCH;
-                stream_started = false;
-                stream_ended = false;
+                //If the next queued song has been prefetched it takes over as soon as this song's audio is all decoded, keeping the audio stream running
+                //Until then the last frame is held on screen
+                prefetch_state next_song = get_prefetch_state();
+                if (next_song == PREFETCH_LOADING || (next_song == PREFETCH_READY && !audio_decoding_finished())) {
+                    double time = playback_time();
+                    render_video_frame(video_VAO, video_texture, video_shaderProgram, video_plane_textures, yuv_shaderProgram, time, stream_ended);
+                }
+                else if (next_song == PREFETCH_READY && prefetched_song_can_follow()) {
+                    //The switch starts the next song's counters, so the last song's are printed first
+                    print_song_stats();
+                    switch_to_prefetched_song();
+                    load_lyrics(song_queue.front(), characters);
+                    song_queue.pop_front();
+                    reset_av_sync_stats();
+                    reset_texture_upload_stats();
+                    stream_ended = false;
+                    double time = playback_time();
+                    render_video_frame(video_VAO, video_texture, video_shaderProgram, video_plane_textures, yuv_shaderProgram, time, stream_ended);
+                }
+                else {
+                    //A song that failed to prefetch is skipped, anything else left in the queue is started from scratch
+                    if (next_song == PREFETCH_FAILED) {
+                        song_queue.pop_front();
+                    }
+                    cancel_prefetch();
+                    stop_audio(&stream);
+                    stop_audio_decoding();
+                    stop_video_decoding();
+                    close_song();
+                    print_song_stats();
+                    release_upload_buffers();
+                    unload_lyrics();
+                    if (song_queue.empty()) {
+                        program.program_state = SONG_SEARCH;
+                    }
+                    stream_started = false;
+                    stream_ended = false;
+                }
             }
             else {
-                double time = (int)(glfwGetTime() * 1000.0) / 1000.0;
-                render_video_frame(video_VAO, video_texture, video_shaderProgram, video_frame_iterator, video_frame_map.end(), time, video_width, video_height, stream_ended);
-                video_frame_iterator++;
+                if (requested_seek >= 0.0) {
+                    seek_song(requested_seek);
+                    requested_seek = -1.0;
+                }
+
+                //The last frame stays up while a seek waits for the decoders to reach the target
+                if (!seek_ready()) {
+                    render_held_video_frame(video_VAO, video_texture, video_shaderProgram, video_plane_textures, yuv_shaderProgram);
+                }
+                else {
+                    //Starts opening the next queued song in the background during the last seconds of this one
+                    if (!song_queue.empty() && get_prefetch_state() == PREFETCH_NONE && song_duration() - song_position() < PREFETCH_LEAD_SECONDS) {
+                        prefetch_song(song_queue.front().c_str());
+                    }
+
+                    //Steps the audio buffer up if the callback keeps running dry
+                    adapt_audio_buffer(&stream);
+                    log_audio_stats();
+                    double time = playback_time();
+                    render_video_frame(video_VAO, video_texture, video_shaderProgram, video_plane_textures, yuv_shaderProgram, time, stream_ended);
+                }
             }
         }
 
+        //Lyrics go over whatever video frame this pass drew
+        if (program.program_state == SONG_PLAYING && stream_started) {
+            render_lyrics(characters, lyrics_shaderProgram, song_position());
+        }
+
+        end_text_frame();
+        if (headless_mode) {
+            run_headless_output(render_pass);
+        }
+        render_pass++;
         glfwSwapBuffers(window);
+        record_buffer_swap();
         glfwPollEvents();
+        if (in_menu) {
+            count_menu_pass(pass_start, cpu_start, true);
+        }
+    }
+    print_text_render_stats();
+    characters.print_stats();
+    print_menu_render_stats();
+    if (headless_mode) {
+        print_headless_stats();
+        destroy_offscreen_target();
     }
 
     //Deleted existing buffers and arrays
@@ -231,8 +487,12 @@ int main()
 
     glDeleteVertexArrays(1, &text_VAO);
     glDeleteBuffers(1, &text_VBO);
+    unload_lyrics();
+    characters.close();
 
-    //End SQL and glfw session
+    //Stops building frame cache entries and measuring loudness, then ends SQL and glfw session
+    stop_frame_cache_builder();
+    stop_loudness_analyzer();
     glfwTerminate();
     my_session.close();
 
@@ -244,18 +504,27 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     //Changes window size
     glViewport(0, 0, width, height);
+    redraw_requested = true;
+}
+
+
+void window_refresh_callback(GLFWwindow* window) {
+    redraw_requested = true;
 }
 
 
 void character_callback(GLFWwindow* window, unsigned int key) {
+    redraw_requested = true;
     if (program.program_state == SONG_SEARCH) {
-        user_text_input += (unsigned char)key;
+        //GLFW hands over code points, the search string is kept as UTF-8 like the titles it's matched against
+        append_utf8(user_text_input, key);
     }
 }
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    redraw_requested = true;
     if (program.program_state == SONG_SEARCH && key == GLFW_KEY_BACKSPACE && user_text_input != "" && action == GLFW_PRESS) {
-        user_text_input = user_text_input.substr(0, user_text_input.length() - 1);
+        pop_utf8(user_text_input);
     }
     if (program.program_state == MAIN_MENU && key == GLFW_KEY_ENTER && action == GLFW_PRESS) {
         std::cout << "entering song search";
@@ -267,8 +536,35 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     }
     else if (program.program_state == SONG_RESULTS && key == GLFW_KEY_ENTER && action == GLFW_PRESS) {
         std::cout << "entering song playing " << std::endl;
+        song_queue.push_back(/*String of selected song*/);
+        load_song_loudness(song_queue.back());
         program.program_state = SONG_PLAYING;
     }
+    else if (program.program_state == SONG_PLAYING && (key == GLFW_KEY_RIGHT || key == GLFW_KEY_LEFT) && action == GLFW_PRESS) {
+        requested_seek = song_position() + (key == GLFW_KEY_RIGHT ? SEEK_STEP_SECONDS : -SEEK_STEP_SECONDS);
+        if (requested_seek < 0.0) {
+            requested_seek = 0.0;
+        }
+    }
+    else if (program.program_state == SONG_PLAYING && key == GLFW_KEY_HOME && action == GLFW_PRESS) {
+        requested_seek = 0.0;
+    }
+    else if (program.program_state == SONG_PLAYING && (key == GLFW_KEY_UP || key == GLFW_KEY_DOWN) && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+        set_key_shift(get_key_shift() + (key == GLFW_KEY_UP ? 1 : -1));
+        std::cout << "Key " << get_key_shift() << " semitones" << std::endl;
+    }
+    else if (program.program_state == SONG_PLAYING && (key == GLFW_KEY_EQUAL || key == GLFW_KEY_MINUS) && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+        set_tempo(get_tempo() + (key == GLFW_KEY_EQUAL ? TEMPO_STEP : -TEMPO_STEP));
+        std::cout << "Tempo " << get_tempo() * 100.0 << "%" << std::endl;
+    }
+    else if (program.program_state == SONG_PLAYING && key == GLFW_KEY_E && action == GLFW_PRESS && mic_monitoring) {
+        microphones.set_echo(!microphones.echo_enabled());
+        std::cout << "Mic echo " << (microphones.echo_enabled() ? "on" : "off") << std::endl;
+    }
+    else if (program.program_state == SONG_PLAYING && key == GLFW_KEY_V && action == GLFW_PRESS) {
+        set_vocal_reduction(!get_vocal_reduction());
+        std::cout << "Vocal reduction " << (get_vocal_reduction() ? "on" : "off") << std::endl;
+    }
     else if (program.program_state == SONG_PLAYING && key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
         std::cout << "entering main menu" << std::endl;
         program.program_state = MAIN_MENU;
@@ -277,5 +573,113 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 }
 
 
+void load_song_loudness(const std::string& song) {
+    double integrated_lufs, true_peak_dbtp;
+    if (song_loudness(song, integrated_lufs, true_peak_dbtp, my_session)) {
+        set_song_loudness(song, integrated_lufs, true_peak_dbtp);
+    }
+    else {
+        queue_loudness_analysis(song);
+    }
+}
+
+
+void store_loudness_results() {
+    std::string song;
+    Loudness_Result result;
+    while (take_loudness_result(song, result)) {
+        store_song_loudness(song, result.integrated_lufs, result.true_peak_dbtp, my_session);
+        set_song_loudness(song, result.integrated_lufs, result.true_peak_dbtp);
+    }
+}
+
+
+void analyze_library() {
+    std::vector<std::string> songs = songs_without_loudness(my_session);
+    std::cout << "Analyzing the loudness of " << songs.size() << " songs" << std::endl;
+    for (std::string& song : songs) {
+        queue_loudness_analysis(song);
+    }
+    while (pending_loudness_analyses() > 0) {
+        store_loudness_results();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    store_loudness_results();
+    stop_loudness_analyzer();
+    print_loudness_stats();
+}
+
+
+
+void run_headless_event(GLFWwindow* window, const Headless_Event& event) {
+    if (event.action == HEADLESS_KEY) {
+        key_callback(window, event.key, 0, GLFW_PRESS, 0);
+        key_callback(window, event.key, 0, GLFW_RELEASE, 0);
+    }
+    else if (event.action == HEADLESS_TEXT) {
+        for (size_t position = 0; position < event.text.size();) {
+            character_callback(window, next_code_point(event.text, position));
+        }
+    }
+    else if (event.action == HEADLESS_QUIT) {
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
+}
+
+void print_song_stats() {
+    frame_pool.print_stats();
+    print_demux_stats();
+    print_video_decode_stats();
+    print_frame_cache_stats();
+    print_seek_stats();
+    print_pitch_stage_stats();
+    print_loudness_stats();
+    print_av_sync_stats();
+    print_texture_upload_stats();
+    print_lyrics_stats();
+}
+
+
+//std::clock() is wall time on Windows and wraps after a few minutes on 32 bit clock_t elsewhere, so the process times are asked for directly
+double process_cpu_seconds() {
+#ifdef _WIN32
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+        return 0.0;
+    }
+    //FILETIMEs count 100 ns ticks
+    ULARGE_INTEGER kernel_ticks, user_ticks;
+    kernel_ticks.LowPart = kernel_time.dwLowDateTime;
+    kernel_ticks.HighPart = kernel_time.dwHighDateTime;
+    user_ticks.LowPart = user_time.dwLowDateTime;
+    user_ticks.HighPart = user_time.dwHighDateTime;
+    return (kernel_ticks.QuadPart + user_ticks.QuadPart) / 1e7;
+#else
+    timespec cpu_time;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_time) != 0) {
+        return 0.0;
+    }
+    return cpu_time.tv_sec + cpu_time.tv_nsec / 1e9;
+#endif
+}
+
+void count_menu_pass(std::chrono::steady_clock::time_point pass_start, double cpu_start, bool drew) {
+    menu_render_stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - pass_start).count();
+    menu_render_stats.cpu_seconds += process_cpu_seconds() - cpu_start;
+    if (drew) {
+        menu_render_stats.frames++;
+    }
+    else {
+        menu_render_stats.idle_wakeups++;
+    }
+}
 
 
+//CPU use is the share of one core, and frames per second stands in for GPU use since every menu frame is a full clear and redraw
+void print_menu_render_stats() {
+    if (menu_render_stats.seconds <= 0.0) {
+        return;
+    }
+    std::cout << "Menus: " << menu_render_stats.seconds << " s, " << menu_render_stats.frames << " frames drawn (" << menu_render_stats.frames / menu_render_stats.seconds
+        << " per second), " << menu_render_stats.idle_wakeups << " idle wakeups, " << menu_render_stats.cpu_seconds / menu_render_stats.seconds * 100.0 << "% CPU" << std::endl;
+}
@@ -0,0 +1,375 @@
+#include "loudness.h"
+#include "audio_dsp.h"
+
+#include <cmath>
+#include <deque>
+#include <algorithm>
+
+
+//Gating blocks are 400ms long and start every 100ms, so the song is measured in 100ms quarters and each block is four of them
+static const double QUARTER_SECONDS = 0.1;
+static const double ABSOLUTE_GATE_LUFS = -70.0;
+static const double RELATIVE_GATE_LU = -10.0;
+
+//True peak oversampling, each of the 4 phases of the interpolation filter has 12 taps
+static const int OVERSAMPLING = 4;
+static const int TAPS_PER_PHASE = 12;
+
+Loudness_Stats loudness_stats = { 0, 0, 0.0, 0.0 };
+
+//Background thread that analyzes the songs queued by queue_loudness_analysis() one at a time, finished results wait in finished_analyses for the main thread to store
+static std::thread analyzer_thread;
+static std::deque<std::string> analysis_queue;
+static std::deque<std::pair<std::string, Loudness_Result>> finished_analyses;
+static std::mutex analysis_mutex;
+static std::condition_variable analysis_wakeup;
+static std::atomic<bool> analyzer_stopping(false);
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Loudness meter
+
+
+//Second order filter in transposed direct form II, in double since the K-weighting high pass sits at 38Hz
+typedef struct {
+    double b0, b1, b2, a1, a2;
+    double z1, z2;
+} Biquad;
+
+static float run_biquad(Biquad& filter, float input) {
+    double output = filter.b0 * input + filter.z1;
+    filter.z1 = filter.b1 * input - filter.a1 * output + filter.z2;
+    filter.z2 = filter.b2 * input - filter.a2 * output;
+    return (float)output;
+}
+
+
+//Measures the K-weighted energy of a stereo song in 100ms quarters and its true peak, fed one block of planes at a time
+class loudness_meter {
+public:
+    loudness_meter(int sample_rate);
+    void add(const float* left, const float* right, int frames);
+    double integrated_lufs();
+    double true_peak_dbtp();
+
+private:
+    int quarter_frames;
+    int quarter_filled = 0;
+    double quarter_energy = 0.0;
+    std::vector<double> quarters;
+
+    Biquad shelf[AUDIO_CHANNELS];
+    Biquad high_pass[AUDIO_CHANNELS];
+    std::vector<float> filtered[AUDIO_CHANNELS];
+
+    //Interpolation taps for each phase, reversed so a phase is one dot product with the last TAPS_PER_PHASE samples
+    std::vector<float> phase_taps[OVERSAMPLING];
+    std::vector<float> history[AUDIO_CHANNELS];
+    float peak = 0.0f;
+};
+
+
+//The K-weighting filters (a high shelf for the head and a high pass for the ear) are worked out for the song's own rate the same way as the BS.1770 coefficients for 48kHz
+loudness_meter::loudness_meter(int sample_rate) {
+    quarter_frames = std::max(1, (int)(sample_rate * QUARTER_SECONDS));
+
+    double k = tan(3.14159265358979 * 1681.974450955533 / sample_rate);
+    double q = 0.7071752369554196;
+    double vh = pow(10.0, 3.999843853973347 / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    Biquad shelf_filter = { (vh + vb * k / q + k * k) / a0, 2.0 * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0, 0.0, 0.0 };
+
+    k = tan(3.14159265358979 * 38.13547087602444 / sample_rate);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+    Biquad high_pass_filter = { 1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0, 0.0, 0.0 };
+
+    for (int channel = 0; channel < AUDIO_CHANNELS; channel++) {
+        shelf[channel] = shelf_filter;
+        high_pass[channel] = high_pass_filter;
+        history[channel].assign(TAPS_PER_PHASE - 1, 0.0f);
+    }
+
+    //Hann windowed sinc, phase 0 lands exactly on the original samples
+    int length = OVERSAMPLING * TAPS_PER_PHASE;
+    for (int phase = 0; phase < OVERSAMPLING; phase++) {
+        phase_taps[phase].resize(TAPS_PER_PHASE);
+        for (int i = 0; i < TAPS_PER_PHASE; i++) {
+            int m = OVERSAMPLING * (TAPS_PER_PHASE - 1 - i) + phase;
+            double x = (m - length / 2) / (double)OVERSAMPLING;
+            double sinc = x == 0.0 ? 1.0 : sin(3.14159265358979 * x) / (3.14159265358979 * x);
+            double window = 0.5 - 0.5 * cos(2.0 * 3.14159265358979 * m / length);
+            phase_taps[phase][i] = (float)(sinc * window);
+        }
+    }
+}
+
+
+void loudness_meter::add(const float* left, const float* right, int frames) {
+    const float* planes[AUDIO_CHANNELS] = { left, right };
+    for (int channel = 0; channel < AUDIO_CHANNELS; channel++) {
+        filtered[channel].resize(frames);
+        for (int i = 0; i < frames; i++) {
+            filtered[channel][i] = run_biquad(high_pass[channel], run_biquad(shelf[channel], planes[channel][i]));
+        }
+
+        //Every oversampled point is a dot product of the newest samples with one phase's taps
+        std::vector<float>& samples = history[channel];
+        samples.insert(samples.end(), planes[channel], planes[channel] + frames);
+        for (int i = 0; i < frames; i++) {
+            for (int phase = 0; phase < OVERSAMPLING; phase++) {
+                peak = std::max(peak, fabsf(audio_kernels.dot_product(&samples[i], phase_taps[phase].data(), TAPS_PER_PHASE)));
+            }
+        }
+        samples.erase(samples.begin(), samples.end() - (TAPS_PER_PHASE - 1));
+    }
+
+    //Sums of squares are dot products of the filtered samples with themselves
+    int position = 0;
+    while (position < frames) {
+        int count = std::min(frames - position, quarter_frames - quarter_filled);
+        for (int channel = 0; channel < AUDIO_CHANNELS; channel++) {
+            quarter_energy += audio_kernels.dot_product(&filtered[channel][position], &filtered[channel][position], count);
+        }
+        position += count;
+        quarter_filled += count;
+        if (quarter_filled == quarter_frames) {
+            quarters.push_back(quarter_energy / quarter_frames);
+            quarter_energy = 0.0;
+            quarter_filled = 0;
+        }
+    }
+}
+
+
+//Gated mean of the blocks' energy in LUFS, songs shorter than one block are measured as a single block
+double loudness_meter::integrated_lufs() {
+    std::vector<double> blocks;
+    for (size_t i = 3; i < quarters.size(); i++) {
+        blocks.push_back((quarters[i - 3] + quarters[i - 2] + quarters[i - 1] + quarters[i]) / 4.0);
+    }
+    if (blocks.empty() && !quarters.empty()) {
+        double sum = 0.0;
+        for (double quarter : quarters) {
+            sum += quarter;
+        }
+        blocks.push_back(sum / quarters.size());
+    }
+
+    auto gated_mean = [&](double threshold) {
+        double sum = 0.0;
+        int count = 0;
+        for (double block : blocks) {
+            if (block > threshold) {
+                sum += block;
+                count++;
+            }
+        }
+        return count > 0 ? sum / count : 0.0;
+    };
+    double absolute_gate = pow(10.0, (ABSOLUTE_GATE_LUFS + 0.691) / 10.0);
+    double ungated = gated_mean(absolute_gate);
+    if (ungated <= 0.0) {
+        return ABSOLUTE_GATE_LUFS;
+    }
+    double relative_gate = ungated * pow(10.0, RELATIVE_GATE_LU / 10.0);
+    double gated = gated_mean(std::max(absolute_gate, relative_gate));
+    return -0.691 + 10.0 * log10(gated);
+}
+
+
+double loudness_meter::true_peak_dbtp() {
+    return 20.0 * log10(std::max(peak, 1e-9f));
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Loudness analysis
+
+
+//Decodes the song's audio as planar float stereo at its own rate and measures it, returns false if it couldn't be decoded to the end
+bool analyze_loudness(const std::string& song_path, Loudness_Result& result) {
+    auto start = std::chrono::steady_clock::now();
+
+    AVFormatContext* format_context = NULL;
+    if (avformat_open_input(&format_context, song_path.c_str(), NULL, NULL) != 0) {
+        return false;
+    }
+    if (avformat_find_stream_info(format_context, NULL) < 0) {
+        avformat_close_input(&format_context);
+        return false;
+    }
+    int stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        avformat_close_input(&format_context);
+        return false;
+    }
+
+    //Only the audio is needed, so the demuxer skips every other stream
+    for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+        if ((int)i != stream_index) {
+            format_context->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    AVCodecContext* codec_context = open_audio_decoder(format_context->streams[stream_index]->codecpar);
+    SwrContext* resampler = NULL;
+    AVChannelLayout output_layout;
+    av_channel_layout_default(&output_layout, AUDIO_CHANNELS);
+    bool ok = codec_context != NULL && swr_alloc_set_opts2(&resampler, &output_layout, AV_SAMPLE_FMT_FLTP, codec_context->sample_rate,
+        &codec_context->ch_layout, codec_context->sample_fmt, codec_context->sample_rate, 0, NULL) >= 0 && swr_init(resampler) >= 0;
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    ok = ok && packet != NULL && frame != NULL;
+
+    int sample_rate = codec_context != NULL ? codec_context->sample_rate : 48000;
+    loudness_meter meter(sample_rate);
+    std::vector<float> planes;
+    int64_t total_frames = 0;
+    bool draining = false;
+    while (ok && !draining && !analyzer_stopping) {
+        int response = av_read_frame(format_context, packet);
+        if (response >= 0 && packet->stream_index != stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+        draining = response < 0;
+        response = avcodec_send_packet(codec_context, draining ? NULL : packet);
+        av_packet_unref(packet);
+        if (response < 0 && response != AVERROR(EAGAIN)) {
+            ok = false;
+            break;
+        }
+        while (ok && avcodec_receive_frame(codec_context, frame) >= 0) {
+            int max_frames = swr_get_out_samples(resampler, frame->nb_samples);
+            planes.resize((size_t)std::max(max_frames, 1) * AUDIO_CHANNELS);
+            uint8_t* output_planes[AUDIO_CHANNELS] = { (uint8_t*)&planes[0], (uint8_t*)&planes[max_frames] };
+            int frames = swr_convert(resampler, output_planes, max_frames, (const uint8_t**)frame->extended_data, frame->nb_samples);
+            if (frames > 0) {
+                meter.add(&planes[0], &planes[max_frames], frames);
+                total_frames += frames;
+            }
+            av_frame_unref(frame);
+        }
+    }
+    ok = ok && !analyzer_stopping && total_frames > 0;
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    swr_free(&resampler);
+    avcodec_free_context(&codec_context);
+    avformat_close_input(&format_context);
+
+    if (ok) {
+        result.integrated_lufs = meter.integrated_lufs();
+        result.true_peak_dbtp = meter.true_peak_dbtp();
+        result.audio_seconds = total_frames / (double)sample_rate;
+        result.analysis_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return ok;
+}
+
+
+//Runs on the analyzer thread, measuring each queued song and leaving the result for take_loudness_result()
+static void loudness_analyzer_loop() {
+    while (true) {
+        std::string song_path;
+        {
+            std::unique_lock<std::mutex> lock(analysis_mutex);
+            analysis_wakeup.wait(lock, [] { return !analysis_queue.empty() || analyzer_stopping; });
+            if (analyzer_stopping) {
+                return;
+            }
+            song_path = analysis_queue.front();
+        }
+
+        Loudness_Result result;
+        bool analyzed = analyze_loudness(song_path, result);
+        if (analyzed) {
+            std::cout << "Loudness: " << song_path << " " << result.integrated_lufs << " LUFS, " << result.true_peak_dbtp << " dBTP, "
+                << result.audio_seconds / result.analysis_seconds << "x real time" << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock(analysis_mutex);
+        if (analyzed) {
+            finished_analyses.push_back({ song_path, result });
+            loudness_stats.songs++;
+            loudness_stats.audio_seconds += result.audio_seconds;
+            loudness_stats.analysis_seconds += result.analysis_seconds;
+        }
+        else if (!analyzer_stopping) {
+            loudness_stats.failures++;
+        }
+        analysis_queue.pop_front();
+    }
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Loudness analysis functions
+
+
+//Queues a song with no stored loudness to be measured in the background
+void queue_loudness_analysis(const std::string& song_path) {
+    std::lock_guard<std::mutex> lock(analysis_mutex);
+    if (std::find(analysis_queue.begin(), analysis_queue.end(), song_path) != analysis_queue.end()) {
+        return;
+    }
+    analysis_queue.push_back(song_path);
+    if (!analyzer_thread.joinable()) {
+        analyzer_stopping = false;
+        analyzer_thread = std::thread(loudness_analyzer_loop);
+    }
+    analysis_wakeup.notify_one();
+}
+
+
+//Hands the main thread the oldest finished analysis, returns false if there isn't one
+bool take_loudness_result(std::string& song_path, Loudness_Result& result) {
+    std::lock_guard<std::mutex> lock(analysis_mutex);
+    if (finished_analyses.empty()) {
+        return false;
+    }
+    song_path = finished_analyses.front().first;
+    result = finished_analyses.front().second;
+    finished_analyses.pop_front();
+    return true;
+}
+
+
+//Songs queued or being analyzed
+int pending_loudness_analyses() {
+    std::lock_guard<std::mutex> lock(analysis_mutex);
+    return (int)analysis_queue.size();
+}
+
+
+//Stops the analyzer thread before the program exits, a song it was in the middle of is measured again next time
+void stop_loudness_analyzer() {
+    if (analyzer_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(analysis_mutex);
+            analyzer_stopping = true;
+        }
+        analysis_wakeup.notify_all();
+        analyzer_thread.join();
+    }
+}
+
+
+//Throughput is seconds of audio per second of analysis, which is what a full library pass is worked out from
+void print_loudness_stats() {
+    std::lock_guard<std::mutex> lock(analysis_mutex);
+    if (loudness_stats.songs == 0 && loudness_stats.failures == 0) {
+        return;
+    }
+    std::cout << "Loudness analysis: " << loudness_stats.songs << " songs (" << loudness_stats.failures << " failed), " << loudness_stats.audio_seconds / 60.0 << " minutes of audio in "
+        << loudness_stats.analysis_seconds << " s, " << (loudness_stats.analysis_seconds > 0.0 ? loudness_stats.audio_seconds / loudness_stats.analysis_seconds : 0.0) << "x real time" << std::endl;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "decoding_func.h"
+
+#include <string>
+
+
+//EBU R128 loudness analysis, run once per song on a background thread so every song can be played back at the same level
+//Integrated loudness follows ITU-R BS.1770: K-weighted 400ms blocks overlapping by 75%, gated at -70 LUFS and then 10 LU under the level of what's left
+//True peak is the highest sample after 4x oversampling, which catches the peaks that land between samples
+//The results are stored with the song's row, so playback only looks them up (see set_song_loudness())
+
+//Loudness_Result object is what one analysis found, and how long it took
+typedef struct {
+    double integrated_lufs;
+    double true_peak_dbtp;
+    double audio_seconds;
+    double analysis_seconds;
+} Loudness_Result;
+
+//Totals for every analysis since the program started
+typedef struct {
+    int64_t songs;
+    int64_t failures;
+    double audio_seconds;
+    double analysis_seconds;
+} Loudness_Stats;
+
+extern Loudness_Stats loudness_stats;
+
+//Loudness analysis functions
+bool analyze_loudness(const std::string& song_path, Loudness_Result& result);
+void queue_loudness_analysis(const std::string& song_path);
+bool take_loudness_result(std::string& song_path, Loudness_Result& result);
+int pending_loudness_analyses();
+void stop_loudness_analyzer();
+void print_loudness_stats();
@@ -0,0 +1,616 @@
+#include "lyrics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+
+//Text vertex shader with a second attribute for the word each glyph is in: when it's sung and its left and right edge on the line
+//The wipe edge is worked out here from the song time, every vertex of a glyph gets the same edge so it doesn't change across the glyph
+const char* lyrics_vertexShaderSource = "#version 330 core\n"
+"layout (location = 0) in vec4 vertex;\n"
+"layout (location = 1) in vec4 word;\n"
+"out vec2 TexCoords;\n"
+"out float line_x;\n"
+"out float wipe_x;\n"
+"uniform mat4 projection;\n"
+"uniform vec2 line_offset;\n"
+"uniform float song_time;\n"
+"void main()\n"
+"{\n"
+"   gl_Position = projection * vec4(vertex.xy + line_offset, 0.0, 1.0);\n"
+"   TexCoords = vertex.zw;\n"
+"   float progress = clamp((song_time - word.x) / max(word.y - word.x, 0.001), 0.0, 1.0);\n"
+"   line_x = vertex.x;\n"
+"   wipe_x = mix(word.z, word.w, progress);\n"
+"}\0";
+
+//Everything left of the wipe edge has been sung. The shadow pass draws the same glyphs in black a little down and right so the lines stand out from the video
+const char* lyrics_fragmentShaderSource = "#version 330 core\n"
+"in vec2 TexCoords;\n"
+"in float line_x;\n"
+"in float wipe_x;\n"
+"out vec4 color;\n"
+"uniform sampler2D text;\n"
+"uniform vec3 sung_color;\n"
+"uniform vec3 unsung_color;\n"
+"uniform bool shadow;\n"
+"void main()\n"
+"{\n"
+"   vec3 fill = shadow ? vec3(0.0) : (line_x < wipe_x ? sung_color : unsung_color);\n"
+"   color = vec4(fill, texture(text, TexCoords).r);\n"
+"}\n\0";
+
+
+Lyrics_Stats lyrics_stats = { 0, 0, 0, 0, 0.0, 0, 0.0 };
+
+//Lines are drawn inside the bottom of the video quad (which covers the middle 75% of the screen both ways), the line being sung above the one coming up
+//Heights are of the baseline as a share of the screen height, lines wider than LYRIC_MAX_WIDTH of the screen are scaled down to fit
+static const float CURRENT_LINE_Y = 0.22f;
+static const float NEXT_LINE_Y = 0.15f;
+static const float LYRIC_SCALE = 0.75f;
+static const float LYRIC_MAX_WIDTH = 0.7f;
+static const float SHADOW_OFFSET = 2.0f;
+
+//A sung line stays up this long unless the next one starts, and the first line after a break shows up as the next line this long before it starts
+static const double LINE_HOLD_SECONDS = 1.0;
+static const double NEXT_LINE_LEAD_SECONDS = 5.0;
+
+//LRC only gives when lines start, a line ends when the next one (or an empty line) starts but is wiped over no more than this
+static const double LRC_MAX_LINE_SECONDS = 8.0;
+
+//x, y, u, v of the glyph and start, end, left and right of its word
+static const int LYRIC_VERTEX_FLOATS = 8;
+
+//Where each line's vertices are in the buffer
+typedef struct {
+    int first_vertex;
+    int vertex_count;
+} Line_Range;
+
+static std::vector<Lyric_Line> lyric_lines;
+static std::vector<Line_Range> line_ranges;
+static std::vector<float> lyric_vertices;
+static unsigned int lyrics_VAO = 0;
+static unsigned int lyrics_VBO = 0;
+static unsigned int lyrics_atlas_texture = 0;
+
+//Glyph cache generation the lines were laid out in, they're laid out again if glyphs have been evicted since
+static int64_t layout_generation = -1;
+
+//Set for songs with more glyphs than the atlas holds, only the line being sung and the next one are in the buffer and shown_current and shown_next are which ones
+static bool per_line_layout = false;
+static int shown_current = -2;
+static int shown_next = -2;
+
+
+//****************    Lyrics file parsing
+
+static std::string trim(const std::string& text) {
+    size_t first = text.find_first_not_of(" \t");
+    if (first == std::string::npos) {
+        return "";
+    }
+    size_t last = text.find_last_not_of(" \t");
+    return text.substr(first, last - first + 1);
+}
+
+//Reads [h:]mm:ss.xx into seconds
+static bool parse_timestamp(const std::string& text, double& seconds) {
+    seconds = 0.0;
+    size_t start = 0;
+    while (true) {
+        size_t colon = text.find(':', start);
+        std::string field = trim(text.substr(start, colon == std::string::npos ? std::string::npos : colon - start));
+        char* field_end;
+        double value = strtod(field.c_str(), &field_end);
+        if (field.empty() || *field_end != '\0' || value < 0.0) {
+            return false;
+        }
+        seconds = seconds * 60.0 + value;
+        if (colon == std::string::npos) {
+            return true;
+        }
+        start = colon + 1;
+    }
+}
+
+static int count_code_points(const std::string& text) {
+    int count = 0;
+    for (char c : text) {
+        count += ((unsigned char)c & 0xC0) != 0x80 ? 1 : 0;
+    }
+    return count;
+}
+
+//Adds a timed piece of a line, text that's only spaces is added to the word before it so it still takes up room on the line
+static void add_word(std::vector<Lyric_Word>& words, const std::string& text, double start, double end) {
+    if (trim(text).empty()) {
+        if (!words.empty()) {
+            words.back().text += text;
+        }
+        return;
+    }
+    words.push_back({ start, std::max(start, end), text });
+}
+
+//Splits a line with no word times into words, sharing the line's time out by how many characters each word has
+static void split_words(const std::string& text, double start, double end, std::vector<Lyric_Word>& words) {
+    int total = std::max(1, count_code_points(text));
+    double seconds_per_character = (end - start) / total;
+    size_t position = 0;
+    double word_start = start;
+    while (position < text.size()) {
+        //Each word keeps the spaces after it
+        size_t word_end = text.find_first_not_of(' ', text.find(' ', position));
+        std::string word = text.substr(position, word_end == std::string::npos ? std::string::npos : word_end - position);
+        double word_seconds = count_code_points(word) * seconds_per_character;
+        add_word(words, word, word_start, word_start + word_seconds);
+        word_start += word_seconds;
+        position = word_end;
+    }
+}
+
+//Splits an LRC line's text into words, at its <mm:ss.xx> tags if it's enhanced LRC. shift moves the tag times for a line repeated under several timestamps
+static void lrc_words(const std::string& text, double start, double end, double shift, std::vector<Lyric_Word>& words) {
+    std::string pending;
+    double word_start = start;
+    bool tagged = false;
+    for (size_t position = 0; position < text.size();) {
+        size_t close = text[position] == '<' ? text.find('>', position) : std::string::npos;
+        double tag_time;
+        if (close != std::string::npos && parse_timestamp(text.substr(position + 1, close - position - 1), tag_time)) {
+            tag_time += shift;
+            add_word(words, pending, word_start, tag_time);
+            pending.clear();
+            word_start = tag_time;
+            tagged = true;
+            position = close + 1;
+            continue;
+        }
+        pending += text[position++];
+    }
+    if (!tagged) {
+        split_words(trim(text), start, end, words);
+        return;
+    }
+    add_word(words, pending, word_start, std::max(word_start, end));
+}
+
+//Lines are [mm:ss.xx] tags (one or more) followed by the text, other tags like [ar:...] are skipped apart from [offset:ms]
+bool parse_lrc(const std::string& contents, std::vector<Lyric_Line>& lines) {
+    //Line starts and text before the line ends are known, and every timestamp including those of empty lines, which end the line before them
+    typedef struct {
+        double start;
+        double shift;
+        std::string text;
+    } Pending_Line;
+    std::vector<Pending_Line> pending;
+    std::vector<double> marks;
+    double offset = 0.0;
+
+    std::istringstream stream(contents);
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        std::vector<double> starts;
+        size_t position = 0;
+        while (position < line.size() && line[position] == '[') {
+            size_t close = line.find(']', position);
+            if (close == std::string::npos) {
+                break;
+            }
+            std::string tag = line.substr(position + 1, close - position - 1);
+            double time;
+            if (parse_timestamp(tag, time)) {
+                starts.push_back(time);
+            }
+            else if (tag.compare(0, 7, "offset:") == 0) {
+                offset = atof(tag.c_str() + 7) / 1000.0;
+            }
+            position = close + 1;
+        }
+        std::string text = line.substr(std::min(position, line.size()));
+        for (double start : starts) {
+            marks.push_back(start);
+            if (!trim(text).empty()) {
+                pending.push_back({ start, start - starts[0], text });
+            }
+        }
+    }
+    std::sort(marks.begin(), marks.end());
+    std::stable_sort(pending.begin(), pending.end(), [](const Pending_Line& a, const Pending_Line& b) { return a.start < b.start; });
+
+    lines.clear();
+    for (const Pending_Line& line_text : pending) {
+        auto next_mark = std::upper_bound(marks.begin(), marks.end(), line_text.start);
+        double end = line_text.start + LRC_MAX_LINE_SECONDS;
+        if (next_mark != marks.end()) {
+            end = std::min(end, *next_mark);
+        }
+        //A positive offset shows the lyrics sooner
+        Lyric_Line lyric = { line_text.start - offset, end - offset, {} };
+        lrc_words(line_text.text, lyric.start, lyric.end, line_text.shift - offset, lyric.words);
+        if (lyric.words.empty()) {
+            continue;
+        }
+        lyric.end = std::max(lyric.end, lyric.words.back().end);
+        lines.push_back(lyric);
+    }
+    return !lines.empty();
+}
+
+//Takes the override blocks out of an ASS line's text, \k, \K, \kf and \ko tags (in centiseconds) time the syllable after them
+static void ass_words(const std::string& text, double start, double end, std::vector<Lyric_Word>& words) {
+    std::string plain;
+    std::string pending;
+    double syllable_start = start;
+    double syllable_seconds = 0.0;
+    bool karaoke = false;
+    for (size_t position = 0; position < text.size();) {
+        if (text[position] == '{') {
+            size_t close = text.find('}', position);
+            if (close == std::string::npos) {
+                break;
+            }
+            std::string block = text.substr(position + 1, close - position - 1);
+            for (size_t tag = block.find('\\'); tag != std::string::npos; tag = block.find('\\', tag + 1)) {
+                size_t digits = tag + 1;
+                if (digits < block.size() && (block[digits] == 'k' || block[digits] == 'K')) {
+                    digits++;
+                    if (digits < block.size() && (block[digits] == 'f' || block[digits] == 'o')) {
+                        digits++;
+                    }
+                    if (digits < block.size() && isdigit((unsigned char)block[digits])) {
+                        add_word(words, pending, syllable_start, syllable_start + syllable_seconds);
+                        pending.clear();
+                        syllable_start += syllable_seconds;
+                        syllable_seconds = atoi(block.c_str() + digits) / 100.0;
+                        karaoke = true;
+                    }
+                }
+            }
+            position = close + 1;
+            continue;
+        }
+        //Line breaks and hard spaces all become spaces, the overlay draws every line on one row
+        if (text[position] == '\\' && position + 1 < text.size() && (text[position + 1] == 'N' || text[position + 1] == 'n' || text[position + 1] == 'h')) {
+            pending += ' ';
+            plain += ' ';
+            position += 2;
+            continue;
+        }
+        pending += text[position];
+        plain += text[position];
+        position++;
+    }
+    if (!karaoke) {
+        words.clear();
+        split_words(trim(plain), start, end, words);
+        return;
+    }
+    add_word(words, pending, syllable_start, syllable_start + syllable_seconds);
+}
+
+//Reads the Dialogue lines of the [Events] section, in the field order its Format line gives
+bool parse_ass(const std::string& contents, std::vector<Lyric_Line>& lines) {
+    std::vector<std::string> format = { "Layer", "Start", "End", "Style", "Name", "MarginL", "MarginR", "MarginV", "Effect", "Text" };
+    bool in_events = false;
+
+    lines.clear();
+    std::istringstream stream(contents);
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty() && line[0] == '[') {
+            in_events = line.compare(0, 8, "[Events]") == 0;
+            continue;
+        }
+        if (!in_events) {
+            continue;
+        }
+        if (line.compare(0, 7, "Format:") == 0) {
+            format.clear();
+            std::istringstream fields(line.substr(7));
+            std::string field;
+            while (std::getline(fields, field, ',')) {
+                format.push_back(trim(field));
+            }
+            continue;
+        }
+        if (line.compare(0, 9, "Dialogue:") != 0) {
+            continue;
+        }
+
+        //The last field is the text, which can have commas in it
+        std::vector<std::string> fields;
+        size_t position = 9;
+        for (size_t i = 0; i + 1 < format.size() && position != std::string::npos; i++) {
+            size_t comma = line.find(',', position);
+            fields.push_back(trim(line.substr(position, comma == std::string::npos ? std::string::npos : comma - position)));
+            position = comma == std::string::npos ? comma : comma + 1;
+        }
+        if (position == std::string::npos) {
+            continue;
+        }
+        fields.push_back(line.substr(position));
+
+        Lyric_Line lyric = { 0.0, 0.0, {} };
+        std::string text;
+        bool timed = true;
+        for (size_t i = 0; i < format.size(); i++) {
+            if (format[i] == "Start") {
+                timed = timed && parse_timestamp(fields[i], lyric.start);
+            }
+            else if (format[i] == "End") {
+                timed = timed && parse_timestamp(fields[i], lyric.end);
+            }
+            else if (format[i] == "Text") {
+                text = fields[i];
+            }
+        }
+        if (!timed) {
+            continue;
+        }
+        ass_words(text, lyric.start, lyric.end, lyric.words);
+        if (!lyric.words.empty()) {
+            lines.push_back(lyric);
+        }
+    }
+    std::stable_sort(lines.begin(), lines.end(), [](const Lyric_Line& a, const Lyric_Line& b) { return a.start < b.start; });
+    return !lines.empty();
+}
+
+
+//****************    Lyrics overlay
+
+//Sets up the program's uniforms that don't change and the VAO, the vertex buffer is made when lyrics are laid out
+void lyrics_component_generation(int& lyrics_shader_program) {
+    glm::mat4 projection = glm::ortho(0.0f, static_cast<float>(SCR_WIDTH), 0.0f, static_cast<float>(SCR_HEIGHT));
+    glUseProgram(lyrics_shader_program);
+    glUniformMatrix4fv(uniform_location(lyrics_shader_program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform1i(uniform_location(lyrics_shader_program, "text"), 0);
+    glUniform3f(uniform_location(lyrics_shader_program, "sung_color"), 0.2f, 0.6f, 1.0f);
+    glUniform3f(uniform_location(lyrics_shader_program, "unsung_color"), 1.0f, 1.0f, 1.0f);
+    glGenVertexArrays(1, &lyrics_VAO);
+}
+
+//Adds a line's glyphs to lyric_vertices centered on x = 0 with its baseline at y = 0 (render_lyrics() moves it into place) and returns where they went
+static Line_Range layout_line(glyph_cache& characters, const Lyric_Line& line) {
+    Character ch;
+    float width = 0.0f;
+    for (const Lyric_Word& word : line.words) {
+        for (size_t position = 0; position < word.text.size();) {
+            uint32_t code_point = next_code_point(word.text, position);
+            if (code_point >= 32 && characters.find(code_point, ch)) {
+                width += (ch.Advance >> 6);
+            }
+        }
+    }
+    float scale = width > 0.0f ? std::min(LYRIC_SCALE, LYRIC_MAX_WIDTH * SCR_WIDTH / width) : LYRIC_SCALE;
+    float x = -width * scale / 2.0f;
+
+    Line_Range range = { (int)(lyric_vertices.size() / LYRIC_VERTEX_FLOATS), 0 };
+    for (const Lyric_Word& word : line.words) {
+        size_t word_first_float = lyric_vertices.size();
+        float word_left = x;
+        float word_right = x;
+        for (size_t position = 0; position < word.text.size();) {
+            uint32_t code_point = next_code_point(word.text, position);
+            if (code_point < 32 || !characters.find(code_point, ch)) {
+                continue;
+            }
+            lyrics_atlas_texture = ch.TextureID;
+            float xpos = x + ch.Bearing.x * scale;
+            float ypos = -(ch.Size.y - ch.Bearing.y) * scale;
+            float w = ch.Size.x * scale;
+            float h = ch.Size.y * scale;
+            if (ch.Size.x > 0 && ch.Size.y > 0) {
+                float u0 = ch.AtlasOffset.x;
+                float v0 = ch.AtlasOffset.y;
+                float u1 = ch.AtlasOffset.x + ch.AtlasSize.x;
+                float v1 = ch.AtlasOffset.y + ch.AtlasSize.y;
+                float quad[6][4] = {
+                    { xpos,     ypos + h,   u0, v0 },
+                    { xpos,     ypos,       u0, v1 },
+                    { xpos + w, ypos,       u1, v1 },
+
+                    { xpos,     ypos + h,   u0, v0 },
+                    { xpos + w, ypos,       u1, v1 },
+                    { xpos + w, ypos + h,   u1, v0 }
+                };
+                for (int vertex = 0; vertex < 6; vertex++) {
+                    lyric_vertices.insert(lyric_vertices.end(), quad[vertex], quad[vertex] + 4);
+                    lyric_vertices.insert(lyric_vertices.end(), { (float)word.start, (float)word.end, 0.0f, 0.0f });
+                }
+            }
+            x += (ch.Advance >> 6) * scale;
+            //The wipe stops at the word's last glyph rather than after the spaces that follow it
+            if (code_point != ' ') {
+                word_right = x;
+            }
+        }
+        for (size_t vertex = word_first_float; vertex < lyric_vertices.size(); vertex += LYRIC_VERTEX_FLOATS) {
+            lyric_vertices[vertex + 6] = word_left;
+            lyric_vertices[vertex + 7] = word_right;
+        }
+    }
+    range.vertex_count = (int)(lyric_vertices.size() / LYRIC_VERTEX_FLOATS) - range.first_vertex;
+    return range;
+}
+
+static void upload_lyric_vertices() {
+    if (lyrics_VBO == 0) {
+        glGenBuffers(1, &lyrics_VBO);
+    }
+    glBindVertexArray(lyrics_VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, lyrics_VBO);
+    glBufferData(GL_ARRAY_BUFFER, lyric_vertices.size() * sizeof(float), lyric_vertices.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, LYRIC_VERTEX_FLOATS * sizeof(float), 0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, LYRIC_VERTEX_FLOATS * sizeof(float), (const void*)(4 * sizeof(float)));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    lyrics_stats.buffer_bytes = (int64_t)(lyric_vertices.size() * sizeof(float));
+}
+
+//Lays out every line and uploads them all into one buffer
+//If glyphs were evicted while doing it the song has more than the atlas holds and the first lines may point at cells that now hold other glyphs,
+//so the song switches to per line layout instead
+static void layout_lyrics(glyph_cache& characters) {
+    auto layout_start = std::chrono::steady_clock::now();
+    int64_t start_generation = characters.generation();
+    lyric_vertices.clear();
+    line_ranges.clear();
+    for (const Lyric_Line& line : lyric_lines) {
+        line_ranges.push_back(layout_line(characters, line));
+    }
+    lyrics_stats.lines = (int64_t)lyric_lines.size();
+    lyrics_stats.glyphs = (int64_t)(lyric_vertices.size() / LYRIC_VERTEX_FLOATS / 6);
+
+    if (characters.generation() != start_generation) {
+        std::cout << "Lyrics have more glyphs than the atlas holds, only the lines on screen will be laid out" << std::endl;
+        per_line_layout = true;
+        shown_current = -2;
+        shown_next = -2;
+        lyric_vertices.clear();
+        line_ranges.assign(lyric_lines.size(), { 0, 0 });
+    }
+    upload_lyric_vertices();
+
+    layout_generation = characters.generation();
+    lyrics_stats.layouts++;
+    lyrics_stats.layout_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - layout_start).count();
+}
+
+//Per line layout, lays out and uploads only the line being sung and the next one (either can be off the ends of the song)
+static void layout_shown_lines(glyph_cache& characters, int current, int next) {
+    auto layout_start = std::chrono::steady_clock::now();
+    lyric_vertices.clear();
+    line_ranges.assign(lyric_lines.size(), { 0, 0 });
+    for (int line : { current, next }) {
+        if (line >= 0 && line < (int)lyric_lines.size()) {
+            line_ranges[line] = layout_line(characters, lyric_lines[line]);
+        }
+    }
+    upload_lyric_vertices();
+
+    shown_current = current;
+    shown_next = next;
+    layout_generation = characters.generation();
+    lyrics_stats.layouts++;
+    lyrics_stats.layout_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - layout_start).count();
+}
+
+//Looks for a lyrics file with the song's name, returns false if there isn't one or it has no timed lines
+bool load_lyrics(const std::string& song_path, glyph_cache& characters) {
+    unload_lyrics();
+    lyrics_stats = { 0, 0, 0, 0, 0.0, 0, 0.0 };
+
+    static const char* LYRICS_EXTENSIONS[] = { ".lrc", ".ass", ".ssa" };
+    for (const char* extension : LYRICS_EXTENSIONS) {
+        std::filesystem::path lyrics_path = std::filesystem::path(song_path).replace_extension(extension);
+        std::ifstream file(lyrics_path, std::ios::binary);
+        if (!file) {
+            continue;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string text = contents.str();
+        if (text.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            text.erase(0, 3);
+        }
+        bool parsed = std::string(extension) == ".lrc" ? parse_lrc(text, lyric_lines) : parse_ass(text, lyric_lines);
+        if (!parsed) {
+            std::cout << "No timed lines in " << lyrics_path.string() << std::endl;
+            lyric_lines.clear();
+            continue;
+        }
+        layout_lyrics(characters);
+        return true;
+    }
+    return false;
+}
+
+void unload_lyrics() {
+    lyric_lines.clear();
+    line_ranges.clear();
+    if (lyrics_VBO != 0) {
+        glDeleteBuffers(1, &lyrics_VBO);
+        lyrics_VBO = 0;
+    }
+    layout_generation = -1;
+    per_line_layout = false;
+}
+
+static void draw_lyric_line(int lyrics_shader_program, const Line_Range& range, float y) {
+    if (range.vertex_count == 0) {
+        return;
+    }
+    glUniform2f(uniform_location(lyrics_shader_program, "line_offset"), SCR_WIDTH / 2.0f + SHADOW_OFFSET, y - SHADOW_OFFSET);
+    glUniform1i(uniform_location(lyrics_shader_program, "shadow"), 1);
+    glDrawArrays(GL_TRIANGLES, range.first_vertex, range.vertex_count);
+    glUniform2f(uniform_location(lyrics_shader_program, "line_offset"), SCR_WIDTH / 2.0f, y);
+    glUniform1i(uniform_location(lyrics_shader_program, "shadow"), 0);
+    glDrawArrays(GL_TRIANGLES, range.first_vertex, range.vertex_count);
+}
+
+//Draws the line being sung and the one after it, song_time is seconds into the song (song_position())
+//Nothing is laid out or uploaded here unless glyphs the lines use were evicted from the atlas, or with per line layout when the next line starts
+void render_lyrics(glyph_cache& characters, int lyrics_shader_program, double song_time) {
+    if (lyric_lines.empty()) {
+        return;
+    }
+    auto render_start = std::chrono::steady_clock::now();
+
+    auto upcoming = std::upper_bound(lyric_lines.begin(), lyric_lines.end(), song_time, [](double time, const Lyric_Line& line) { return time < line.start; });
+    int next = (int)(upcoming - lyric_lines.begin());
+    int current = next - 1;
+    if (!per_line_layout && layout_generation != characters.generation()) {
+        layout_lyrics(characters);
+    }
+    if (per_line_layout && (layout_generation != characters.generation() || current != shown_current || next != shown_next)) {
+        layout_shown_lines(characters, current, next);
+    }
+    bool show_current = current >= 0 && song_time < lyric_lines[current].end + LINE_HOLD_SECONDS;
+    bool show_next = next < (int)lyric_lines.size() && (show_current || lyric_lines[next].start - song_time < NEXT_LINE_LEAD_SECONDS);
+
+    if (show_current || show_next) {
+        glEnable(GL_BLEND);
+        glUseProgram(lyrics_shader_program);
+        glUniform1f(uniform_location(lyrics_shader_program, "song_time"), (float)song_time);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, lyrics_atlas_texture);
+        glBindVertexArray(lyrics_VAO);
+        if (show_current) {
+            draw_lyric_line(lyrics_shader_program, line_ranges[current], CURRENT_LINE_Y * SCR_HEIGHT);
+        }
+        if (show_next) {
+            draw_lyric_line(lyrics_shader_program, line_ranges[next], NEXT_LINE_Y * SCR_HEIGHT);
+        }
+        glBindVertexArray(0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDisable(GL_BLEND);
+    }
+
+    lyrics_stats.frames++;
+    lyrics_stats.render_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
+}
+
+//Prints what laying out the song's lyrics took and the CPU time drawing them took per frame
+void print_lyrics_stats() {
+    if (lyrics_stats.layouts == 0) {
+        return;
+    }
+    std::cout << "Lyrics: " << lyrics_stats.lines << " lines, " << lyrics_stats.glyphs << " glyphs in " << lyrics_stats.buffer_bytes / 1024.0 << " KB, laid out "
+        << lyrics_stats.layouts << " times in " << lyrics_stats.layout_seconds * 1000.0 << " ms, "
+        << (lyrics_stats.frames > 0 ? lyrics_stats.render_seconds / lyrics_stats.frames * 1000000.0 : 0.0) << " us CPU per frame" << std::endl;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "opengl_funcs.h"
+
+#include <string>
+#include <vector>
+
+
+//Synchronized lyrics drawn over the video for songs that come with an LRC or ASS file next to them (same name, .lrc, .ass or .ssa)
+//Every line is laid out once when the song is loaded, into one vertex buffer for the whole song. Each glyph's vertices carry the times and left/right edges of its word,
+//so drawing a frame only sets the song time uniform and the shader works out how far the highlight wipe has got
+//A song with more distinct glyphs than the glyph atlas holds only has the two lines on screen laid out, again each time a line starts
+//LRC lines can time each word with <mm:ss.xx> tags (enhanced LRC), ASS lines with \k karaoke tags. Lines with no word times have the line's time shared out by word length
+
+//A word, or a syllable when ASS karaoke tags split words up, and when it's sung (seconds into the song)
+typedef struct {
+    double start;
+    double end;
+    std::string text;
+} Lyric_Word;
+
+typedef struct {
+    double start;
+    double end;
+    std::vector<Lyric_Word> words;
+} Lyric_Line;
+
+//Lyrics of the current song, layout is what laying out the lines and uploading them took, render is what every frame drawing them took
+typedef struct {
+    int64_t lines;
+    int64_t glyphs;
+    int64_t buffer_bytes;
+    int64_t layouts;
+    double layout_seconds;
+    int64_t frames;
+    double render_seconds;
+} Lyrics_Stats;
+
+//Sources for lyrics, the text shaders with the word timing attribute and the wipe
+extern const char* lyrics_vertexShaderSource;
+extern const char* lyrics_fragmentShaderSource;
+
+extern Lyrics_Stats lyrics_stats;
+
+//Lyrics file parsing functions, lines come back sorted by start time
+bool parse_lrc(const std::string& contents, std::vector<Lyric_Line>& lines);
+bool parse_ass(const std::string& contents, std::vector<Lyric_Line>& lines);
+
+//Lyrics overlay functions
+void lyrics_component_generation(int& lyrics_shader_program);
+bool load_lyrics(const std::string& song_path, glyph_cache& characters);
+void unload_lyrics();
+void render_lyrics(glyph_cache& characters, int lyrics_shader_program, double song_time);
+void print_lyrics_stats();
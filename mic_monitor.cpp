@@ -0,0 +1,108 @@
+#include "mic_monitor.h"
+
+#include <algorithm>
+
+
+//The echo is a single feedback delay, short enough to sound like a room rather than a canyon
+static const double ECHO_SECONDS = 0.09;
+static const float ECHO_FEEDBACK = 0.35f;
+static const float ECHO_MIX = 0.25f;
+
+//Mics start a bit under the backing track, which is played at OUTPUT_GAIN
+static const float DEFAULT_MIC_GAIN = 0.8f;
+
+//Round trip the monitoring is meant to stay under, anything more is noticeable to the singer
+static const double ROUND_TRIP_TARGET_SECONDS = 0.010;
+
+bool mic_monitoring = false;
+int mic_frames_per_buffer = 64;
+mic_monitor microphones;
+
+
+//Sizes the echo line for the stream about to be opened and clears the measurements, only called while the stream is closed
+void mic_monitor::prepare(int sample_rate, int input_channels) {
+    channels = std::min(input_channels, MAX_MIC_CHANNELS);
+    echo_line.assign(std::max(1, (int)(sample_rate * ECHO_SECONDS)), 0.0f);
+    echo_position = 0;
+    counters = { 0, 0.0, 0.0 };
+}
+
+
+void mic_monitor::set_gain(int mic, float gain) {
+    if (mic >= 0 && mic < MAX_MIC_CHANNELS) {
+        gains[mic].store(gain, std::memory_order_relaxed);
+    }
+}
+
+void mic_monitor::set_echo(bool enabled) {
+    echo_mix.store(enabled ? ECHO_MIX : 0.0f, std::memory_order_relaxed);
+}
+
+bool mic_monitor::echo_enabled() {
+    return echo_mix.load(std::memory_order_relaxed) > 0.0f;
+}
+
+
+//Called from the audio callback, sums the mics (interleaved, channels per frame) with their gains and adds them and their echo to both output channels
+//The echo line keeps running while the echo is off so switching it on doesn't start from silence
+void mic_monitor::process(const float* input, float* output, int frames) {
+    float mix = echo_mix.load(std::memory_order_relaxed);
+    float mic_gains[MAX_MIC_CHANNELS];
+    for (int mic = 0; mic < channels; mic++) {
+        mic_gains[mic] = gains[mic].load(std::memory_order_relaxed);
+    }
+    int line_length = (int)echo_line.size();
+
+    for (int i = 0; i < frames; i++) {
+        float voice = 0.0f;
+        for (int mic = 0; mic < channels; mic++) {
+            voice += input[i * channels + mic] * mic_gains[mic];
+        }
+        float delayed = echo_line[echo_position];
+        echo_line[echo_position] = voice + delayed * ECHO_FEEDBACK;
+        echo_position = echo_position + 1 == line_length ? 0 : echo_position + 1;
+
+        float sample = voice + delayed * mix;
+        output[i * AUDIO_CHANNELS] += sample;
+        output[i * AUDIO_CHANNELS + 1] += sample;
+    }
+}
+
+
+//Called from every duplex callback. The round trip of a buffer is from when its input hit the ADC to when its output reaches the DAC,
+//some host APIs leave those times at 0 and then the buffer isn't counted
+void mic_monitor::record_round_trip(const PaStreamCallbackTimeInfo* time_info) {
+    if (time_info->inputBufferAdcTime != 0.0 && time_info->outputBufferDacTime != 0.0) {
+        double round_trip = time_info->outputBufferDacTime - time_info->inputBufferAdcTime;
+        counters.timed_buffers++;
+        counters.round_trip_seconds += round_trip;
+        counters.max_round_trip_seconds = std::max(counters.max_round_trip_seconds, round_trip);
+    }
+}
+
+
+//Only read once the stream has been stopped, the callback is the only writer while it runs
+Monitor_Stats mic_monitor::stats() {
+    return counters;
+}
+
+
+//Turns on the duplex stream for the following songs, smaller buffers lower the latency but give the callback less time
+void enable_mic_monitoring(int frames_per_buffer) {
+    mic_monitoring = true;
+    mic_frames_per_buffer = std::max(16, frames_per_buffer);
+    for (int mic = 0; mic < MAX_MIC_CHANNELS; mic++) {
+        microphones.set_gain(mic, DEFAULT_MIC_GAIN);
+    }
+    microphones.set_echo(true);
+}
+
+
+void print_monitor_stats() {
+    Monitor_Stats stats = microphones.stats();
+    if (stats.timed_buffers > 0) {
+        double average_round_trip = stats.round_trip_seconds / stats.timed_buffers;
+        std::cout << "Mic round trip: average " << average_round_trip * 1000.0 << " ms, worst " << stats.max_round_trip_seconds * 1000.0 << " ms"
+            << (average_round_trip > ROUND_TRIP_TARGET_SECONDS ? " (over the 10 ms target, try a smaller --mic buffer)" : "") << std::endl;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "decoding_func.h"
+
+
+//Microphone monitoring through a duplex PortAudio stream, so singers can be heard over the backing track without an external mixer
+//The mic inputs are mixed into the output inside the audio callback with a gain per mic and a light echo, the callback side only uses memory set up by prepare() and atomics, no locks or allocations
+//Round trip latency comes from the host's ADC/DAC times for each buffer, and is reported alongside the callback stats (see print_audio_callback_stats()) so buffer sizes can be picked per machine
+
+//Most mic inputs that are monitored, any more channels the input device has are left out
+#define MAX_MIC_CHANNELS 4
+
+//Round trips measured by the callback since the stream was opened
+typedef struct {
+    int64_t timed_buffers;
+    double round_trip_seconds;
+    double max_round_trip_seconds;
+} Monitor_Stats;
+
+class mic_monitor {
+public:
+    void prepare(int sample_rate, int input_channels);
+    void set_gain(int mic, float gain);
+    void set_echo(bool enabled);
+    bool echo_enabled();
+    void process(const float* input, float* output, int frames);
+    void record_round_trip(const PaStreamCallbackTimeInfo* time_info);
+    Monitor_Stats stats();
+
+private:
+    int channels = 0;
+    std::atomic<float> gains[MAX_MIC_CHANNELS];
+    std::atomic<float> echo_mix{ 0.0f };
+    std::vector<float> echo_line;
+    int echo_position = 0;
+    Monitor_Stats counters = { 0, 0.0, 0.0 };
+};
+
+//External monitoring variables, mic_monitoring is off until enable_mic_monitoring() is called and then initialize_audio() opens a duplex stream
+extern bool mic_monitoring;
+extern int mic_frames_per_buffer;
+extern mic_monitor microphones;
+
+//Monitoring functions
+void enable_mic_monitoring(int frames_per_buffer);
+void print_monitor_stats();
@@ -1,10 +1,124 @@
 
 #include "opengl_funcs.h"
 
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <tuple>
+#include <filesystem>
+
 //Window information
 const unsigned int SCR_WIDTH = 1280;
 const unsigned int SCR_HEIGHT = 720;
 
+AV_Sync_Stats av_sync_stats = { 0, 0, 0, 0.0, 0.0, 0, 0.0, 0.0, { 0 } };
+double display_refresh_period = 1.0 / 60.0;
+
+//When the last swap returned, and the time of the frame it showed if the pass that ended with it presented a new frame
+static std::chrono::steady_clock::time_point last_swap;
+static bool swap_seen = false;
+static bool present_pending = false;
+static double pending_present_timestamp = 0.0;
+
+//Swap intervals outside this share of the refresh period (missed vblanks, time spent in menus) don't move the estimate, the rest move it by REFRESH_SMOOTHING of the difference
+static const double REFRESH_ACCEPT_LOW = 0.5;
+static const double REFRESH_ACCEPT_HIGH = 1.5;
+static const double REFRESH_SMOOTHING = 0.05;
+
+//Layout of the frame currently in the video textures, used to draw it again when the next frame isn't due yet
+static frame_layout shown_layout = FRAME_RGB0;
+static bool frame_shown = false;
+
+Texture_Upload_Stats texture_upload_stats = { 0, 0.0, 0.0, 0, 0, 0, 0, 0 };
+Shader_Stats shader_stats = { 0, 0, 0, 0, 0, 0.0 };
+const char* SHADER_CACHE_DIRECTORY = "shader_cache";
+
+//Start of every saved program binary, driver_hash is of the GL vendor, renderer and version strings it was saved under
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t driver_hash;
+    uint32_t binary_format;
+    uint32_t binary_length;
+} Shader_Binary_Header;
+
+static const char SHADER_BINARY_MAGIC[4] = { 'K', 'S', 'P', 'B' };
+static const uint32_t SHADER_BINARY_VERSION = 1;
+
+//Programs made so far by the hash of their sources, and the uniform locations looked up in them
+static std::map<uint64_t, int> shader_programs;
+static std::map<std::pair<int, std::string>, int> uniform_locations;
+Text_Render_Stats text_render_stats = { 0, 0, 0, 0, 0.0, 0, 0, 0, 0, 0 };
+
+//Size of the glyph atlas, 1024 cells of GLYPH_CELL_SIZE (4 MB), enough for the Latin glyphs plus the Hangul/kana/kanji of a few screens of songs
+//Glyphs sit a pixel inside their cell so linear filtering doesn't pull in their neighbours, bigger glyphs are cut off at the cell's edge
+static const int GLYPH_ATLAS_WIDTH = 2048;
+static const int GLYPH_ATLAS_HEIGHT = 2048;
+static const int GLYPH_ATLAS_PADDING = 1;
+
+//Fonts glyphs are looked up in, in order. Fonts that aren't installed are left out of the chain
+static const char* FONT_FALLBACK_CHAIN[] = {
+    "C:\\Windows\\fonts\\arial.ttf",      // Latin, Greek and Cyrillic
+    "C:\\Windows\\fonts\\malgun.ttf",     // Korean
+    "C:\\Windows\\fonts\\msgothic.ttc",   // Japanese
+    "C:\\Windows\\fonts\\msyh.ttc",       // Chinese
+    "C:\\Windows\\fonts\\seguisym.ttf"    // Symbols
+};
+static const int FONT_PIXEL_SIZE = 48;
+
+//Strings are cached by everything that changes their vertices or how they're drawn
+typedef struct Text_Key {
+    std::string text;
+    float x;
+    float y;
+    float scale;
+    float red;
+    float green;
+    float blue;
+    bool operator<(const Text_Key& other) const {
+        return std::tie(text, x, y, scale, red, green, blue) < std::tie(other.text, other.x, other.y, other.scale, other.red, other.green, other.blue);
+    }
+} Text_Key;
+
+//A laid out string's vertex buffer, the last render loop pass that drew it and the glyph cache generation it was laid out in
+typedef struct {
+    unsigned int buffer;
+    unsigned int atlas_texture;
+    int vertex_count;
+    size_t bytes;
+    int64_t last_frame;
+    int64_t glyph_generation;
+} Cached_Text;
+
+//Strings not drawn for this many passes of the render loop have their buffers freed, so text that keeps changing (like the search input) doesn't pile up
+static const int64_t TEXT_CACHE_IDLE_FRAMES = 120;
+
+static std::map<Text_Key, Cached_Text> text_cache;
+static int64_t text_frame_number = 0;
+
+//Vertices of the string being laid out, kept between calls so the vector doesn't reallocate for every new string. text_calls_this_frame is what end_text_frame() looks at
+static std::vector<float> text_vertices;
+static int64_t text_calls_this_frame = 0;
+
+//A pixel buffer object frames are decoded into, mapped is where it's mapped while the frame pool has it and fence is set while the GPU is uploading from it
+typedef struct {
+    unsigned int buffer;
+    size_t size;
+    uint8_t* mapped;
+    GLsync fence;
+} Frame_Upload_Buffer;
+
+//Created on the first pass that has a frame size, grown when a bigger frame arrives and deleted when the song is closed
+static std::vector<Frame_Upload_Buffer> upload_buffers;
+static std::vector<uint8_t*> unused_upload_buffers;
+
+//Texture and frame size/layout the video texture storage was last allocated for, storage is only allocated again when one of them changes
+static unsigned int storage_texture = 0;
+static int storage_width = 0;
+static int storage_height = 0;
+static frame_layout storage_layout = FRAME_RGB0;
+
 
 
 //****************************************************************************************************************
@@ -38,6 +152,31 @@ const char* texture_fragmentShaderSource = "#version 330 core\n"
 "   FragColor = texture(ourTexture, TexCoord);\n"
 "}\n\0";    
 
+//The source for video frames that arrive as YUV planes, converts them to RGB with the stream's matrix and range
+//NV12 frames keep both chroma samples in u_texture's red and green channels
+const char* yuv_fragmentShaderSource = "#version 330 core\n"
+"in vec3 ourColor;\n"
+"in vec2 TexCoord;\n"
+"out vec4 FragColor;\n"
+"uniform sampler2D y_texture;\n"
+"uniform sampler2D u_texture;\n"
+"uniform sampler2D v_texture;\n"
+"uniform int nv12;\n"
+"uniform mat3 yuv_matrix;\n"
+"uniform vec3 yuv_offset;\n"
+"void main()\n"
+"{\n"
+"   vec3 yuv;\n"
+"   yuv.x = texture(y_texture, TexCoord).r;\n"
+"   if (nv12 == 1) {\n"
+"       yuv.yz = texture(u_texture, TexCoord).rg;\n"
+"   } else {\n"
+"       yuv.y = texture(u_texture, TexCoord).r;\n"
+"       yuv.z = texture(v_texture, TexCoord).r;\n"
+"   }\n"
+"   FragColor = vec4(clamp(yuv_matrix * (yuv - yuv_offset), 0.0, 1.0), 1.0);\n"
+"}\n\0";
+
 //****************************************************************************************************************
 //****************************************************************************************************************
 // 
@@ -102,10 +241,30 @@ int fragment_shader_creator(const char* fragment_source) {
 }
 
 
+//Program binaries are core from OpenGL 4.1, before that the driver has to have ARB_get_program_binary. Without either, programs are always compiled
+static bool program_binaries_supported() {
+#ifdef GL_VERSION_4_1
+    if (GLAD_GL_VERSION_4_1) {
+        return true;
+    }
+#endif
+#ifdef GL_ARB_get_program_binary
+    if (GLAD_GL_ARB_get_program_binary) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+
 int shader_program_creator(int vertexShader, int fragmentShader) {
     int shaderProgram = glCreateProgram();
     int success;
     char infoLog[512];
+    //Lets the linked program be read back with glGetProgramBinary for the shader cache
+    if (program_binaries_supported()) {
+        glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
     glAttachShader(shaderProgram, vertexShader);
     glAttachShader(shaderProgram, fragmentShader);
     glLinkProgram(shaderProgram);
@@ -120,11 +279,137 @@ int shader_program_creator(int vertexShader, int fragmentShader) {
 }
 
 
+//****************    Shader program cache
+
+//Saved binaries only work with the driver that made them, so they're tagged with a hash of its strings and a driver update makes them all stale
+static uint64_t driver_hash() {
+    uint64_t hash = 14695981039346656037ULL;
+    GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (GLenum name : names) {
+        const char* value = (const char*)glGetString(name);
+        hash = fnv1a_hash(value != NULL ? value : "", hash);
+        hash = fnv1a_hash("|", hash);
+    }
+    return hash;
+}
+
+static std::string shader_binary_path(uint64_t source_hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)source_hash);
+    return (std::filesystem::path(SHADER_CACHE_DIRECTORY) / name).string();
+}
+
+//Loads a saved program if there is one from this driver that still links, returns 0 otherwise
+static int load_program_binary(uint64_t source_hash, uint64_t driver) {
+    FILE* file = fopen(shader_binary_path(source_hash).c_str(), "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    Shader_Binary_Header header;
+    std::vector<uint8_t> binary;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, SHADER_BINARY_MAGIC, 4) == 0 &&
+        header.version == SHADER_BINARY_VERSION && header.driver_hash == driver && header.binary_length > 0;
+    if (valid) {
+        binary.resize(header.binary_length);
+        valid = fread(binary.data(), 1, binary.size(), file) == binary.size();
+    }
+    fclose(file);
+    if (!valid) {
+        return 0;
+    }
+
+    int program = glCreateProgram();
+    glProgramBinary(program, header.binary_format, binary.data(), (GLsizei)binary.size());
+    int success = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+//Saves a linked program for the next launch, drivers that can't hand back binaries are skipped
+static bool save_program_binary(int program, uint64_t source_hash, uint64_t driver) {
+    int length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return false;
+    }
+    std::vector<uint8_t> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    std::error_code error;
+    std::filesystem::create_directories(SHADER_CACHE_DIRECTORY, error);
+    FILE* file = fopen(shader_binary_path(source_hash).c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+    Shader_Binary_Header header = { { SHADER_BINARY_MAGIC[0], SHADER_BINARY_MAGIC[1], SHADER_BINARY_MAGIC[2], SHADER_BINARY_MAGIC[3] }, SHADER_BINARY_VERSION, driver, format, (uint32_t)length };
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, length, file) == (size_t)length;
+    fclose(file);
+    return written;
+}
+
+//Returns the program for this pair of sources, the same one every time it's asked for
+//The first time in a launch it's loaded from the shader cache if this driver saved it before, otherwise it's compiled and linked and then saved
+int shader_program_from_sources(const char* vertex_source, const char* fragment_source) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t source_hash = fnv1a_hash(fragment_source, fnv1a_hash("\n#fragment\n", fnv1a_hash(vertex_source)));
+    auto existing = shader_programs.find(source_hash);
+    if (existing != shader_programs.end()) {
+        shader_stats.shared++;
+        return existing->second;
+    }
+
+    int binary_formats = 0;
+    if (program_binaries_supported()) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binary_formats);
+    }
+    uint64_t driver = binary_formats > 0 ? driver_hash() : 0;
+    int program = binary_formats > 0 ? load_program_binary(source_hash, driver) : 0;
+    if (program != 0) {
+        shader_stats.loaded++;
+    }
+    else {
+        program = shader_program_creator(vertex_shader_creator(vertex_source), fragment_shader_creator(fragment_source));
+        shader_stats.compiled++;
+        if (binary_formats > 0 && save_program_binary(program, source_hash, driver)) {
+            shader_stats.saved++;
+        }
+    }
+    shader_programs[source_hash] = program;
+    shader_stats.programs++;
+    shader_stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return program;
+}
+
+//Only asks the driver the first time a name is looked up in a program, uniforms that don't exist are remembered as -1 like glGetUniformLocation gives
+int uniform_location(int shader_program, const char* name) {
+    std::pair<int, std::string> key(shader_program, name);
+    auto found = uniform_locations.find(key);
+    if (found != uniform_locations.end()) {
+        return found->second;
+    }
+    int location = glGetUniformLocation(shader_program, name);
+    uniform_locations[key] = location;
+    return location;
+}
+
+//A launch where every program was loaded is a warm start, one that compiled them is cold
+void print_shader_stats() {
+    std::cout << "Shaders: " << shader_stats.programs << " programs (" << shader_stats.shared << " requests shared an existing one), " << shader_stats.loaded << " loaded from the cache, "
+        << shader_stats.compiled << " compiled (" << shader_stats.saved << " saved), " << shader_stats.seconds * 1000.0 << " ms, "
+        << (shader_stats.compiled == 0 && shader_stats.loaded > 0 ? "warm" : "cold") << " start" << std::endl;
+}
+
+
 //Function to generate/bind VAO/VBO/EBO and generating/binding texture information of the background texture
 
 void background_component_generation(unsigned int &VAO, unsigned int &VBO, unsigned int &EBO, int &shader_program, unsigned int &background_texture) {
     glUseProgram(shader_program);
-    glUniform1i(glGetUniformLocation(shader_program, "background_texture"), 0);
+    glUniform1i(uniform_location(shader_program, "background_texture"), 0);
     float vertices[] = {
         // positions          // colors           // texture coords
          1.0f,  1.0f, 0.0f,   1.0f, 0.0f, 0.0f,   1.0f, 1.0f, // top right
@@ -200,7 +485,7 @@ void background_component_generation(unsigned int &VAO, unsigned int &VBO, unsig
 
 void video_component_generation(unsigned int& VAO, unsigned int& VBO, unsigned int& EBO, int& shader_program, unsigned int& video_texture,/* uint8_t* video_frame_data,*/ int width, int height) {
     glUseProgram(shader_program);
-    glUniform1i(glGetUniformLocation(shader_program, "background_texture"), 0);
+    glUniform1i(uniform_location(shader_program, "background_texture"), 0);
 
 
 
@@ -254,89 +539,277 @@ void video_component_generation(unsigned int& VAO, unsigned int& VBO, unsigned i
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    glGenerateMipmap(GL_TEXTURE_2D);
+    //Storage is allocated by the first frame uploaded into it, see allocate_video_storage()
     glBindVertexArray(0);
 }
 
 
 
-//Generates textures for all characters
+//Generates the three single channel textures that YUV frames are uploaded into and points the YUV shader's samplers at them
 
-std::map<char, Character> text_component_generation(unsigned int& text_VAO, unsigned int& text_VBO, int &text_shaderProgram) {
+void video_plane_texture_generation(int& yuv_shader_program, unsigned int plane_textures[3]) {
+    glUseProgram(yuv_shader_program);
+    glUniform1i(uniform_location(yuv_shader_program, "y_texture"), 0);
+    glUniform1i(uniform_location(yuv_shader_program, "u_texture"), 1);
+    glUniform1i(uniform_location(yuv_shader_program, "v_texture"), 2);
 
-    //Projects the text to be based on screen's dimensions rather than the -1.0 to 1.0 measurement
-    glm::mat4 projection = glm::ortho(0.0f, static_cast<float>(SCR_WIDTH), 0.0f, static_cast<float>(SCR_HEIGHT));
-    glUseProgram(text_shaderProgram);
-    glUniformMatrix4fv(glGetUniformLocation(text_shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+    glGenTextures(3, plane_textures);
+    for (int i = 0; i < 3; i++) {
+        glBindTexture(GL_TEXTURE_2D, plane_textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
 
 
-    //Use freetype's freetype object to laod arial characters into face object 
-    FT_Library ft;
-    if (FT_Init_FreeType(&ft))
-    {
+
+//****************    Glyph cache
+
+//Opens every font of the chain that can be found and sets up the empty atlas, pixel_size is the height glyphs are rasterized at
+bool glyph_cache::open(const std::vector<std::string>& font_paths, int pixel_size) {
+    if (FT_Init_FreeType(&library)) {
         std::cout << "ERROR::FREETYPE: Could not init FreeType Library" << std::endl;
-        //return -1;
+        return false;
     }
-    FT_Face face;
-    if (FT_New_Face(ft, "C:\\Windows\\fonts\\arial.ttf", 0, &face))
-    {
+    for (const std::string& path : font_paths) {
+        FT_Face face;
+        if (FT_New_Face(library, path.c_str(), 0, &face)) {
+            std::cout << "Font " << path << " not found, left out of the fallback chain" << std::endl;
+            continue;
+        }
+        FT_Set_Pixel_Sizes(face, 0, pixel_size);
+        faces.push_back(face);
+    }
+    if (faces.empty()) {
         std::cout << "ERROR::FREETYPE: Failed to load font" << std::endl;
-        //return -1;
+        return false;
     }
-    FT_Set_Pixel_Sizes(face, 0, 48);
-    if (FT_Load_Char(face, 'X', FT_LOAD_RENDER))
-    {
-        std::cout << "ERROR::FREETYTPE: Failed to load Glyph" << std::endl;
-        //return -1;
+
+    cells_per_row = GLYPH_ATLAS_WIDTH / GLYPH_CELL_SIZE;
+    int cell_count = cells_per_row * (GLYPH_ATLAS_HEIGHT / GLYPH_CELL_SIZE);
+    //Handed out from the back, so the first glyphs go in the top left
+    free_cells.clear();
+    for (int cell = cell_count - 1; cell >= 0; cell--) {
+        free_cells.push_back(cell);
+    }
+    cell_pixels.assign((size_t)GLYPH_CELL_SIZE * GLYPH_CELL_SIZE, 0);
+
+    std::vector<uint8_t> blank_atlas((size_t)GLYPH_ATLAS_WIDTH * GLYPH_ATLAS_HEIGHT, 0);
+    glGenTextures(1, &atlas_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, atlas_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, GLYPH_ATLAS_WIDTH, GLYPH_ATLAS_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, blank_atlas.data());
+    // set texture options
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return true;
+}
+
+void glyph_cache::close() {
+    for (FT_Face face : faces) {
+        FT_Done_Face(face);
+    }
+    faces.clear();
+    if (library != NULL) {
+        FT_Done_FreeType(library);
+        library = NULL;
+    }
+    if (atlas_texture != 0) {
+        glDeleteTextures(1, &atlas_texture);
+        atlas_texture = 0;
+    }
+    glyphs.clear();
+    recently_used.clear();
+    free_cells.clear();
+}
+
+//Looks a code point up, rasterizing it into the atlas if it isn't there. Returns false if no glyph could be made for it
+bool glyph_cache::find(uint32_t code_point, Character& glyph) {
+    counters.lookups++;
+    auto found = glyphs.find(code_point);
+    if (found != glyphs.end()) {
+        counters.hits++;
+        recently_used.splice(recently_used.begin(), recently_used, found->second.recent);
+        glyph = found->second.glyph;
+        return true;
+    }
+    return rasterize(code_point, glyph);
+}
+
+//Goes up every time a glyph is evicted. Strings laid out in an earlier generation may point at a cell that now holds another glyph
+int64_t glyph_cache::generation() {
+    return evicted_generation;
+}
+
+//Gives out a free cell, or the cell of the least recently used glyph when the atlas is full
+int glyph_cache::take_cell() {
+    if (!free_cells.empty()) {
+        int cell = free_cells.back();
+        free_cells.pop_back();
+        return cell;
     }
+    uint32_t oldest = recently_used.back();
+    recently_used.pop_back();
+    auto evicted = glyphs.find(oldest);
+    int cell = evicted->second.cell;
+    glyphs.erase(evicted);
+    counters.evictions++;
+    evicted_generation++;
+    return cell;
+}
 
-    //Object that contains all the textures and pixel information for text characters
-    std::map<char, Character> characters;
+bool glyph_cache::rasterize(uint32_t code_point, Character& glyph) {
+    if (faces.empty()) {
+        return false;
+    }
+    auto rasterize_start = std::chrono::steady_clock::now();
+
+    //First font of the chain that has the code point, glyph index 0 is the font's missing glyph box
+    FT_Face face = faces[0];
+    FT_UInt glyph_index = 0;
+    for (size_t i = 0; i < faces.size(); i++) {
+        glyph_index = FT_Get_Char_Index(faces[i], code_point);
+        if (glyph_index != 0) {
+            face = faces[i];
+            counters.fallbacks += i > 0 ? 1 : 0;
+            break;
+        }
+    }
+    if (glyph_index == 0) {
+        counters.missing++;
+    }
+    if (FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER)) {
+        std::cout << "ERROR::FREETYTPE: Failed to load Glyph " << code_point << std::endl;
+        return false;
+    }
 
+    //The whole cell is uploaded, which also clears whatever glyph was in it before
+    FT_Bitmap& bitmap = face->glyph->bitmap;
+    int width = std::min((int)bitmap.width, GLYPH_CELL_SIZE - 2 * GLYPH_ATLAS_PADDING);
+    int rows = std::min((int)bitmap.rows, GLYPH_CELL_SIZE - 2 * GLYPH_ATLAS_PADDING);
+    std::fill(cell_pixels.begin(), cell_pixels.end(), 0);
+    for (int row = 0; row < rows; row++) {
+        memcpy(&cell_pixels[(size_t)(row + GLYPH_ATLAS_PADDING) * GLYPH_CELL_SIZE + GLYPH_ATLAS_PADDING], bitmap.buffer + (size_t)row * bitmap.pitch, width);
+    }
+    int cell = take_cell();
+    int cell_x = (cell % cells_per_row) * GLYPH_CELL_SIZE;
+    int cell_y = (cell / cells_per_row) * GLYPH_CELL_SIZE;
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    for (unsigned char c = 0; c < 128; c++)
-    {
-        // load character glyph 
-        if (FT_Load_Char(face, c, FT_LOAD_RENDER))
-        {
-            std::cout << "ERROR::FREETYTPE: Failed to load Glyph" << std::endl;
-            continue;
+    glBindTexture(GL_TEXTURE_2D, atlas_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, cell_x, cell_y, GLYPH_CELL_SIZE, GLYPH_CELL_SIZE, GL_RED, GL_UNSIGNED_BYTE, cell_pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    int glyph_x = cell_x + GLYPH_ATLAS_PADDING;
+    int glyph_y = cell_y + GLYPH_ATLAS_PADDING;
+    glyph = {
+        atlas_texture,
+        glm::ivec2(width, rows),
+        glm::ivec2(face->glyph->bitmap_left, face->glyph->bitmap_top),
+        face->glyph->advance.x,
+        glm::vec2(glyph_x / (float)GLYPH_ATLAS_WIDTH, glyph_y / (float)GLYPH_ATLAS_HEIGHT),
+        glm::vec2(width / (float)GLYPH_ATLAS_WIDTH, rows / (float)GLYPH_ATLAS_HEIGHT)
+    };
+    recently_used.push_front(code_point);
+    glyphs[code_point] = { glyph, cell, recently_used.begin() };
+
+    counters.rasterized++;
+    counters.rasterize_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - rasterize_start).count();
+    return true;
+}
+
+//Prints the hit rate, the time glyphs took to rasterize and how much of the atlas is in use
+void glyph_cache::print_stats() {
+    if (counters.lookups == 0) {
+        return;
+    }
+    int cell_count = cells_per_row * (GLYPH_ATLAS_HEIGHT / GLYPH_CELL_SIZE);
+    std::cout << "Glyph cache: " << counters.hits * 100.0 / counters.lookups << "% hits over " << counters.lookups << " lookups, " << counters.rasterized << " rasterized in "
+        << counters.rasterize_seconds * 1000.0 << " ms (" << (counters.rasterized > 0 ? counters.rasterize_seconds / counters.rasterized * 1000000.0 : 0.0) << " us each), "
+        << counters.evictions << " evicted" << std::endl;
+    std::cout << "Glyph cache: " << glyphs.size() << " of " << cell_count << " cells in use, atlas " << (size_t)GLYPH_ATLAS_WIDTH * GLYPH_ATLAS_HEIGHT / (1024.0 * 1024.0) << " MB, "
+        << faces.size() << " fonts, " << counters.fallbacks << " glyphs from fallback fonts, " << counters.missing << " with no font" << std::endl;
+}
+
+
+//****************    UTF-8
+
+//Decodes the code point starting at position and moves position past it
+uint32_t next_code_point(const std::string& text, size_t& position) {
+    unsigned char lead = (unsigned char)text[position++];
+    if (lead < 0x80) {
+        return lead;
+    }
+    int continuation_bytes = lead >= 0xF8 ? -1 : lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : -1;
+    if (continuation_bytes < 0) {
+        return 0xFFFD;
+    }
+    uint32_t code_point = lead & (0x3F >> continuation_bytes);
+    for (int i = 0; i < continuation_bytes; i++) {
+        if (position >= text.size() || ((unsigned char)text[position] & 0xC0) != 0x80) {
+            return 0xFFFD;
         }
-        // generate texture
-        unsigned int texture;
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexImage2D(
-            GL_TEXTURE_2D,
-            0,
-            GL_RED,
-            face->glyph->bitmap.width,
-            face->glyph->bitmap.rows,
-            0,
-            GL_RED,
-            GL_UNSIGNED_BYTE,
-            face->glyph->bitmap.buffer
-        );
-        // set texture options
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // now store character for later use
-        Character glyph = {
-            texture,
-            glm::ivec2(face->glyph->bitmap.width, face->glyph->bitmap.rows),
-            glm::ivec2(face->glyph->bitmap_left, face->glyph->bitmap_top),
-            face->glyph->advance.x
-        };
-        characters.insert(std::pair<char, Character>(c, glyph));
+        code_point = (code_point << 6) | ((unsigned char)text[position++] & 0x3F);
     }
+    return code_point;
+}
 
-    //clear freetype resources
-    FT_Done_Face(face);
-    FT_Done_FreeType(ft);
+void append_utf8(std::string& text, uint32_t code_point) {
+    if (code_point > 0x10FFFF || (code_point >= 0xD800 && code_point <= 0xDFFF)) {
+        code_point = 0xFFFD;
+    }
+    if (code_point < 0x80) {
+        text += (char)code_point;
+    }
+    else if (code_point < 0x800) {
+        text += (char)(0xC0 | (code_point >> 6));
+        text += (char)(0x80 | (code_point & 0x3F));
+    }
+    else if (code_point < 0x10000) {
+        text += (char)(0xE0 | (code_point >> 12));
+        text += (char)(0x80 | ((code_point >> 6) & 0x3F));
+        text += (char)(0x80 | (code_point & 0x3F));
+    }
+    else {
+        text += (char)(0xF0 | (code_point >> 18));
+        text += (char)(0x80 | ((code_point >> 12) & 0x3F));
+        text += (char)(0x80 | ((code_point >> 6) & 0x3F));
+        text += (char)(0x80 | (code_point & 0x3F));
+    }
+}
+
+//Removes the last code point, continuation bytes are dropped along with the byte that started them
+void pop_utf8(std::string& text) {
+    while (!text.empty() && ((unsigned char)text.back() & 0xC0) == 0x80) {
+        text.pop_back();
+    }
+    if (!text.empty()) {
+        text.pop_back();
+    }
+}
 
 
+//Opens the fonts for text and sets up its VAO/VBO, the printable ASCII glyphs are put in the atlas up front since nearly every string uses them
+
+void text_component_generation(unsigned int& text_VAO, unsigned int& text_VBO, int &text_shaderProgram, glyph_cache& characters) {
+
+    //Projects the text to be based on screen's dimensions rather than the -1.0 to 1.0 measurement
+    glm::mat4 projection = glm::ortho(0.0f, static_cast<float>(SCR_WIDTH), 0.0f, static_cast<float>(SCR_HEIGHT));
+    glUseProgram(text_shaderProgram);
+    glUniformMatrix4fv(uniform_location(text_shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+
+    std::vector<std::string> font_paths(std::begin(FONT_FALLBACK_CHAIN), std::end(FONT_FALLBACK_CHAIN));
+    if (characters.open(font_paths, FONT_PIXEL_SIZE)) {
+        Character glyph;
+        for (uint32_t c = 32; c < 127; c++) {
+            characters.find(c, glyph);
+        }
+    }
 
     //Assign values to VAO/VBO objects
     glGenVertexArrays(1, &text_VAO);
@@ -348,63 +821,160 @@ std::map<char, Character> text_component_generation(unsigned int& text_VAO, unsi
     glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), 0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
-
-    return characters;
 }
 
 
 //****************    Text creation
 
-//Funtion to bind and draw text textures using the map of characters created in main
-void render_text(std::map<char, Character> characters, std::string text, int text_shader_program,unsigned int text_VAO, unsigned int text_VBO, float x_start, float y_start, float scale, glm::vec3 color) {
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    glUseProgram(text_shader_program);
-    glUniform3f(glGetUniformLocation(text_shader_program, "textColor"), color.x, color.y, color.z);
-    glActiveTexture(GL_TEXTURE0);
-    glBindVertexArray(text_VAO);
-    std::string::const_iterator c;
-
-    for (c = text.begin(); c != text.end(); c++) {
-        Character ch = characters[*c];
+//Lays out a UTF-8 string into two triangles per visible glyph (x, y, u, v per vertex) starting at the baseline position x_start, y_start
+static void layout_text(glyph_cache& characters, const std::string& text, float x_start, float y_start, float scale, std::vector<float>& vertices_out, unsigned int& atlas_texture) {
+    vertices_out.clear();
+    Character ch;
+    for (size_t position = 0; position < text.size();) {
+        uint32_t code_point = next_code_point(text, position);
+        //Control characters have no glyph to draw
+        if (code_point < 32 || !characters.find(code_point, ch)) {
+            continue;
+        }
+        atlas_texture = ch.TextureID;
         float xpos = x_start + ch.Bearing.x * scale;
         float ypos = y_start - (ch.Size.y - ch.Bearing.y) * scale;
 
         float w = ch.Size.x * scale;
         float h = ch.Size.y * scale;
 
-        //Two triangles
-        float vertices[6][4] = {
-            { xpos,     ypos + h,   0.0f, 0.0f },
-             { xpos,     ypos,       0.0f, 1.0f },
-            { xpos + w, ypos,       1.0f, 1.0f },
-
-            { xpos,     ypos + h,   0.0f, 0.0f },
-            { xpos + w, ypos,       1.0f, 1.0f },
-            { xpos + w, ypos + h,   1.0f, 0.0f }
-        };
-
-        //render glyph texture over quad
-        glBindTexture(GL_TEXTURE_2D, ch.TextureID);
-        glBindBuffer(GL_ARRAY_BUFFER, text_VBO);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        //render quad
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+        //Blank glyphs like spaces only move the cursor
+        if (ch.Size.x > 0 && ch.Size.y > 0) {
+            float u0 = ch.AtlasOffset.x;
+            float v0 = ch.AtlasOffset.y;
+            float u1 = ch.AtlasOffset.x + ch.AtlasSize.x;
+            float v1 = ch.AtlasOffset.y + ch.AtlasSize.y;
+
+            //Two triangles
+            float vertices[6][4] = {
+                { xpos,     ypos + h,   u0, v0 },
+                { xpos,     ypos,       u0, v1 },
+                { xpos + w, ypos,       u1, v1 },
+
+                { xpos,     ypos + h,   u0, v0 },
+                { xpos + w, ypos,       u1, v1 },
+                { xpos + w, ypos + h,   u1, v0 }
+            };
+            vertices_out.insert(vertices_out.end(), &vertices[0][0], &vertices[0][0] + 6 * 4);
+        }
         //advance cursor for next glyph
         x_start += (ch.Advance >> 6) * scale;
     }
+}
+
+//Funtion to draw text using the map of characters created in main
+//Each string is laid out and uploaded into its own vertex buffer the first time it's drawn with a given position, scale and color, after that drawing it again only binds that buffer
+//Every glyph comes from the same atlas texture so the whole string is one draw call. A string is laid out again if glyphs were evicted from the atlas since it was last laid out
+void render_text(glyph_cache& characters, const std::string& text, int text_shader_program,unsigned int text_VAO, float x_start, float y_start, float scale, glm::vec3 color) {
+    auto text_start = std::chrono::steady_clock::now();
+
+    Text_Key key = { text, x_start, y_start, scale, color.x, color.y, color.z };
+    auto cached = text_cache.find(key);
+    if (cached != text_cache.end() && cached->second.glyph_generation != characters.generation()) {
+        if (cached->second.buffer != 0) {
+            glDeleteBuffers(1, &cached->second.buffer);
+        }
+        text_render_stats.buffer_bytes -= cached->second.bytes;
+        text_cache.erase(cached);
+        cached = text_cache.end();
+    }
+    if (cached == text_cache.end()) {
+        Cached_Text entry = { 0, 0, 0, 0, text_frame_number, 0 };
+        layout_text(characters, text, x_start, y_start, scale, text_vertices, entry.atlas_texture);
+        entry.glyph_generation = characters.generation();
+        entry.vertex_count = (int)(text_vertices.size() / 4);
+        if (entry.vertex_count > 0) {
+            entry.bytes = text_vertices.size() * sizeof(float);
+            glGenBuffers(1, &entry.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, entry.buffer);
+            glBufferData(GL_ARRAY_BUFFER, entry.bytes, text_vertices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            text_render_stats.uploads++;
+            text_render_stats.buffer_bytes += entry.bytes;
+        }
+        cached = text_cache.insert(std::make_pair(key, entry)).first;
+        text_render_stats.cache_misses++;
+    }
+    else {
+        text_render_stats.cache_hits++;
+    }
+    Cached_Text& entry = cached->second;
+    entry.last_frame = text_frame_number;
+    if (entry.vertex_count == 0) {
+        return;
+    }
+
+    glEnable(GL_CULL_FACE);
+    glEnable(GL_BLEND);
+    glUseProgram(text_shader_program);
+    glUniform3f(uniform_location(text_shader_program, "textColor"), color.x, color.y, color.z);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, entry.atlas_texture);
+
+    //The text VAO is pointed at the string's buffer, which doesn't upload anything
+    glBindVertexArray(text_VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, entry.buffer);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDrawArrays(GL_TRIANGLES, 0, entry.vertex_count);
+
     glBindVertexArray(0);
     glBindTexture(GL_TEXTURE_2D, 0);
 
     glDisable(GL_CULL_FACE);
     glDisable(GL_BLEND);
 
+    text_calls_this_frame++;
+    text_render_stats.text_calls++;
+    text_render_stats.draw_calls++;
+    text_render_stats.glyphs += entry.vertex_count / 6;
+    text_render_stats.cpu_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - text_start).count();
+}
+
+//Called once per pass of the render loop, counts the pass as a text frame if anything was drawn and frees the buffers of strings that haven't been drawn in a while
+void end_text_frame() {
+    if (text_calls_this_frame > 0) {
+        text_render_stats.frames++;
+    }
+    text_calls_this_frame = 0;
+    text_frame_number++;
+
+    for (auto entry = text_cache.begin(); entry != text_cache.end();) {
+        if (text_frame_number - entry->second.last_frame > TEXT_CACHE_IDLE_FRAMES) {
+            if (entry->second.buffer != 0) {
+                glDeleteBuffers(1, &entry->second.buffer);
+            }
+            text_render_stats.buffer_bytes -= entry->second.bytes;
+            entry = text_cache.erase(entry);
+        }
+        else {
+            entry++;
+        }
+    }
+    text_render_stats.cached_strings = (int64_t)text_cache.size();
+}
+
+//Prints the draw calls and CPU time an average text frame took, and the draw calls the same text took with a texture per glyph
+void print_text_render_stats() {
+    if (text_render_stats.frames == 0) {
+        return;
+    }
+    double frames = (double)text_render_stats.frames;
+    std::cout << "Text: " << text_render_stats.frames << " frames, " << text_render_stats.draw_calls / frames << " draw calls per frame (" << text_render_stats.glyphs / frames
+        << " with a texture per glyph), " << text_render_stats.cpu_seconds / frames * 1000.0 << " ms CPU per frame" << std::endl;
+    int64_t lookups = text_render_stats.cache_hits + text_render_stats.cache_misses;
+    std::cout << "Text cache: " << (lookups > 0 ? text_render_stats.cache_hits * 100.0 / lookups : 0.0) << "% hits, " << text_render_stats.uploads / frames << " buffer uploads per frame, "
+        << text_render_stats.cached_strings << " strings in " << text_render_stats.buffer_bytes / 1024.0 << " KB of buffers" << std::endl;
 }
 
 //Function uses render text for printing text of songs searched for after taking a vector of sql "rows"
 
-void print_songs(std::vector<Row> songs, const unsigned int screen_width, const unsigned int screen_height, std::map<char, Character> characters, int text_shader_program, unsigned int text_VAO, unsigned int text_VBO) {
+void print_songs(std::vector<Row> songs, const unsigned int screen_width, const unsigned int screen_height, glyph_cache& characters, int text_shader_program, unsigned int text_VAO) {
     float y_modifier = 0.7f;
     for (int i = 0; i < songs.size(); i++) {
         int result_num = songs[i][0];
@@ -414,7 +984,7 @@ void print_songs(std::vector<Row> songs, const unsigned int screen_width, const
         std::string song_string = song;
         std::string artist_string = artist;
         main_string = main_string + ". " + song_string + " by " + artist_string;
-        render_text(characters, main_string, text_shader_program, text_VAO, text_VBO, 0.075f * screen_width, y_modifier * screen_height, 0.25f, glm::vec3(0.0f, 0.0f, 0.0f));
+        render_text(characters, main_string, text_shader_program, text_VAO, 0.075f * screen_width, y_modifier * screen_height, 0.25f, glm::vec3(0.0f, 0.0f, 0.0f));
         y_modifier -= .025f;
     }
 }
@@ -435,42 +1005,403 @@ void render_background(unsigned int VAO, unsigned int background_texture, int sh
 
 //****************    Video frame creation
 
-//Function to render the video frames
+//Sets the YUV shader's matrix and offset for the current stream
+//Limited range streams have luma in 16-235 and chroma in 16-240 so those are stretched back out to 0-1 as part of the matrix
+
+static void set_yuv_color_matrix(int yuv_shaderProgram, color_matrix matrix, bool full_range) {
+    float kr = matrix == COLOR_MATRIX_BT709 ? 0.2126f : 0.299f;
+    float kb = matrix == COLOR_MATRIX_BT709 ? 0.0722f : 0.114f;
+    float kg = 1.0f - kr - kb;
+    float luma_scale = full_range ? 1.0f : 255.0f / 219.0f;
+    float chroma_scale = full_range ? 1.0f : 255.0f / 224.0f;
+
+    //Column major, one column each for the Y, U and V contributions to R, G and B
+    float yuv_matrix[9] = {
+        luma_scale, luma_scale, luma_scale,
+        0.0f, -chroma_scale * (2.0f - 2.0f * kb) * kb / kg, chroma_scale * (2.0f - 2.0f * kb),
+        chroma_scale * (2.0f - 2.0f * kr), -chroma_scale * (2.0f - 2.0f * kr) * kr / kg, 0.0f
+    };
+    glUniformMatrix3fv(uniform_location(yuv_shaderProgram, "yuv_matrix"), 1, GL_FALSE, yuv_matrix);
+    glUniform3f(uniform_location(yuv_shaderProgram, "yuv_offset"), full_range ? 0.0f : 16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f);
+}
 
-void render_video_frame(unsigned int video_VAO, unsigned int video_texture, int video_shaderProgram, std::map<double, uint8_t*>::iterator frame_iterator, std::map<double, uint8_t*>::iterator frame_iterator_end, double time, int width, int height, bool stream_ended) {
+//Allocates the video textures' storage for the frame's size and layout, once per resolution rather than once per frame
+//The chroma planes of YUV frames are half the width and height of the luma plane, and NV12 keeps both chroma samples in one two channel texture
+static void allocate_video_storage(Video_Frame& frame, unsigned int video_texture, unsigned int plane_textures[3]) {
+    unsigned int texture = frame.layout == FRAME_RGB0 ? video_texture : plane_textures[0];
+    if (texture == storage_texture && frame.width == storage_width && frame.height == storage_height && frame.layout == storage_layout) {
+        return;
+    }
+    storage_texture = texture;
+    storage_width = frame.width;
+    storage_height = frame.height;
+    storage_layout = frame.layout;
+    texture_upload_stats.storage_allocations++;
 
-    //First case is when your frame should wait to be rendered, then waits the difference in time\
-    //Second case is when your map iterator reaches the end of the map
-    //Third case is everything in between
-    if (frame_iterator->first > time) {
-        //std::cout << "waiting " << frame_iterator->first - time << " seconds" << std::endl;
-        glfwWaitEventsTimeout(frame_iterator->first - time);
-        uint8_t* cur_frame = frame_iterator->second;
+    if (frame.layout == FRAME_RGB0) {
+        glBindTexture(GL_TEXTURE_2D, video_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, frame.width, frame.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        return;
+    }
+    int chroma_width = (frame.width + 1) / 2;
+    int chroma_height = (frame.height + 1) / 2;
+    glBindTexture(GL_TEXTURE_2D, plane_textures[0]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, frame.width, frame.height, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, plane_textures[1]);
+    if (frame.layout == FRAME_NV12) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, chroma_width, chroma_height, 0, GL_RG, GL_UNSIGNED_BYTE, NULL);
+    }
+    else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, chroma_width, chroma_height, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+        glBindTexture(GL_TEXTURE_2D, plane_textures[2]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, chroma_width, chroma_height, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    }
+}
+
+//Called every pass of the render loop while a song plays. Buffers the GPU has finished uploading from, and ones the pool can't use for the current frame size, are grown if needed, mapped again and lent to the frame pool
+//Nothing here waits on the GPU, a buffer whose upload hasn't finished is left for a later pass
+static void supply_frame_buffers() {
+    size_t size = frame_pool.frame_size();
+    if (size == 0) {
+        return;
+    }
+    if (upload_buffers.size() < UPLOAD_BUFFER_COUNT) {
+        upload_buffers.resize(UPLOAD_BUFFER_COUNT, Frame_Upload_Buffer{ 0, 0, NULL, 0 });
+    }
+
+    unused_upload_buffers.clear();
+    frame_pool.take_unused_mapped(unused_upload_buffers);
+    for (uint8_t* unused : unused_upload_buffers) {
+        for (Frame_Upload_Buffer& upload : upload_buffers) {
+            if (upload.mapped == unused) {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.buffer);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                upload.mapped = NULL;
+            }
+        }
+    }
+
+    for (Frame_Upload_Buffer& upload : upload_buffers) {
+        if (upload.mapped != NULL) {
+            continue;
+        }
+        if (upload.fence != 0) {
+            if (glClientWaitSync(upload.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+                texture_upload_stats.fence_waits++;
+                continue;
+            }
+            glDeleteSync(upload.fence);
+            upload.fence = 0;
+        }
+        if (upload.buffer == 0) {
+            glGenBuffers(1, &upload.buffer);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.buffer);
+        if (upload.size < size) {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+            upload.size = size;
+        }
+        //The GPU is done with the old contents, so this doesn't wait on anything
+        upload.mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, upload.size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (upload.mapped != NULL) {
+            frame_pool.add_mapped(upload.mapped, upload.size);
+            texture_upload_stats.buffers_mapped++;
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+//Uploads a frame into the video textures
+//A frame the decoder wrote into a lent pixel buffer is unmapped and glTexSubImage2D reads from the buffer by offset, so the transfer happens on the GPU's time and the render thread never touches the pixels
+//Any other frame is uploaded straight from its memory
+static void upload_video_frame(Video_Frame& frame, unsigned int video_texture, unsigned int plane_textures[3]) {
+    auto upload_start = std::chrono::steady_clock::now();
+    allocate_video_storage(frame, video_texture, plane_textures);
+
+    Frame_Upload_Buffer* source_buffer = NULL;
+    for (Frame_Upload_Buffer& upload : upload_buffers) {
+        if (upload.mapped != NULL && upload.mapped == frame.frame_data) {
+            source_buffer = &upload;
+            break;
+        }
+    }
+    uintptr_t source = (uintptr_t)frame.frame_data;
+    if (source_buffer != NULL && frame_pool.retire_mapped(frame.frame_data)) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, source_buffer->buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        source_buffer->mapped = NULL;
+        source = 0;
+        //The buffer is the renderer's again, there's nothing for release_video_frame() to hand back
+        frame.frame_data = NULL;
+    }
+    else {
+        source_buffer = NULL;
+        if (!frame.mapped) {
+            texture_upload_stats.pool_uploads++;
+        }
+    }
+
+    //With a buffer bound the data pointers are offsets into it
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (frame.layout == FRAME_RGB0) {
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, video_texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, cur_frame);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        glUseProgram(video_shaderProgram);
-        glBindVertexArray(video_VAO);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width, frame.height, GL_RGBA, GL_UNSIGNED_BYTE, (const void*)source);
     }
-    else if (frame_iterator == frame_iterator_end) {
-        stream_ended = true;
-    } else {
-        uint8_t* cur_frame = frame_iterator->second;
+    else {
+        int chroma_width = (frame.width + 1) / 2;
+        int chroma_height = (frame.height + 1) / 2;
+        size_t luma_size = (size_t)frame.width * frame.height;
+        size_t chroma_size = (size_t)chroma_width * chroma_height;
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, plane_textures[0]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width, frame.height, GL_RED, GL_UNSIGNED_BYTE, (const void*)source);
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, plane_textures[1]);
+        if (frame.layout == FRAME_NV12) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, chroma_width, chroma_height, GL_RG, GL_UNSIGNED_BYTE, (const void*)(source + luma_size));
+        }
+        else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, chroma_width, chroma_height, GL_RED, GL_UNSIGNED_BYTE, (const void*)(source + luma_size));
+
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, plane_textures[2]);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, chroma_width, chroma_height, GL_RED, GL_UNSIGNED_BYTE, (const void*)(source + luma_size + chroma_size));
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    if (source_buffer != NULL) {
+        source_buffer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        texture_upload_stats.mapped_uploads++;
+    }
+
+    double upload_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - upload_start).count();
+    texture_upload_stats.uploads++;
+    texture_upload_stats.upload_seconds += upload_seconds;
+    if (upload_seconds > texture_upload_stats.max_upload_seconds) {
+        texture_upload_stats.max_upload_seconds = upload_seconds;
+    }
+}
+
+
+//Draws whatever frame is currently in the video textures with the shader for its layout
+
+static void draw_video_textures(unsigned int video_VAO, unsigned int video_texture, int video_shaderProgram, unsigned int plane_textures[3], int yuv_shaderProgram) {
+    if (shown_layout == FRAME_RGB0) {
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, video_texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, cur_frame);
-        glGenerateMipmap(GL_TEXTURE_2D);
         glUseProgram(video_shaderProgram);
-        glBindVertexArray(video_VAO);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+    }
+    else {
+        for (int i = 0; i < 3; i++) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            glBindTexture(GL_TEXTURE_2D, plane_textures[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glUseProgram(yuv_shaderProgram);
+        glUniform1i(uniform_location(yuv_shaderProgram, "nv12"), shown_layout == FRAME_NV12 ? 1 : 0);
+        set_yuv_color_matrix(yuv_shaderProgram, video_color_matrix, video_full_range);
+    }
+    glBindVertexArray(video_VAO);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+}
+
+
+//Keeps the last frame up without taking a new one from the ring, for while a seek waits on the decoders
+//The decoder is still handed mapped buffers so the frames it decodes at the target can go straight to the GPU
+void render_held_video_frame(unsigned int video_VAO, unsigned int video_texture, int video_shaderProgram, unsigned int plane_textures[3], int yuv_shaderProgram) {
+    supply_frame_buffers();
+    if (frame_shown) {
+        draw_video_textures(video_VAO, video_texture, video_shaderProgram, plane_textures, yuv_shaderProgram);
+    }
+}
+
+
+//****************    Frame pacing
+
+//Turns on vsync so every swap lands on a vblank, and starts the refresh period from what the monitor reports
+void start_frame_pacing() {
+    glfwSwapInterval(1);
+    GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode* mode = monitor != NULL ? glfwGetVideoMode(monitor) : NULL;
+    if (mode != NULL && mode->refreshRate > 0) {
+        display_refresh_period = 1.0 / mode->refreshRate;
+    }
+}
 
+//With vsync the swap returns at a vblank, so the time between swaps follows the refresh period
+//A frame presented in this pass is now on screen, and how far its time is from the playback clock is its present error
+void record_buffer_swap() {
+    auto now = std::chrono::steady_clock::now();
+    if (swap_seen) {
+        double interval = std::chrono::duration<double>(now - last_swap).count();
+        if (interval > display_refresh_period * REFRESH_ACCEPT_LOW && interval < display_refresh_period * REFRESH_ACCEPT_HIGH) {
+            display_refresh_period += (interval - display_refresh_period) * REFRESH_SMOOTHING;
+        }
+    }
+    last_swap = now;
+    swap_seen = true;
+
+    if (!present_pending) {
+        return;
+    }
+    present_pending = false;
+    static const double BUCKET_LIMITS[PRESENT_HISTOGRAM_BUCKETS - 1] = { 0.002, 0.004, 0.008, 0.016, 0.033 };
+    double error = playback_time() - pending_present_timestamp;
+    int bucket = 0;
+    while (bucket < PRESENT_HISTOGRAM_BUCKETS - 1 && std::abs(error) >= BUCKET_LIMITS[bucket]) {
+        bucket++;
+    }
+    av_sync_stats.present_histogram[bucket]++;
+    av_sync_stats.presents_timed++;
+    av_sync_stats.present_error_sum += error;
+    if (std::abs(error) > std::abs(av_sync_stats.max_present_error)) {
+        av_sync_stats.max_present_error = error;
     }
 }
 
+//Seconds from now until the vblank the next swap will land on, worked forward from the last swap by whole refresh periods
+static double time_to_next_vblank() {
+    if (!swap_seen) {
+        return display_refresh_period;
+    }
+    double since_swap = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_swap).count();
+    double periods = std::floor(since_swap / display_refresh_period) + 1.0;
+    return periods * display_refresh_period - since_swap;
+}
 
 
+//Function to render the video frames
+//Presents the frame in video_frames whose time best matches the song time at the next vblank (time is the playback clock now), marking stream_ended once the decoder has finished and every frame has been shown
+//A frame due more than half a refresh after that vblank is held and the previous frame is drawn again, and due frames are skipped while a later one is closer to the vblank
+//Nothing here sleeps, the loop is paced by the vsynced swap
+//RGB0 frames go through the standard texture shader and YUV frames go through the YUV shader with their planes in plane_textures
 
+void render_video_frame(unsigned int video_VAO, unsigned int video_texture, int video_shaderProgram, unsigned int plane_textures[3], int yuv_shaderProgram, double time, bool& stream_ended) {
+
+    supply_frame_buffers();
+
+    //Waits on the decoder if it has fallen behind, and if there are no frames left the stream is over
+    //The last frame stays on screen so there is no black gap while the next queued song is switched in
+    Video_Frame frame;
+    if (!video_frames.front(frame)) {
+        stream_ended = true;
+        if (frame_shown) {
+            draw_video_textures(video_VAO, video_texture, video_shaderProgram, plane_textures, yuv_shaderProgram);
+        }
+        return;
+    }
+
+    //Song time when the frame drawn now reaches the screen, and the slack either side of it
+    double speed = playback_speed();
+    double target = time + time_to_next_vblank() * speed;
+    double half_refresh = display_refresh_period * 0.5 * speed;
+
+    //Holds a frame that isn't due by that vblank and shows the previous one again
+    if (frame.timestamp > target + half_refresh) {
+        if (frame_shown) {
+            draw_video_textures(video_VAO, video_texture, video_shaderProgram, plane_textures, yuv_shaderProgram);
+            av_sync_stats.frames_repeated++;
+        }
+        return;
+    }
+
+    //Skips frames while a later due one is closer to the vblank
+    video_frames.pop(frame);
+    Video_Frame next;
+    while (video_frames.size() > 0 && video_frames.front(next) && next.timestamp <= target + half_refresh && std::abs(next.timestamp - target) < std::abs(frame.timestamp - target)) {
+        release_video_frame(frame);
+        av_sync_stats.frames_dropped++;
+        video_frames.pop(frame);
+    }
+
+    upload_video_frame(frame, video_texture, plane_textures);
+    shown_layout = frame.layout;
+    frame_shown = true;
+    draw_video_textures(video_VAO, video_texture, video_shaderProgram, plane_textures, yuv_shaderProgram);
+
+    //The texture has its own copy of the pixels now so the frame buffer can go back to the pool
+    release_video_frame(frame);
+    present_pending = true;
+    pending_present_timestamp = frame.timestamp;
+
+    double offset = target - frame.timestamp;
+    av_sync_stats.frames_presented++;
+    av_sync_stats.offset_sum += offset;
+    if (std::abs(offset) > std::abs(av_sync_stats.max_offset)) {
+        av_sync_stats.max_offset = offset;
+    }
+}
+
+
+void reset_av_sync_stats() {
+    av_sync_stats = { 0, 0, 0, 0.0, 0.0, 0, 0.0, 0.0, { 0 } };
+}
+
+//Prints the last song's average and worst A/V offset along with how many frames were dropped and repeated to stay in sync
+void print_av_sync_stats() {
+    double average_offset = av_sync_stats.frames_presented > 0 ? av_sync_stats.offset_sum / av_sync_stats.frames_presented : 0.0;
+    std::cout << "A/V sync: " << av_sync_stats.frames_presented << " frames presented, " << av_sync_stats.frames_dropped << " dropped, "
+        << av_sync_stats.frames_repeated << " repeated, average offset " << average_offset * 1000.0 << " ms, worst " << av_sync_stats.max_offset * 1000.0 << " ms" << std::endl;
+    if (av_sync_stats.presents_timed > 0) {
+        static const char* BUCKET_NAMES[PRESENT_HISTOGRAM_BUCKETS] = { "<2ms", "<4ms", "<8ms", "<16ms", "<33ms", "more" };
+        std::cout << "Present error: average " << av_sync_stats.present_error_sum / av_sync_stats.presents_timed * 1000.0 << " ms, worst " << av_sync_stats.max_present_error * 1000.0
+            << " ms, refresh " << display_refresh_period * 1000.0 << " ms,";
+        for (int i = 0; i < PRESENT_HISTOGRAM_BUCKETS; i++) {
+            std::cout << " " << BUCKET_NAMES[i] << " " << av_sync_stats.present_histogram[i];
+        }
+        std::cout << std::endl;
+    }
+}
+
+
+void reset_texture_upload_stats() {
+    texture_upload_stats = { 0, 0.0, 0.0, 0, 0, 0, 0, 0 };
+}
+
+//Prints the last song's average and worst upload time and how many frames came straight from the decoder through a pixel buffer
+void print_texture_upload_stats() {
+    if (texture_upload_stats.uploads == 0) {
+        return;
+    }
+    std::cout << "Texture uploads: " << texture_upload_stats.uploads << " frames, " << texture_upload_stats.mapped_uploads << " decoded into " << UPLOAD_BUFFER_COUNT << " pixel buffers, "
+        << texture_upload_stats.pool_uploads << " from pool buffers, average "
+        << texture_upload_stats.upload_seconds / texture_upload_stats.uploads * 1000.0 << " ms, worst " << texture_upload_stats.max_upload_seconds * 1000.0 << " ms, "
+        << texture_upload_stats.buffers_mapped << " buffer maps, " << texture_upload_stats.fence_waits << " fence waits, " << texture_upload_stats.storage_allocations << " storage allocations" << std::endl;
+}
+
+//Called on the render thread once the song's decoder has been stopped. The frames left in the ring go back to the pool, which then gives up its pixel buffers and
+//stops asking for new ones until the next song's decoder configures it, so a song played from the frame cache has none mapped
+//A buffer the pool still has out can't be unmapped under it and is kept
+void release_upload_buffers() {
+    video_frames.reset(VIDEO_RING_CAPACITY);
+    unused_upload_buffers.clear();
+    frame_pool.take_all_mapped(unused_upload_buffers);
+    frame_pool.configure(0, 0, FRAME_RGB0);
+
+    std::vector<Frame_Upload_Buffer> kept;
+    for (Frame_Upload_Buffer& upload : upload_buffers) {
+        if (upload.mapped != NULL && std::find(unused_upload_buffers.begin(), unused_upload_buffers.end(), upload.mapped) == unused_upload_buffers.end()) {
+            kept.push_back(upload);
+            continue;
+        }
+        if (upload.mapped != NULL) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.buffer);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        if (upload.fence != 0) {
+            glDeleteSync(upload.fence);
+        }
+        if (upload.buffer != 0) {
+            glDeleteBuffers(1, &upload.buffer);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    upload_buffers.swap(kept);
+    unused_upload_buffers.clear();
+}
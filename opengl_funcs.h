@@ -2,10 +2,15 @@
 
 #include <iostream>
 #include <map>
+#include <list>
+#include <unordered_map>
 
 //For SQL elements
 #include "sql_work.h"
 
+//For the decoded video frame ring
+#include "decoding_func.h"
+
 //OpenGL libraries
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -24,13 +29,68 @@
 
 
 //Object to handle each individual character's specifics when handling text
+//Every glyph lives in the same atlas texture, AtlasOffset and AtlasSize are where its bitmap is in it (in texture coordinates)
 struct Character {
-    unsigned int TextureID;  // ID handle of the glyph texture
+    unsigned int TextureID;  // ID handle of the glyph atlas texture
     glm::ivec2   Size;       // Size of glyph
     glm::ivec2   Bearing;    // Offset from baseline to left/top of glyph
     signed long Advance;    // Offset to advance to next glyph
+    glm::vec2    AtlasOffset; // Top left of the glyph in the atlas
+    glm::vec2    AtlasSize;   // Size of the glyph in the atlas
+};
+
+//Glyphs are rasterized with FreeType the first time their code point is drawn, into cells of GLYPH_CELL_SIZE pixels in one atlas texture
+//When every cell is taken the least recently used glyph gives up its cell. Code points the first font doesn't have are looked up in the next font of the fallback chain,
+//and ones no font has are drawn with the first font's missing glyph box
+#define GLYPH_CELL_SIZE 64
+
+//Glyph cache counters since the fonts were opened, a lookup is one code point drawn into a newly laid out string
+typedef struct {
+    int64_t lookups;
+    int64_t hits;
+    int64_t rasterized;
+    int64_t evictions;
+    int64_t fallbacks;
+    int64_t missing;
+    double rasterize_seconds;
+} Glyph_Cache_Stats;
+
+class glyph_cache {
+public:
+    bool open(const std::vector<std::string>& font_paths, int pixel_size);
+    void close();
+    bool find(uint32_t code_point, Character& glyph);
+    int64_t generation();
+    void print_stats();
+
+private:
+    //A resident glyph, the cell it's in and its place in the recently used list
+    typedef struct {
+        Character glyph;
+        int cell;
+        std::list<uint32_t>::iterator recent;
+    } Cached_Glyph;
+
+    bool rasterize(uint32_t code_point, Character& glyph);
+    int take_cell();
+
+    FT_Library library = NULL;
+    std::vector<FT_Face> faces;
+    unsigned int atlas_texture = 0;
+    int cells_per_row = 0;
+    std::vector<int> free_cells;
+    std::unordered_map<uint32_t, Cached_Glyph> glyphs;
+    std::list<uint32_t> recently_used;
+    std::vector<uint8_t> cell_pixels;
+    int64_t evicted_generation = 0;
+    Glyph_Cache_Stats counters = { 0, 0, 0, 0, 0, 0, 0.0 };
 };
 
+//UTF-8 helpers, invalid or cut off sequences decode as U+FFFD so a bad song title can't stop the rest of it from being drawn
+uint32_t next_code_point(const std::string& text, size_t& position);
+void append_utf8(std::string& text, uint32_t code_point);
+void pop_utf8(std::string& text);
+
 extern const unsigned int SCR_WIDTH;
 extern const unsigned int SCR_HEIGHT;
 
@@ -39,6 +99,9 @@ extern const unsigned int SCR_HEIGHT;
 extern const char* texture_vertexShaderSource;
 extern const char* texture_fragmentShaderSource;
 
+//Source for video frames uploaded as YUV planes, uses texture_vertexShaderSource as its vertex shader
+extern const char* yuv_fragmentShaderSource;
+
 
 //Sources for text
 extern const char* text_vertexShaderSource;
@@ -50,20 +113,116 @@ int vertex_shader_creator(const char* vertex_source);
 int fragment_shader_creator(const char* fragment_source);
 int shader_program_creator(int vertexShader, int fragmentShader);
 
+//Shader programs are shared by every caller asking for the same pair of sources, and linked programs are saved in SHADER_CACHE_DIRECTORY so later launches load them instead of compiling
+//A saved program is only used by the same driver (vendor, renderer and version) that saved it
+typedef struct {
+    int programs;
+    int shared;
+    int loaded;
+    int compiled;
+    int saved;
+    double seconds;
+} Shader_Stats;
+
+extern const char* SHADER_CACHE_DIRECTORY;
+extern Shader_Stats shader_stats;
+
+//Shader program cache functions, uniform_location() looks each name up from the driver once per program
+int shader_program_from_sources(const char* vertex_source, const char* fragment_source);
+int uniform_location(int shader_program, const char* name);
+void print_shader_stats();
+
 //Generation of components for background, text, and video frame textures
 void background_component_generation(unsigned int& VAO, unsigned int& VBO, unsigned int& EBO, int &shader_program, unsigned int &background_texture);
-std::map<char, Character> text_component_generation(unsigned int& text_VAO, unsigned int& text_VBO,  int& text_shaderProgram);
+void text_component_generation(unsigned int& text_VAO, unsigned int& text_VBO,  int& text_shaderProgram, glyph_cache& characters);
 void video_component_generation(unsigned int& VAO, unsigned int& VBO, unsigned int& EBO, int& shader_program, unsigned int& video_texture,/*uint8_t* video_frame_data,*/ int width, int height);
+void video_plane_texture_generation(int& yuv_shader_program, unsigned int plane_textures[3]);
 
 //Objects and functions for text
-void render_text(std::map<char, Character> characters, std::string text, int text_shader_program, unsigned int text_VAO, unsigned int text_VBO, float x_start, float y_start, float scale, glm::vec3 color);
+void render_text(glyph_cache& characters, const std::string& text, int text_shader_program, unsigned int text_VAO, float x_start, float y_start, float scale, glm::vec3 color);
+
+//Text drawing counters since the program started, a text frame is one pass of the render loop that drew any text
+//Laid out strings are kept in their own vertex buffers between frames, uploads are the strings that had to be laid out again and buffer_bytes is what the kept buffers hold now
+typedef struct {
+    int64_t frames;
+    int64_t text_calls;
+    int64_t draw_calls;
+    int64_t glyphs;
+    double cpu_seconds;
+    int64_t cache_hits;
+    int64_t cache_misses;
+    int64_t uploads;
+    int64_t cached_strings;
+    int64_t buffer_bytes;
+} Text_Render_Stats;
+
+extern Text_Render_Stats text_render_stats;
+
+void end_text_frame();
+void print_text_render_stats();
 
 //Function to render background
 void render_background(unsigned int VAO, unsigned int background_texture, int shaderProgram);
 
+//Present errors are sorted by how far the frame's time was from the playback clock when the swap showing it returned: under 2, 4, 8, 16 and 33 ms, and the last bucket for anything further
+#define PRESENT_HISTOGRAM_BUCKETS 6
+
+//A/V sync counters for the current song, offsets are the song time at the predicted vblank minus frame time when each frame was picked (positive means the frame was late)
+//Present errors are measured again after the swap, against the playback clock at the moment the frame actually went up
+typedef struct {
+    int64_t frames_presented;
+    int64_t frames_dropped;
+    int64_t frames_repeated;
+    double offset_sum;
+    double max_offset;
+    int64_t presents_timed;
+    double present_error_sum;
+    double max_present_error;
+    int64_t present_histogram[PRESENT_HISTOGRAM_BUCKETS];
+} AV_Sync_Stats;
+
+extern AV_Sync_Stats av_sync_stats;
+
+//Time between vblanks, seeded from the monitor's refresh rate and then followed from the swap timestamps
+extern double display_refresh_period;
+
+void reset_av_sync_stats();
+void print_av_sync_stats();
+
+//Frame pacing functions, start_frame_pacing() turns on vsync and record_buffer_swap() is called right after every glfwSwapBuffers()
+void start_frame_pacing();
+void record_buffer_swap();
+
+//Video frames are decoded straight into pixel buffer objects that the render thread keeps mapped and lends to the frame pool, so uploading a frame is only unmapping its buffer and queueing glTexSubImage2D from it
+//There are UPLOAD_BUFFER_COUNT of them, a fence is set after each upload and a buffer is only mapped again once the GPU has passed it
+//Frames decoded while no mapped buffer was free go into ordinary pool buffers, and those and frames mapped from the frame cache are uploaded straight from memory
+//release_upload_buffers() unmaps and deletes them when a song is closed
+#define UPLOAD_BUFFER_COUNT 3
+
+//Texture upload counters for the current song, upload time is the render thread's time from unmapping a buffer to queueing the upload
+//Mapped uploads are frames the decoder wrote into a pixel buffer, pool uploads are decoded frames that had to go into a pool buffer because no pixel buffer was free
+//Fence waits are the times a buffer couldn't be mapped again because the GPU hadn't finished uploading from it, buffers mapped is how many times a buffer was mapped and lent to the pool
+typedef struct {
+    int64_t uploads;
+    double upload_seconds;
+    double max_upload_seconds;
+    int64_t mapped_uploads;
+    int64_t pool_uploads;
+    int64_t fence_waits;
+    int64_t buffers_mapped;
+    int64_t storage_allocations;
+} Texture_Upload_Stats;
+
+extern Texture_Upload_Stats texture_upload_stats;
+
+void reset_texture_upload_stats();
+void print_texture_upload_stats();
+void release_upload_buffers();
+
 //Function to render video frames
-void render_video_frame(unsigned int video_VAO, unsigned int video_texture, int video_shaderProgram, std::map<double, uint8_t*>::iterator frame_iterator, std::map<double, uint8_t*>::iterator frame_iterator_end, double time, int width, int height, bool stream_ended);
+void render_video_frame(unsigned int video_VAO, unsigned int video_texture, int video_shaderProgram, unsigned int plane_textures[3], int yuv_shaderProgram, double time, bool& stream_ended);
+void render_held_video_frame(unsigned int video_VAO, unsigned int video_texture, int video_shaderProgram, unsigned int plane_textures[3], int yuv_shaderProgram);
 
 //Song printing function
-void print_songs(std::vector<Row> songs, const unsigned int screen_width, const unsigned int screen_height, std::map<char, Character> characters, int text_shader_program, unsigned int text_VAO, unsigned int text_VBO);
+void print_songs(std::vector<Row> songs, const unsigned int screen_width, const unsigned int screen_height, glyph_cache& characters, int text_shader_program, unsigned int text_VAO);
 
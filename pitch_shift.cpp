@@ -0,0 +1,259 @@
+#include "pitch_shift.h"
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+
+//Length of a WSOLA hop and how far either side of the ideal position a segment is searched for, in seconds
+//15ms hops are short enough not to smear the voice and the 6ms search covers a full period of anything above about 170Hz
+static const double HOP_SECONDS = 0.015;
+static const double SEARCH_SECONDS = 0.006;
+
+//The search looks at every fourth candidate first and then at the ones around the best of those
+static const int COARSE_STEP = 4;
+
+
+//Sizes the hops for the output rate and clears everything carried between blocks, called once before each song's audio is decoded
+void pitch_tempo_stage::configure(int sample_rate) {
+    rate = sample_rate;
+    hop = (int)(sample_rate * HOP_SECONDS);
+    search = (int)(sample_rate * SEARCH_SECONDS);
+
+    //The crossfade weights go from the old segment to the new one over a hop, one weight per interleaved sample
+    ramp.resize((size_t)hop * AUDIO_CHANNELS);
+    for (int i = 0; i < hop; i++) {
+        for (int channel = 0; channel < AUDIO_CHANNELS; channel++) {
+            ramp[(size_t)i * AUDIO_CHANNELS + channel] = (float)i / hop;
+        }
+    }
+
+    input.clear();
+    input_time = 0.0;
+    timed = false;
+    analysis_position = 0.0;
+    previous_segment = -1;
+    stretched.clear();
+    stretched_start = 0;
+    resample_position = 1.0;
+    marks.clear();
+    counters = { 0, 0, 0, 0.0, 0.0 };
+}
+
+
+//Semitones move the key without changing the speed and tempo changes the speed without changing the key, they can be changed between any two blocks
+void pitch_tempo_stage::set_shift(int semitones, double tempo) {
+    pitch_ratio = pow(2.0, semitones / 12.0);
+    tempo_ratio = tempo;
+    stretch = pitch_ratio / tempo_ratio;
+}
+
+bool pitch_tempo_stage::is_neutral() {
+    return pitch_ratio == 1.0 && tempo_ratio == 1.0;
+}
+
+//How many seconds of the song play per second of output
+double pitch_tempo_stage::tempo() {
+    return tempo_ratio;
+}
+
+
+//Adds a block of interleaved frames that start at input_time (only used for the first block, after that the input is taken to carry straight on)
+//output is replaced with however many frames are ready, which for the first few blocks can be none, and output_time is set to the song time of the first of them
+//Returns the number of frames in output
+int pitch_tempo_stage::process(const float* samples, int frames, double time, std::vector<float>& output, double& output_time) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (!timed) {
+        input_time = time;
+        timed = true;
+    }
+    input.insert(input.end(), samples, samples + (size_t)frames * AUDIO_CHANNELS);
+    stretch_hops();
+    int produced = resample(output, output_time);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    counters.blocks++;
+    counters.input_frames += frames;
+    counters.output_frames += produced;
+    counters.process_seconds += seconds;
+    counters.max_block_seconds = std::max(counters.max_block_seconds, seconds);
+    return produced;
+}
+
+
+//Pushes the input still waiting for a full hop through at the end of the song by padding it with silence, and cuts the output off where the song's audio ends
+int pitch_tempo_stage::drain(std::vector<float>& output, double& output_time) {
+    if (!timed) {
+        output.clear();
+        return 0;
+    }
+    double end_time = input_time + input.size() / AUDIO_CHANNELS / (double)rate;
+    std::vector<float> silence((size_t)(hop * 3 + search * 2) * AUDIO_CHANNELS, 0.0f);
+    int produced = process(silence.data(), (int)(silence.size() / AUDIO_CHANNELS), input_time, output, output_time);
+    counters.input_frames -= (int64_t)(silence.size() / AUDIO_CHANNELS);
+
+    int keep = produced > 0 ? (int)((end_time - output_time) * rate / tempo_ratio) : 0;
+    keep = std::max(0, std::min(keep, produced));
+    output.resize((size_t)keep * AUDIO_CHANNELS);
+    counters.output_frames -= produced - keep;
+    return keep;
+}
+
+
+Pitch_Stage_Stats pitch_tempo_stage::stats() {
+    return counters;
+}
+
+
+//Stretches as many hops as the input allows. Each hop picks the segment near the ideal analysis position that correlates best with how the previous segment carried on,
+//and crossfades from that continuation into it, so the waveforms line up where they overlap and the joins don't click or phase
+void pitch_tempo_stage::stretch_hops() {
+    int available = (int)(input.size() / AUDIO_CHANNELS);
+    int length = hop * AUDIO_CHANNELS;
+
+    while (true) {
+        int ideal = (int)(analysis_position + 0.5);
+        int chosen = ideal;
+        size_t at = stretched.size();
+
+        if (previous_segment < 0) {
+            if (ideal + hop > available) {
+                break;
+            }
+            stretched.insert(stretched.end(), input.data() + (size_t)ideal * AUDIO_CHANNELS, input.data() + (size_t)(ideal + hop) * AUDIO_CHANNELS);
+        }
+        else {
+            int continuation = previous_segment + hop;
+            if (continuation + hop > available || ideal + search + hop > available) {
+                break;
+            }
+
+            //Correlation is divided by the candidate's level so loud segments don't win just for being loud
+            const float* target = &input[(size_t)continuation * AUDIO_CHANNELS];
+            auto similarity = [&](int candidate) {
+                const float* segment = &input[(size_t)candidate * AUDIO_CHANNELS];
+                float correlation = audio_kernels.dot_product(target, segment, length);
+                float energy = audio_kernels.dot_product(segment, segment, length);
+                return correlation / sqrtf(energy + 1e-9f);
+            };
+            int low = std::max(ideal - search, 0);
+            int high = ideal + search;
+            float best_score = similarity(low);
+            chosen = low;
+            for (int candidate = low + COARSE_STEP; candidate <= high; candidate += COARSE_STEP) {
+                float score = similarity(candidate);
+                if (score > best_score) {
+                    best_score = score;
+                    chosen = candidate;
+                }
+            }
+            int coarse = chosen;
+            for (int candidate = std::max(coarse - COARSE_STEP + 1, low); candidate < std::min(coarse + COARSE_STEP, high + 1); candidate++) {
+                if (candidate == coarse) {
+                    continue;
+                }
+                float score = similarity(candidate);
+                if (score > best_score) {
+                    best_score = score;
+                    chosen = candidate;
+                }
+            }
+
+            stretched.resize(at + length);
+            audio_kernels.crossfade(target, &input[(size_t)chosen * AUDIO_CHANNELS], ramp.data(), &stretched[at], length);
+        }
+
+        marks.push_back({ stretched_start + (int64_t)(at / AUDIO_CHANNELS), input_time + analysis_position / rate, stretch });
+        previous_segment = chosen;
+        analysis_position += hop / stretch;
+    }
+
+    //Input before both the next continuation and the next search window won't be looked at again
+    if (previous_segment >= 0) {
+        int keep_from = std::min(previous_segment + hop, (int)analysis_position - search);
+        if (keep_from > 0) {
+            input.erase(input.begin(), input.begin() + (size_t)keep_from * AUDIO_CHANNELS);
+            previous_segment -= keep_from;
+            analysis_position -= keep_from;
+            input_time += keep_from / (double)rate;
+        }
+    }
+}
+
+
+//Reads the stretched audio pitch_ratio frames at a time with cubic (Catmull-Rom) interpolation, which needs one frame before and two after each read position
+int pitch_tempo_stage::resample(std::vector<float>& output, double& output_time) {
+    output.clear();
+    int64_t stretched_end = stretched_start + (int64_t)(stretched.size() / AUDIO_CHANNELS);
+    if (marks.empty() || (int64_t)resample_position + 2 >= stretched_end) {
+        return 0;
+    }
+
+    //Song time of the first output frame, from the newest mark it has reached
+    while (marks.size() > 1 && marks[1].position <= resample_position) {
+        marks.pop_front();
+    }
+    output_time = marks[0].timestamp + (resample_position - marks[0].position) / (rate * marks[0].stretch);
+
+    output.reserve((size_t)((stretched_end - resample_position) / pitch_ratio + 1) * AUDIO_CHANNELS);
+    while ((int64_t)resample_position + 2 < stretched_end) {
+        int64_t base = (int64_t)resample_position;
+        float t = (float)(resample_position - base);
+        const float* points = &stretched[(size_t)(base - 1 - stretched_start) * AUDIO_CHANNELS];
+        for (int channel = 0; channel < AUDIO_CHANNELS; channel++) {
+            float y0 = points[channel];
+            float y1 = points[AUDIO_CHANNELS + channel];
+            float y2 = points[AUDIO_CHANNELS * 2 + channel];
+            float y3 = points[AUDIO_CHANNELS * 3 + channel];
+            float a = -0.5f * y0 + 1.5f * y1 - 1.5f * y2 + 0.5f * y3;
+            float b = y0 - 2.5f * y1 + 2.0f * y2 - 0.5f * y3;
+            float c = -0.5f * y0 + 0.5f * y2;
+            output.push_back(((a * t + b) * t + c) * t + y1);
+        }
+        resample_position += pitch_ratio;
+    }
+
+    //Keeps the frame before the next read position
+    int64_t drop = (int64_t)resample_position - 1 - stretched_start;
+    if (drop > 0) {
+        stretched.erase(stretched.begin(), stretched.begin() + (size_t)drop * AUDIO_CHANNELS);
+        stretched_start += drop;
+    }
+    return (int)(output.size() / AUDIO_CHANNELS);
+}
+
+
+//****************************************************************************************************************
+//****************************************************************************************************************
+//
+//Benchmark
+
+
+//Runs 10 seconds of a two tone test signal through the stage in blocks the size of a typical decoded frame
+void benchmark_pitch_stage() {
+    const int rate = 48000;
+    const int seconds = 10;
+    const int block = 1024;
+    std::vector<float> signal((size_t)rate * seconds * AUDIO_CHANNELS);
+    for (int i = 0; i < rate * seconds; i++) {
+        signal[(size_t)i * AUDIO_CHANNELS] = 0.4f * sinf(i * 2.0f * 3.14159265f * 220.0f / rate);
+        signal[(size_t)i * AUDIO_CHANNELS + 1] = 0.4f * sinf(i * 2.0f * 3.14159265f * 330.0f / rate);
+    }
+
+    const int settings[][2] = { { 3, 100 }, { -5, 100 }, { 0, 80 }, { 2, 125 } };
+    std::vector<float> output;
+    for (const int* setting : settings) {
+        pitch_tempo_stage stage;
+        stage.configure(rate);
+        stage.set_shift(setting[0], setting[1] / 100.0);
+        double output_time;
+        for (int i = 0; i + block <= rate * seconds; i += block) {
+            stage.process(&signal[(size_t)i * AUDIO_CHANNELS], block, i / (double)rate, output, output_time);
+        }
+        Pitch_Stage_Stats stats = stage.stats();
+        std::cout << "Pitch stage (" << audio_kernels.name << "), key " << setting[0] << ", tempo " << setting[1] << "%: "
+            << stats.process_seconds / stats.blocks * 1e6 << " us per block, worst " << stats.max_block_seconds * 1e6 << " us, "
+            << (stats.input_frames / (double)rate) / stats.process_seconds << "x real time" << std::endl;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "audio_dsp.h"
+#include "decoding_func.h"
+
+#include <vector>
+#include <deque>
+
+
+//Key and tempo stage that runs on the audio decoder thread, between interleaving and the audio sample ring
+//The audio is first stretched in time with WSOLA (waveform similarity overlap-add): every hop the input segment that best lines up with how the last one carried on is found by cross-correlation and crossfaded in
+//The stretched audio is then resampled by the pitch ratio, which brings the length back to what the tempo asks for and moves the key by the number of semitones
+//The correlation search and the crossfades use the SIMD kernels from audio_dsp, the cubic resampler is a plain loop
+
+//Cost of the stage, one block is one call to process()
+typedef struct {
+    int64_t blocks;
+    int64_t input_frames;
+    int64_t output_frames;
+    double process_seconds;
+    double max_block_seconds;
+} Pitch_Stage_Stats;
+
+//Stretch_Mark object ties a position in the stretched audio to the song time it came from, and how many stretched frames there are per input frame from there on
+typedef struct {
+    int64_t position;
+    double timestamp;
+    double stretch;
+} Stretch_Mark;
+
+class pitch_tempo_stage {
+public:
+    void configure(int sample_rate);
+    void set_shift(int semitones, double tempo);
+    bool is_neutral();
+    double tempo();
+    int process(const float* input, int frames, double input_time, std::vector<float>& output, double& output_time);
+    int drain(std::vector<float>& output, double& output_time);
+    Pitch_Stage_Stats stats();
+
+private:
+    void stretch_hops();
+    int resample(std::vector<float>& output, double& output_time);
+
+    int rate = 44100;
+    int hop = 0;
+    int search = 0;
+    std::vector<float> ramp;
+
+    double pitch_ratio = 1.0;
+    double tempo_ratio = 1.0;
+    double stretch = 1.0;
+
+    //Input frames that haven't been stretched yet, the first one is at input_time
+    std::vector<float> input;
+    double input_time = 0.0;
+    bool timed = false;
+    double analysis_position = 0.0;
+    int previous_segment = -1;
+
+    //Stretched frames that haven't been resampled yet, the first one is stretched_start frames into the stretched audio
+    std::vector<float> stretched;
+    int64_t stretched_start = 0;
+    double resample_position = 0.0;
+    std::deque<Stretch_Mark> marks;
+
+    Pitch_Stage_Stats counters = { 0, 0, 0, 0.0, 0.0 };
+};
+
+//Times the stage at a few key and tempo settings and prints how many times faster than real time it runs on one core
+void benchmark_pitch_stage();
@@ -17,3 +17,49 @@ std::vector<Row> song_query(string& song, Session& sql_session) {
     return query_result.fetchAll();
 }
 
+
+
+//song_loudness looks up the loudness stored for a song, returns false if it hasn't been measured yet (or the table doesn't have the loudness columns)
+bool song_loudness(const std::string& song_path, double& integrated_lufs, double& true_peak_dbtp, Session& sql_session) {
+    try {
+        auto query_result = sql_session.sql("SELECT loudness_lufs, true_peak_dbtp FROM song_list WHERE song_path = ? LIMIT 1;").bind(song_path).execute();
+        Row row = query_result.fetchOne();
+        if (row.isNull() || row[0].isNull() || row[1].isNull()) {
+            return false;
+        }
+        integrated_lufs = (double)row[0];
+        true_peak_dbtp = (double)row[1];
+        return true;
+    }
+    catch (const std::exception& error) {
+        std::cout << "Couldn't look up loudness: " << error.what() << std::endl;
+        return false;
+    }
+}
+
+//store_song_loudness saves a song's measured loudness in its row so it is only ever analyzed once
+bool store_song_loudness(const std::string& song_path, double integrated_lufs, double true_peak_dbtp, Session& sql_session) {
+    try {
+        sql_session.sql("UPDATE song_list SET loudness_lufs = ?, true_peak_dbtp = ? WHERE song_path = ?;").bind(integrated_lufs).bind(true_peak_dbtp).bind(song_path).execute();
+        return true;
+    }
+    catch (const std::exception& error) {
+        std::cout << "Couldn't store loudness: " << error.what() << std::endl;
+        return false;
+    }
+}
+
+//songs_without_loudness returns the file of every song that hasn't been measured, for a full library pass
+std::vector<std::string> songs_without_loudness(Session& sql_session) {
+    std::vector<std::string> songs;
+    try {
+        auto query_result = sql_session.sql("SELECT song_path FROM song_list WHERE loudness_lufs IS NULL;").execute();
+        for (Row& row : query_result.fetchAll()) {
+            songs.push_back((std::string)row[0]);
+        }
+    }
+    catch (const std::exception& error) {
+        std::cout << "Couldn't list songs: " << error.what() << std::endl;
+    }
+    return songs;
+}
@@ -8,4 +8,9 @@ using namespace ::mysqlx;
 
 extern Session my_session;
 
-std::vector<Row> song_query(string& song, Session& sql_session);
\ No newline at end of file
+std::vector<Row> song_query(string& song, Session& sql_session);
+
+//Loudness is stored in the song's row in the loudness_lufs and true_peak_dbtp columns, found by the file's song_path
+bool song_loudness(const std::string& song_path, double& integrated_lufs, double& true_peak_dbtp, Session& sql_session);
+bool store_song_loudness(const std::string& song_path, double integrated_lufs, double true_peak_dbtp, Session& sql_session);
+std::vector<std::string> songs_without_loudness(Session& sql_session);